@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+# benchmark runner: builds an optimized clox (with every debug option off, see DebugFlags in vm.h), runs every benchmark
+# a few times and prints one result per benchmark to stdout, as JSON lines (default) or CSV
+#
+#   python3 bench/run.py                    all of them, 5 runs each
+#   python3 bench/run.py -n 10 fib zoo      just these two, 10 runs each
+#   python3 bench/run.py --vm ./clox_old    measure another build instead (it needs --gc-stats)
+#
+# each benchmark prints one value, checked against the "// expect:" comment on its print statement
+# an untimed first run checks it and writes the benchmark's .loxc cache, so the timed ones all start from the cache
+# wall time is the median of the timed runs, the GC figures come from clox --gc-stats (pause times are wall time)
+
+import argparse
+import csv
+import glob
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT_DIR = os.path.dirname(BENCH_DIR)
+
+FIELDS = ["benchmark", "runs", "wall_median_s", "wall_min_s", "wall_max_s", "bytes_allocated",
+          "minor_collections", "full_collections", "pauses", "pause_total_ms", "pause_max_ms"]
+
+
+def build(cc, flags):
+    out_dir = os.path.join(BENCH_DIR, "build")
+    os.makedirs(out_dir, exist_ok=True)
+    vm = os.path.join(out_dir, "clox.exe" if os.name == "nt" else "clox")
+    sources = sorted(glob.glob(os.path.join(ROOT_DIR, "*.c")))
+    libs = ["-lm"] if os.name == "nt" else ["-lm", "-pthread"]      # the parallel marker, see GC_PARALLEL_MARK in common.h
+    command = [cc, "-o", vm, "-std=c99"] + flags.split() + sources + libs
+    print("building: " + " ".join(command), file=sys.stderr)
+    subprocess.run(command, check=True)
+    return vm
+
+
+def expected_output(path):
+    with open(path) as file:
+        match = re.search(r"//\s*expect:\s*(.*)", file.read())
+    return match.group(1).strip() if match else None
+
+
+# runs the benchmark once, returns (wall seconds, gc stats)
+def run_once(vm, path):
+    start = time.perf_counter()
+    result = subprocess.run([vm, "--gc-stats", path], capture_output=True, text=True)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        raise RuntimeError("%s exited with %d:\n%s" % (path, result.returncode, result.stderr))
+    stats = json.loads(result.stderr.strip().splitlines()[-1])      # --gc-stats prints the last line
+    return wall, stats, result.stdout.strip()
+
+
+def run_benchmark(vm, path, runs):
+    name = os.path.splitext(os.path.basename(path))[0]
+    expected = expected_output(path)
+    _, _, output = run_once(vm, path)
+    if expected is not None and output != expected:
+        raise RuntimeError("%s printed %r, expected %r" % (name, output, expected))
+
+    walls = []
+    samples = []
+    for _ in range(runs):
+        wall, stats, _ = run_once(vm, path)
+        walls.append(wall)
+        samples.append(stats)
+
+    # the allocation and collection counts don't change from run to run, the pauses do
+    stats = samples[0]
+    return {
+        "benchmark": name,
+        "runs": runs,
+        "wall_median_s": round(statistics.median(walls), 4),
+        "wall_min_s": round(min(walls), 4),
+        "wall_max_s": round(max(walls), 4),
+        "bytes_allocated": stats["bytes_allocated"],
+        "minor_collections": stats["minor_collections"],
+        "full_collections": stats["full_collections"],
+        "pauses": stats["pauses"],
+        "pause_total_ms": round(statistics.median(s["pause_total_ms"] for s in samples), 3),
+        "pause_max_ms": round(max(s["pause_max_ms"] for s in samples), 3),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run the clox benchmarks.")
+    parser.add_argument("benchmarks", nargs="*", help="names of the benchmarks to run (default: all of them)")
+    parser.add_argument("-n", "--runs", type=int, default=5, help="timed runs of each benchmark (default: 5)")
+    parser.add_argument("--vm", help="clox binary to measure, instead of building one")
+    parser.add_argument("--cc", default=os.environ.get("CC", "gcc"), help="C compiler (default: $CC or gcc)")
+    parser.add_argument("--cflags", default="-O2", help="extra compiler flags (default: -O2)")
+    parser.add_argument("--format", choices=["json", "csv"], default="json", help="output format (default: json)")
+    args = parser.parse_args()
+
+    paths = sorted(glob.glob(os.path.join(BENCH_DIR, "*.lox")))
+    if args.benchmarks:
+        names = {os.path.splitext(os.path.basename(p))[0]: p for p in paths}
+        unknown = [b for b in args.benchmarks if b not in names]
+        if unknown:
+            parser.error("unknown benchmark(s): " + ", ".join(unknown))
+        paths = [names[b] for b in args.benchmarks]
+
+    vm = os.path.abspath(args.vm) if args.vm else build(args.cc, args.cflags)
+
+    writer = None
+    if args.format == "csv":
+        writer = csv.DictWriter(sys.stdout, fieldnames=FIELDS)
+        writer.writeheader()
+
+    failed = False
+    for path in paths:
+        try:
+            result = run_benchmark(vm, path, args.runs)
+        except RuntimeError as error:
+            print(error, file=sys.stderr)
+            failed = True
+            continue
+        finally:
+            cache = os.path.splitext(path)[0] + ".loxc"
+            if os.path.exists(cache):
+                os.remove(cache)
+        if writer:
+            writer.writerow(result)
+        else:
+            print(json.dumps(result))
+        sys.stdout.flush()
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
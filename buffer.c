@@ -0,0 +1,319 @@
+#include <string.h>
+
+#include "buffer.h"
+
+// AVX2 kernels get compiled for it function by function (so the rest of the build needs no -mavx2) and only run when the
+// CPU turns out to have it, NEON is part of every AArch64 CPU so those always run there
+#if !defined(BUFFER_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BUFFER_AVX2
+#elif !defined(BUFFER_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define BUFFER_NEON
+#endif
+
+// the comparisons min and max make, written the way MINPD/MAXPD work: when they're equal (or x is NaN) acc stays
+#define MIN_OF(acc, x) ((x) < (acc) ? (x) : (acc))
+#define MAX_OF(acc, x) ((x) > (acc) ? (x) : (acc))
+
+// the *Blocks kernels take the elements in [start, end), a whole number of BUFFER_LANES wide blocks,
+// and fold element i into lanes[i % BUFFER_LANES]
+// the others do the whole array, the SIMD ones finish the last few elements one at a time
+
+static void sumBlocksScalar(double* lanes, const double* values, int start, int end) {
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int k = 0; k < BUFFER_LANES; k++) lanes[k] += values[i + k];
+    }
+}
+
+static void dotBlocksScalar(double* lanes, const double* a, const double* b, int start, int end) {
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int k = 0; k < BUFFER_LANES; k++) lanes[k] += a[i + k] * b[i + k];
+    }
+}
+
+static void minBlocksScalar(double* lanes, const double* values, int start, int end) {
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int k = 0; k < BUFFER_LANES; k++) lanes[k] = MIN_OF(lanes[k], values[i + k]);
+    }
+}
+
+static void maxBlocksScalar(double* lanes, const double* values, int start, int end) {
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int k = 0; k < BUFFER_LANES; k++) lanes[k] = MAX_OF(lanes[k], values[i + k]);
+    }
+}
+
+static void scaleScalar(double* values, int count, double factor) {
+    for (int i = 0; i < count; i++) values[i] *= factor;
+}
+
+static void addScalar(double* to, const double* from, int count) {
+    for (int i = 0; i < count; i++) to[i] += from[i];
+}
+
+static void mulScalar(double* to, const double* from, int count) {
+    for (int i = 0; i < count; i++) to[i] *= from[i];
+}
+
+static void fillScalar(double* values, int count, double value) {
+    for (int i = 0; i < count; i++) values[i] = value;
+}
+
+#if defined(BUFFER_AVX2)
+
+// four registers of four doubles hold the sixteen lanes
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void sumBlocksAvx2(double* lanes, const double* values, int start, int end) {
+    __m256d acc[4];
+    for (int j = 0; j < 4; j++) acc[j] = _mm256_loadu_pd(lanes + 4 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 4; j++) acc[j] = _mm256_add_pd(acc[j], _mm256_loadu_pd(values + i + 4 * j));
+    }
+    for (int j = 0; j < 4; j++) _mm256_storeu_pd(lanes + 4 * j, acc[j]);
+}
+
+// a separate multiply and add (no FMA), so the products get rounded just like the scalar version rounds them
+AVX2 static void dotBlocksAvx2(double* lanes, const double* a, const double* b, int start, int end) {
+    __m256d acc[4];
+    for (int j = 0; j < 4; j++) acc[j] = _mm256_loadu_pd(lanes + 4 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 4; j++) {
+            __m256d product = _mm256_mul_pd(_mm256_loadu_pd(a + i + 4 * j), _mm256_loadu_pd(b + i + 4 * j));
+            acc[j] = _mm256_add_pd(acc[j], product);
+        }
+    }
+    for (int j = 0; j < 4; j++) _mm256_storeu_pd(lanes + 4 * j, acc[j]);
+}
+
+// _mm256_min_pd(x, acc) is x < acc ? x : acc, i.e. MIN_OF(acc, x)
+AVX2 static void minBlocksAvx2(double* lanes, const double* values, int start, int end) {
+    __m256d acc[4];
+    for (int j = 0; j < 4; j++) acc[j] = _mm256_loadu_pd(lanes + 4 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 4; j++) acc[j] = _mm256_min_pd(_mm256_loadu_pd(values + i + 4 * j), acc[j]);
+    }
+    for (int j = 0; j < 4; j++) _mm256_storeu_pd(lanes + 4 * j, acc[j]);
+}
+
+AVX2 static void maxBlocksAvx2(double* lanes, const double* values, int start, int end) {
+    __m256d acc[4];
+    for (int j = 0; j < 4; j++) acc[j] = _mm256_loadu_pd(lanes + 4 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 4; j++) acc[j] = _mm256_max_pd(_mm256_loadu_pd(values + i + 4 * j), acc[j]);
+    }
+    for (int j = 0; j < 4; j++) _mm256_storeu_pd(lanes + 4 * j, acc[j]);
+}
+
+AVX2 static void scaleAvx2(double* values, int count, double factor) {
+    __m256d by = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), by));
+    for (; i < count; i++) values[i] *= factor;
+}
+
+AVX2 static void addAvx2(double* to, const double* from, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(to + i, _mm256_add_pd(_mm256_loadu_pd(to + i), _mm256_loadu_pd(from + i)));
+    for (; i < count; i++) to[i] += from[i];
+}
+
+AVX2 static void mulAvx2(double* to, const double* from, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(to + i, _mm256_mul_pd(_mm256_loadu_pd(to + i), _mm256_loadu_pd(from + i)));
+    for (; i < count; i++) to[i] *= from[i];
+}
+
+AVX2 static void fillAvx2(double* values, int count, double value) {
+    __m256d with = _mm256_set1_pd(value);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) _mm256_storeu_pd(values + i, with);
+    for (; i < count; i++) values[i] = value;
+}
+
+// the runtime library looks the CPU up once at startup, so this is just a load (that any thread can do)
+static bool hasAvx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#define USE_SIMD()      hasAvx2()
+#define KERNEL(name)    name##Avx2
+
+#elif defined(BUFFER_NEON)
+
+// eight registers of two doubles hold the sixteen lanes
+static void sumBlocksNeon(double* lanes, const double* values, int start, int end) {
+    float64x2_t acc[8];
+    for (int j = 0; j < 8; j++) acc[j] = vld1q_f64(lanes + 2 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 8; j++) acc[j] = vaddq_f64(acc[j], vld1q_f64(values + i + 2 * j));
+    }
+    for (int j = 0; j < 8; j++) vst1q_f64(lanes + 2 * j, acc[j]);
+}
+
+// vmulq and vaddq rather than vfmaq, so the products get rounded just like the scalar version rounds them
+static void dotBlocksNeon(double* lanes, const double* a, const double* b, int start, int end) {
+    float64x2_t acc[8];
+    for (int j = 0; j < 8; j++) acc[j] = vld1q_f64(lanes + 2 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 8; j++) {
+            float64x2_t product = vmulq_f64(vld1q_f64(a + i + 2 * j), vld1q_f64(b + i + 2 * j));
+            acc[j] = vaddq_f64(acc[j], product);
+        }
+    }
+    for (int j = 0; j < 8; j++) vst1q_f64(lanes + 2 * j, acc[j]);
+}
+
+// vminq/vmaxq treat NaN and signed zeros differently from MIN_OF/MAX_OF, so compare and select instead
+static void minBlocksNeon(double* lanes, const double* values, int start, int end) {
+    float64x2_t acc[8];
+    for (int j = 0; j < 8; j++) acc[j] = vld1q_f64(lanes + 2 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 8; j++) {
+            float64x2_t x = vld1q_f64(values + i + 2 * j);
+            acc[j] = vbslq_f64(vcltq_f64(x, acc[j]), x, acc[j]);
+        }
+    }
+    for (int j = 0; j < 8; j++) vst1q_f64(lanes + 2 * j, acc[j]);
+}
+
+static void maxBlocksNeon(double* lanes, const double* values, int start, int end) {
+    float64x2_t acc[8];
+    for (int j = 0; j < 8; j++) acc[j] = vld1q_f64(lanes + 2 * j);
+    for (int i = start; i < end; i += BUFFER_LANES) {
+        for (int j = 0; j < 8; j++) {
+            float64x2_t x = vld1q_f64(values + i + 2 * j);
+            acc[j] = vbslq_f64(vcgtq_f64(x, acc[j]), x, acc[j]);
+        }
+    }
+    for (int j = 0; j < 8; j++) vst1q_f64(lanes + 2 * j, acc[j]);
+}
+
+static void scaleNeon(double* values, int count, double factor) {
+    float64x2_t by = vdupq_n_f64(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) vst1q_f64(values + i, vmulq_f64(vld1q_f64(values + i), by));
+    for (; i < count; i++) values[i] *= factor;
+}
+
+static void addNeon(double* to, const double* from, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) vst1q_f64(to + i, vaddq_f64(vld1q_f64(to + i), vld1q_f64(from + i)));
+    for (; i < count; i++) to[i] += from[i];
+}
+
+static void mulNeon(double* to, const double* from, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) vst1q_f64(to + i, vmulq_f64(vld1q_f64(to + i), vld1q_f64(from + i)));
+    for (; i < count; i++) to[i] *= from[i];
+}
+
+static void fillNeon(double* values, int count, double value) {
+    float64x2_t with = vdupq_n_f64(value);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) vst1q_f64(values + i, with);
+    for (; i < count; i++) values[i] = value;
+}
+
+#define USE_SIMD()      true
+#define KERNEL(name)    name##Neon
+
+#else
+
+#define USE_SIMD()      false
+#define KERNEL(name)    name##Scalar
+
+#endif
+
+// where the last whole block ends, the few elements after it get done one at a time
+static int blockEnd(int count) {
+    return count - count % BUFFER_LANES;
+}
+
+// combines the lanes pairwise, 8 apart, then 4 apart and so on down to lanes[0]
+static double sumLanes(double* lanes) {
+    for (int width = BUFFER_LANES / 2; width > 0; width /= 2) {
+        for (int k = 0; k < width; k++) lanes[k] += lanes[k + width];
+    }
+    return lanes[0];
+}
+
+double bufferSum(const double* values, int count) {
+    double lanes[BUFFER_LANES] = {0};
+    int end = blockEnd(count);
+    if (USE_SIMD()) KERNEL(sumBlocks)(lanes, values, 0, end);
+    else sumBlocksScalar(lanes, values, 0, end);
+
+    double total = sumLanes(lanes);
+    for (int i = end; i < count; i++) total += values[i];
+    return total;
+}
+
+double bufferDot(const double* a, const double* b, int count) {
+    double lanes[BUFFER_LANES] = {0};
+    int end = blockEnd(count);
+    if (USE_SIMD()) KERNEL(dotBlocks)(lanes, a, b, 0, end);
+    else dotBlocksScalar(lanes, a, b, 0, end);
+
+    double total = sumLanes(lanes);
+    for (int i = end; i < count; i++) total += a[i] * b[i];
+    return total;
+}
+
+// the first block starts the lanes off, an array shorter than one block is just scanned
+double bufferMin(const double* values, int count) {
+    double result = values[0];
+    int end = blockEnd(count);
+    if (end > 0) {
+        double lanes[BUFFER_LANES];
+        memcpy(lanes, values, sizeof(lanes));
+        if (USE_SIMD()) KERNEL(minBlocks)(lanes, values, BUFFER_LANES, end);
+        else minBlocksScalar(lanes, values, BUFFER_LANES, end);
+
+        for (int width = BUFFER_LANES / 2; width > 0; width /= 2) {
+            for (int k = 0; k < width; k++) lanes[k] = MIN_OF(lanes[k], lanes[k + width]);
+        }
+        result = lanes[0];
+    }
+    for (int i = end > 0 ? end : 1; i < count; i++) result = MIN_OF(result, values[i]);
+    return result;
+}
+
+double bufferMax(const double* values, int count) {
+    double result = values[0];
+    int end = blockEnd(count);
+    if (end > 0) {
+        double lanes[BUFFER_LANES];
+        memcpy(lanes, values, sizeof(lanes));
+        if (USE_SIMD()) KERNEL(maxBlocks)(lanes, values, BUFFER_LANES, end);
+        else maxBlocksScalar(lanes, values, BUFFER_LANES, end);
+
+        for (int width = BUFFER_LANES / 2; width > 0; width /= 2) {
+            for (int k = 0; k < width; k++) lanes[k] = MAX_OF(lanes[k], lanes[k + width]);
+        }
+        result = lanes[0];
+    }
+    for (int i = end > 0 ? end : 1; i < count; i++) result = MAX_OF(result, values[i]);
+    return result;
+}
+
+void bufferScale(double* values, int count, double factor) {
+    if (USE_SIMD()) KERNEL(scale)(values, count, factor);
+    else scaleScalar(values, count, factor);
+}
+
+void bufferAdd(double* to, const double* from, int count) {
+    if (USE_SIMD()) KERNEL(add)(to, from, count);
+    else addScalar(to, from, count);
+}
+
+void bufferMul(double* to, const double* from, int count) {
+    if (USE_SIMD()) KERNEL(mul)(to, from, count);
+    else mulScalar(to, from, count);
+}
+
+void bufferFill(double* values, int count, double value) {
+    if (USE_SIMD()) KERNEL(fill)(values, count, value);
+    else fillScalar(values, count, value);
+}
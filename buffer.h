@@ -0,0 +1,25 @@
+// include guard
+#ifndef clox_buffer_h
+#define clox_buffer_h
+
+#include "common.h"
+
+// bulk numeric kernels over raw arrays of doubles, behind the buffer natives in vm.c (see ObjBuffer)
+// they use AVX2 when the CPU has it (checked once, at runtime) or NEON on AArch64, anything else or a build with
+// -DBUFFER_NO_SIMD goes through plain loops
+// the reductions add up (or compare) BUFFER_LANES interleaved partial results that get combined in a fixed order at the end,
+// every version does exactly the same operations in the same order, so they all give the same result down to the last bit
+// (it can differ from adding the elements up left to right though)
+#define BUFFER_LANES 16
+
+double bufferSum(const double* values, int count);
+double bufferDot(const double* a, const double* b, int count);
+double bufferMin(const double* values, int count);             // count must be at least 1
+double bufferMax(const double* values, int count);             // same
+void bufferScale(double* values, int count, double factor);    // values[i] *= factor
+void bufferAdd(double* to, const double* from, int count);     // to[i] += from[i]
+void bufferMul(double* to, const double* from, int count);     // to[i] *= from[i]
+void bufferFill(double* values, int count, double value);
+
+// end include guard
+#endif
@@ -12,14 +12,17 @@ void initChunk(Chunk* chunk) {
     chunk->lineCapacity = 0; // <--
     chunk->lines = NULL;    // No memory allocated for tracking line numbers
     initValueArray(&chunk->constants);                                  // Initialize the constants array
+    chunk->cacheCount = 0;
+    chunk->cacheCapacity = 0;
+    chunk->caches = NULL;   // No inline caches handed out yet
 }
 
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);     // otherwise the code belongs to a mapped .loxc file
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);                                                   // Resets chunk to the safe defaults
-    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
 }
 
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
@@ -77,6 +80,18 @@ int addConstant(Chunk* chunk, Value value) {
     return chunk->constants.count - 1;                                 // Return the index where value is stored
 }
 
+// hands out a new, empty inline cache for an instruction and returns its index
+int addInlineCache(Chunk* chunk) {
+    if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+        int oldCapacity = chunk->cacheCapacity;
+        chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity, chunk->cacheCapacity);
+    }
+
+    chunk->caches[chunk->cacheCount].count = 0;
+    return chunk->cacheCount++;
+}
+
 void writeConstant(Chunk* chunk, Value value, int line) {
     int index = addConstant(chunk, value);
     
@@ -38,19 +38,56 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,               // OP_CALL in a return statement, a closure it calls takes over the caller's frame
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_TAIL_INVOKE,             // OP_INVOKE in a return statement, the method's closure takes over the caller's frame
+    OP_TAIL_SUPER_INVOKE,       // same for OP_SUPER_INVOKE
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_MODULUS,
     OP_CONSTANT_LONG,
     OP_RETURN,
-    OP_CONDITIONAL,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_BUILD_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    // a switch whose leading cases are literals picks the case in one go (see switchStatement()), the switch value stays
+    // on the stack, each jump counts forward from the end of the instruction
+    OP_SWITCH_INT,              // lowest label (4 bytes), slot count (2), miss jump (2), then a jump (2) for every label from the lowest on
+    OP_SWITCH_STRING,           // slot count (2, a power of two), miss jump (2), then hashed slots: string constant (2, 0xffff if empty), jump (2)
+    // superinstructions, only ever produced by the peephole pass in optimizer.c (the compiler never emits them itself)
+    OP_ADD_LOCALS,              // GET_LOCAL a; GET_LOCAL b; ADD
+    OP_ADD_CONSTANT,            // CONSTANT k; ADD                  (k a number)
+    OP_SUBTRACT_CONSTANT,       // CONSTANT k; NEGATE; ADD          (k a number)
+    OP_POP_JUMP_IF_FALSE,       // JUMP_IF_FALSE; POP               (pops the condition on both paths)
+    OP_POP_JUMP_IF_TRUE,        // NOT; JUMP_IF_FALSE; POP
+    OP_JUMP_IF_NOT_LESS,        // LESS; JUMP_IF_FALSE; POP
+    OP_JUMP_IF_NOT_GREATER      // GREATER; JUMP_IF_FALSE; POP
 } OpCode;
 
+// how many receiver layouts one inline cache remembers before it starts overwriting its last entry
+#define INLINE_CACHE_SIZE 4
+
+// a remembered property/method lookup, valid for receivers of exactly this class and shape
+typedef struct {
+    ObjClass* klass;            // receiver's class (the superclass for OP_SUPER_INVOKE)
+    ObjShape* shape;            // receiver's shape (NULL for OP_SUPER_INVOKE, which has no receiver layout to check)
+    uint32_t version;           // klass->version when the entry was filled, a mismatch means the class's methods changed
+    int index;                  // index of the field in the receiver's fields array, -1 when the lookup found a method
+    ObjShape* transition;       // OP_SET_PROPERTY that adds a field: the shape the instance moves to (NULL otherwise)
+    Value method;               // the method's closure when index is -1
+} InlineCacheEntry;
+
+// per call-site cache for OP_GET_PROPERTY, OP_SET_PROPERTY, OP_INVOKE and OP_SUPER_INVOKE
+// entries[0] is the monomorphic case, the rest fill in as the site sees more receiver layouts
+typedef struct {
+    int count;                  // # of entries in use
+    InlineCacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 //  maps bytecode instructions back to source code lines
 typedef struct {
     int offset;             // index in bytecode array where source code line begins
@@ -60,12 +97,15 @@ typedef struct {
 // Defining the chunk structure
 typedef struct {
     int count;              //  Number of bytes currently in the chunk.
-    int capacity;           //  Maximum bytes the chunk can hold before resizing.
+    int capacity;           //  Maximum bytes the chunk can hold before resizing (0 with code set: read-only code loaded from a .loxc file)
     uint8_t* code;          //  Pointer to a dynamic array of bytecode instructions (opcodes).
     int lineCount;          // how many linestart entries are currently stored
     int lineCapacity;       // allocated size (# of LineStart entries) for the dynamic array lines
     LineStart* lines;       //  pointer to a dynamic array of LineStart structs
     ValueArray constants;   //  Each chunk will carry with it a list of the values/constants that appear in the program
+    int cacheCount;         // # of inline caches handed out to instructions in this chunk
+    int cacheCapacity;      // allocated size of the caches array
+    InlineCache* caches;    // inline caches, instructions that use one carry its index as a 2 byte operand
 } Chunk;
 
 // chunk function declarations
@@ -73,6 +113,7 @@ void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 void writeConstant(Chunk* chunk, Value value, int line);
 int getLine(Chunk* chunk, int instruction);
 
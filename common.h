@@ -10,12 +10,56 @@
 
 // optimization for cutting down the size of the Value type
 #define NAN_BOXING
-// useful for debugging
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
-// useful for flushing out memory management bugs
-#define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
+// threaded dispatch for the interpreter loop, uses the labels-as-values extension (&&label) so only GCC/Clang get it
+// every other compiler falls back to the plain switch in run()
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO
+#endif
+// peephole pass that fuses common bytecode sequences into superinstructions once a function is compiled (see optimizer.c)
+// comment it out to run the compiler's output as is, e.g. to measure what the pass buys
+#define OPTIMIZE_PEEPHOLE
+// full collections run incrementally, in bounded slices interleaved with the program instead of one long pause (see memory.c)
+// comment it out to go back to stop-the-world full collections
+#define GC_INCREMENTAL
+// the pauses that trace to the end (minor collections, finishing a full one) share a big trace out among several threads
+// (see memory.c), needs POSIX threads so Windows builds and anything else trace on the program's thread only
+#if !defined(_WIN32) && (defined(__unix__) || defined(__APPLE__))
+#define GC_PARALLEL_MARK
+#endif
+// small allocations (objects, short strings and arrays) come from size-class pools instead of malloc (see memory.c)
+// comment it out to send everything to malloc, e.g. so a memory checker like ASan can see each block
+#define POOL_ALLOCATOR
+// the I/O natives (sockets, timers, file reads) park the fiber that calls them until the event loop sees it can go on
+// (see loop.c), with epoll on Linux and kqueue on macOS and the BSDs, anything else gets fibers but not those natives
+#if defined(__linux__)
+#define EVENT_LOOP_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define EVENT_LOOP_KQUEUE
+#endif
+#if defined(EVENT_LOOP_EPOLL) || defined(EVENT_LOOP_KQUEUE)
+#define EVENT_LOOP
+#endif
+// hot functions get translated into x86-64 machine code by a baseline JIT (see jit.c), which relies on the NaN-boxed
+// Value layout and on mmap(), so other CPUs, Windows and the union Value only interpret (so does clox --no-jit)
+#if defined(NAN_BOXING) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define JIT
+#endif
+// the debugging aids (disassembly, tracing, GC logging and stress testing) are switched on at runtime, see DebugFlags in vm.h
+
+// storage of which every thread has its own copy (vm, the compiler's state), C99 has no keyword for it
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// tells GCC/Clang which way a branch almost always goes so the code for it gets laid out as the straight path through
+// (the ints' fast paths in run() would otherwise end up as cold branches behind the doubles' code), no-op elsewhere
+#if defined(__GNUC__) || defined(__clang__)
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
 
 // fixed size for local array
 #define UINT8_COUNT (UINT8_MAX + 1)
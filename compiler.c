@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,11 +9,14 @@
 #include "scanner.h"
 
 #define MAX_CASES 256
+// a switch gets a jump table once it starts with this many literal case labels, fewer are as quickly tested one by one
+#define SWITCH_TABLE_MIN 3
+
+// the peephole pass and the stack depth count
+#include "optimizer.h"
 
 // debugging support
-#ifdef DEBUG_PRINT_CODE
 #include "debug.h"
-#endif
 
 // This compiler is single-pass, it ALSO includes the parser to read user's source code (makes it simpler but does not work for every language)
 // (combines parsing and bytecode generation into one step)
@@ -21,11 +25,12 @@ typedef struct {
 	Token previous;						// previous token being processed
 	bool hadError;						// Indicates if an error occurred during parsing
 	bool panicMode;						// this prevents further error messages from being generated after an error is encountered
+	ObjString* source;					// copy of the source being compiled when function bodies are compiled lazily, NULL otherwise
 } Parser;
 
-// global variables used for forloop parsing/compiling
-int innermostLoopStart = -1;
-int innermostLoopScopeDepth = 0;
+// global variables used for forloop parsing/compiling (the compiler's state is per thread, so threads can compile at once)
+THREAD_LOCAL int innermostLoopStart = -1;
+THREAD_LOCAL int innermostLoopScopeDepth = 0;
 
 // defines levels (lowest to highest from top to bottom) of operator precedence
 // IMPORTANT for determining the order of operations when parsing expressions
@@ -66,6 +71,7 @@ typedef struct {
 typedef struct {
 	uint8_t index;						// index of the local variable being captured
 	bool isLocal;						// whether or not variable is local to immediate closure (true) or is itself an upvalue from a higher level (false)
+	Token name;							// the variable's name, kept for the body of a lazily compiled function
 } Upvalue;
 
 // lets the compiler tell when it’s compiling top-level code versus the body of a function
@@ -76,6 +82,16 @@ typedef enum {
 	TYPE_SCRIPT
 } FunctionType;
 
+// what the compiler knows about the expression it just compiled, when that expression is a literal (or folded into one)
+// lets an operator evaluate literal operands at compile time, and a statement drop a branch a literal condition never takes
+typedef struct {
+	bool isConstant;					// the last expression was a literal (only trusted while end == the chunk's count, see lastConstant())
+	Value value;						// its value
+	int start;							// offset of the instruction that loads it
+	int end;							// offset just past that instruction
+	int constantCount;					// size of the constant table before the literal was added to it
+} ExprConstant;
+
 typedef struct Compiler {
 	struct Compiler* enclosing;
 	ObjFunction* function;				// function being compiled
@@ -85,6 +101,10 @@ typedef struct Compiler {
 	int localCount;						// tracks how many locals are in scope—how many of those array slots are in use
 	Upvalue upvalues[UINT8_COUNT];
 	int scopeDepth;						// Tracks the current depth of nested blocks (used for scoping)
+	Table stringConstants;				// identifier name -> its index in THIS function's constant table (indices are per chunk)
+	ExprConstant lastConstant;			// the most recently emitted literal, for constant folding
+	int lastCall;						// offset of the most recent OP_CALL, OP_INVOKE or OP_SUPER_INVOKE, for spotting a call in tail position
+	LazyBody* lazy;						// compiling a lazily compiled body on its first call: where its upvalues' names are (no enclosing compiler then)
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -92,13 +112,10 @@ typedef struct ClassCompiler {
 	bool hasSuperclass;					// whether class has a superclass (used for inheritance)	
 } ClassCompiler;
   
-Parser parser;
+THREAD_LOCAL Parser parser;
 
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
-
-
-Table stringConstants;
+THREAD_LOCAL Compiler* current = NULL;
+THREAD_LOCAL ClassCompiler* currentClass = NULL;
 
 // current chunk = chunk owned by function we are currently compiling
 static Chunk* currentChunk() {
@@ -236,6 +253,73 @@ static void emitConstant(Value value) {
 	emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+// the literal the expression just compiled to, isConstant is false when it wasn't one
+// anything emitted after the literal moves the chunk's count past its end, so whatever consumed it doesn't show up as a literal too
+static ExprConstant lastConstant() {
+	ExprConstant constant = current->lastConstant;
+	constant.isConstant = constant.isConstant && constant.end == currentChunk()->count;
+	return constant;
+}
+
+// emits the instruction that loads a literal, and remembers the literal so whatever operator consumes it can fold it
+static void emitLiteral(Value value) {
+	ExprConstant* constant = &current->lastConstant;
+	constant->start = currentChunk()->count;
+	constant->constantCount = currentChunk()->constants.count;
+
+	if (IS_NIL(value)) {
+		emitByte(OP_NIL);
+	} else if (IS_BOOL(value)) {
+		emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	} else {
+		emitConstant(value);
+	}
+
+	constant->isConstant = true;
+	constant->value = value;
+	constant->end = currentChunk()->count;
+}
+
+// drops everything emitted from start onward, for literals that got folded and for code that can never run
+static void discardCode(int start) {
+	Chunk* chunk = currentChunk();
+	chunk->count = start;
+	while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= start) {
+		chunk->lineCount--;
+	}
+
+	if (current->lastConstant.end > start) {
+		current->lastConstant.isConstant = false;
+	}
+}
+
+// drops a literal's code and its constant table entry (nothing else can refer to it, it was the last thing emitted)
+static void discardConstant(ExprConstant* constant) {
+	discardCode(constant->start);
+	currentChunk()->constants.count = constant->constantCount;
+}
+
+// same as isFalsey() in the VM: nil and false are falsey, everything else is truthy
+static bool constantIsFalsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// emits a global variable instruction, followed by its 2 byte slot in vm->globalValues
+static void emitGlobal(uint8_t op, int slot) {
+	emitByte(op);
+	emitBytes((slot >> 8) & 0xff, slot & 0xff);
+}
+
+// gives the instruction just emitted its own inline cache, written as a 2 byte operand holding the cache's index
+static void emitInlineCache() {
+	int cache = addInlineCache(currentChunk());
+	if (cache > UINT16_MAX) {
+		error("Too many property accesses in one chunk.");
+	}
+
+	emitBytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 // returns the offset of the emitted instruction in the chunk. After compiling the then branch, pass in the offset to it
 static void patchJump(int offset) {
 	// -2 to adjust for the bytecode for the jump offset itself.
@@ -251,15 +335,20 @@ static void patchJump(int offset) {
 
 // to initialize compiler
 // compiler implicitly claims stack slot zero from locals array for the VM’s own internal use
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// function is the one to compile into, NULL for a new one (named after the previous token unless it's the script)
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
 	compiler->enclosing = current;
 	compiler->function = NULL;
 	compiler->type = type;
 	compiler->localCount = 0;
 	compiler->scopeDepth = 0;
-	compiler->function = newFunction();
+	initTable(&compiler->stringConstants);
+	compiler->lastConstant.isConstant = false;
+	compiler->lastCall = -1;
+	compiler->lazy = NULL;
+	compiler->function = function != NULL ? function : newFunction();
 	current = compiler;
-	if (type != TYPE_SCRIPT) {
+	if (type != TYPE_SCRIPT && function == NULL) {
 		current->function->name = copyString(parser.previous.start, parser.previous.length);
 	}
 	
@@ -282,12 +371,18 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
 	emitReturn();
 	ObjFunction* function = current->function;
+	freeTable(&current->stringConstants);
+
+  #ifdef OPTIMIZE_PEEPHOLE
+	if (!parser.hadError) {
+		optimizeChunk(currentChunk());
+	}
+  #endif
+	function->maxSlots = maxStackDepth(currentChunk(), function->arity + 1);
 
-  #ifdef DEBUG_PRINT_CODE
-  	if (!parser.hadError) {
+  	if (!parser.hadError && (vm->debug & DEBUG_PRINT_CODE)) {
 		disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
   	}
-  #endif
 
   current = current->enclosing;
   return function;
@@ -320,22 +415,33 @@ static void statement();
 static void declaration();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
+static void conditional(bool canAssign);
 
 // Ensures that each identifier is stored only once in the constant table, avoiding duplicates
 static uint8_t identifierConstant(Token* name) {
   // See if we already have it.
   ObjString* string = copyString(name->start, name->length);
   Value indexValue;
-  if (tableGet(&stringConstants, string, &indexValue)) {
+  if (tableGet(&current->stringConstants, string, &indexValue)) {
     // We do.
-    return (uint8_t)AS_NUMBER(indexValue);
+    return (uint8_t)AS_INT(indexValue);
   }
 
   uint8_t index = makeConstant(OBJ_VAL(string));
-  tableSet(&stringConstants, string, NUMBER_VAL((double)index));
+  tableSet(&current->stringConstants, string, INT_VAL(index));
   return index;
 }
 
+// resolves a global variable name to its slot, globals are bound by name at compile time rather than looked up by name at runtime
+// a name that hasn't been seen before still gets a slot, it just stays undefined until the DEFINE runs (so using it too early is a runtime error, like before)
+static int identifierGlobal(Token* name) {
+	int slot = globalSlot(copyString(name->start, name->length));
+	if (slot > UINT16_MAX) {
+		error("Too many global variables.");
+	}
+	return slot;
+}
+
 // purpose is in the name
 // compare lengths first, then if same, check characters using memcmp()
 static bool identifiersEqual(Token* a, Token* b) {
@@ -360,7 +466,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 // Adds a new upvalue to a function's list of upvalues if it doesn’t already exist and returns the index of that upvalue
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal, Token* name) {
 	int upvalueCount = compiler->function->upvalueCount;
 	
 	for (int i = 0; i < upvalueCount; i++) {
@@ -377,22 +483,31 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
 	compiler->upvalues[upvalueCount].isLocal = isLocal;
 	compiler->upvalues[upvalueCount].index = index;
+	compiler->upvalues[upvalueCount].name = *name;
 	return compiler->function->upvalueCount++;
 }
 
 // Resolves a variable from an enclosing function’s scope and returns an upvalue index for it. It builds up the chain of closures if needed.
+// a lazily compiled body has no enclosing compiler left, but its upvalues (every one it could need) were resolved already
 static int resolveUpvalue(Compiler* compiler, Token* name) {
-	if (compiler->enclosing == NULL) return -1;
+	if (compiler->enclosing == NULL) {
+		if (compiler->lazy == NULL) return -1;
+		for (int i = 0; i < compiler->function->upvalueCount; i++) {
+			ObjString* upvalueName = compiler->lazy->upvalueNames[i];
+			if (upvalueName->length == name->length && memcmp(upvalueName->chars, name->start, name->length) == 0) return i;
+		}
+		return -1;
+	}
   
 	int local = resolveLocal(compiler->enclosing, name);
 	if (local != -1) {
 		compiler->enclosing->locals[local].isCaptured = true;
-	  	return addUpvalue(compiler, (uint8_t)local, true);
+	  	return addUpvalue(compiler, (uint8_t)local, true, name);
 	}
 	
 	int upvalue = resolveUpvalue(compiler->enclosing, name);
 	if (upvalue != -1) {
-	  	return addUpvalue(compiler, (uint8_t)upvalue, false);
+	  	return addUpvalue(compiler, (uint8_t)upvalue, false, name);
 	}
   
 	return -1;
@@ -429,15 +544,15 @@ static void declareVariable() {
 	addLocal(*name);
 }
 
-// parses variable name and returns its constant index
+// parses variable name and returns its global slot
 // delcare the variable and exit function if we are in a local scope
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
 	consume(TOKEN_IDENTIFIER, errorMessage);
 
 	declareVariable();
 	if (current->scopeDepth > 0) return 0;
 
-	return identifierConstant(&parser.previous);
+	return identifierGlobal(&parser.previous);
 }
 
 static void markInitialized() {
@@ -446,13 +561,13 @@ static void markInitialized() {
 }
 
 // creates bytecode to define a global variable
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
 	if (current->scopeDepth > 0) {
 		markInitialized();
 		return;
 	}
 	
-	emitBytes(OP_DEFINE_GLOBAL, global);
+	emitGlobal(OP_DEFINE_GLOBAL, global);
 }
 
 // compile arguments for function (arguments != parameters)
@@ -481,11 +596,62 @@ static void and_(bool canAssign) {
 	patchJump(endJump);									// patch jump to skip right side if left was false
 }
 
+// evaluates a binary operator on two literals at compile time, replacing the code for both with the result
+// returns false (leaving the code alone) if the operands have types the operator rejects, so the error still happens at runtime
+// each case computes exactly what the VM would for the instructions it replaces (>= is !(a < b), not a >= b, for NaN's sake)
+static bool foldBinary(TokenType operatorType, ExprConstant* left, ExprConstant* right) {
+	Value a = left->value;
+	Value b = right->value;
+	Value result;
+
+	if (operatorType == TOKEN_EQUAL_EQUAL) {
+		result = BOOL_VAL(valuesEqual(a, b));
+	} else if (operatorType == TOKEN_BANG_EQUAL) {
+		result = BOOL_VAL(!valuesEqual(a, b));
+	} else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a);
+		double y = AS_NUMBER(b);
+		switch (operatorType) {
+			case TOKEN_GREATER:       result = BOOL_VAL(x > y); break;
+			case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+			case TOKEN_LESS:          result = BOOL_VAL(x < y); break;
+			case TOKEN_LESS_EQUAL:    result = BOOL_VAL(!(x > y)); break;
+			case TOKEN_PLUS:          result = numberValue(x + y); break;
+			case TOKEN_MINUS:         result = numberValue(x + -y); break;
+			case TOKEN_STAR:          result = numberValue(x * y); break;
+			case TOKEN_SLASH:         result = numberValue(x / y); break;
+			case TOKEN_PERCENT:       result = numberValue(fmod(x, y)); break;
+			default: return false; // Unreachable.
+		}
+	} else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+		// both operands are still in the constant table here, so a GC while building the result can't free them
+		ObjString* x = AS_STRING(a);
+		ObjString* y = AS_STRING(b);
+		int length = x->length + y->length;
+		char* chars = ALLOCATE(char, length + 1);
+		memcpy(chars, x->chars, x->length);
+		memcpy(chars + x->length, y->chars, y->length);
+		chars[length] = '\0';
+		result = OBJ_VAL(takeString(chars, length));			// interned, so it's the same string the VM would have built
+	} else {
+		return false;
+	}
+
+	discardConstant(left);										// right was emitted after left, so this drops both
+	emitLiteral(result);
+	return true;
+}
+
 // handles binary operator parsing
+// when both operands turn out to be literals the operation is done at compile time instead
 static void binary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
+	ExprConstant left = lastConstant();
 	ParseRule* rule = getRule(operatorType);
 	parsePrecedence((Precedence)(rule->precedence + 1));
+
+	ExprConstant right = lastConstant();
+	if (left.isConstant && right.isConstant && foldBinary(operatorType, &left, &right)) return;
   
 	// Emit the operator instruction.
 	switch (operatorType) {
@@ -508,9 +674,39 @@ static void binary(bool canAssign) {
 // when parsing through a call to a function
 static void call(bool canAssign) {
 	uint8_t argCount = argumentList();
+	current->lastCall = currentChunk()->count;
 	emitBytes(OP_CALL, argCount);
 }
 
+// a list literal: every element gets pushed in order, then OP_BUILD_LIST gathers that many into a new list
+static void listLiteral(bool canAssign) {
+	int itemCount = 0;
+	if (!check(TOKEN_RIGHT_BRACKET)) {
+		do {
+			expression();
+			if (itemCount == 255) {
+				error("Can't have more than 255 elements in a list literal.");
+			}
+			itemCount++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+	emitBytes(OP_BUILD_LIST, (uint8_t)itemCount);
+}
+
+// subscript after an expression, the list and the index end up on the stack (and the new value on top of them when assigning)
+static void subscript(bool canAssign) {
+	expression();
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+	if (canAssign && match(TOKEN_EQUAL)) {
+		expression();
+		emitByte(OP_INDEX_SET);
+	} else {
+		emitByte(OP_INDEX_GET);
+	}
+}
+
 // for parsing through after a dot for instances
 // load token’s lexeme (property name) into the constant table as a string so that the name is available at runtime
 static void dot(bool canAssign) {
@@ -520,21 +716,25 @@ static void dot(bool canAssign) {
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
 		emitBytes(OP_SET_PROPERTY, name);
+		emitInlineCache();
 	} else if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount = argumentList();
+		current->lastCall = currentChunk()->count;
 		emitBytes(OP_INVOKE, name);
 		emitByte(argCount);
+		emitInlineCache();
 	} else {
 	  	emitBytes(OP_GET_PROPERTY, name);
+		emitInlineCache();
 	}
 }
 
 // compiles literal tokens like nil, true, false into bytecode instructions
 static void literal(bool canAssign) {
 	switch (parser.previous.type) {
-	  	case TOKEN_FALSE: emitByte(OP_FALSE); break;
-	  	case TOKEN_NIL: emitByte(OP_NIL); break;
-	  	case TOKEN_TRUE: emitByte(OP_TRUE); break;
+	  	case TOKEN_FALSE: emitLiteral(BOOL_VAL(false)); break;
+	  	case TOKEN_NIL: emitLiteral(NIL_VAL); break;
+	  	case TOKEN_TRUE: emitLiteral(BOOL_VAL(true)); break;
 	  	default: return; // Unreachable.
 	}
 }
@@ -548,7 +748,7 @@ static void grouping(bool canAssign) {
 // handles # literals parsing
 static void number(bool canAssign) {
 	double value = strtod(parser.previous.start, NULL);
-	emitConstant(NUMBER_VAL(value));
+	emitLiteral(numberValue(value));						// whole numbers become ints (see value.h)
 }
 
 // also uses short-circuiting technique
@@ -567,7 +767,7 @@ static void or_(bool canAssign) {
 // the + 1 and - 2 parts trim the leading and trailing quotation marks
 // it then creates a string object, wraps it in a Value, and stuffs it into the constant table
 static void string(bool canAssign) {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+	emitLiteral(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 // determines whether var is global or local, then based on next token being '=', determines value assignment
@@ -581,16 +781,19 @@ static void namedVariable(Token name, bool canAssign) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	} else {
-	  	arg = identifierConstant(&name);
+	  	arg = identifierGlobal(&name);
 	  	getOp = OP_GET_GLOBAL;
 	  	setOp = OP_SET_GLOBAL;
 	}
 
+	bool isGlobal = getOp == OP_GET_GLOBAL;
 	if (canAssign && match(TOKEN_EQUAL)) {
 		expression();
-		emitBytes(setOp, (uint8_t)arg);
+		if (isGlobal) emitGlobal(setOp, arg);
+		else emitBytes(setOp, (uint8_t)arg);
 	} else {
-		emitBytes(getOp, (uint8_t)arg);
+		if (isGlobal) emitGlobal(getOp, arg);
+		else emitBytes(getOp, (uint8_t)arg);
 	}
 }
 
@@ -626,8 +829,10 @@ static void super_(bool canAssign) {
 	if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t argCount = argumentList();
 		namedVariable(syntheticToken("super"), false);
+		current->lastCall = currentChunk()->count;
 		emitBytes(OP_SUPER_INVOKE, name);
 		emitByte(argCount);
+		emitInlineCache();
 	} else {
 		namedVariable(syntheticToken("super"), false);
 		emitBytes(OP_GET_SUPER, name);
@@ -646,11 +851,26 @@ static void this_(bool canAssign) {
 } 
 
 // handles unary operator parsing
+// a literal operand is folded, unless it's a non-number being negated (left for the VM to report)
 static void unary(bool canAssign) {
 	TokenType operatorType = parser.previous.type;
   
 	// Compile the operand.
 	parsePrecedence(PREC_UNARY);
+
+	ExprConstant operand = lastConstant();
+	if (operand.isConstant) {
+		if (operatorType == TOKEN_BANG) {
+			discardConstant(&operand);
+			emitLiteral(BOOL_VAL(constantIsFalsey(operand.value)));
+			return;
+		}
+		if (operatorType == TOKEN_MINUS && IS_NUMBER(operand.value)) {
+			discardConstant(&operand);
+			emitLiteral(numberValue(-AS_NUMBER(operand.value)));
+			return;
+		}
+	}
   
 	// Emit the operator instruction.
 	switch (operatorType) {
@@ -666,8 +886,12 @@ static void unary(bool canAssign) {
 ParseRule rules[] = {
 	[TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
 	[TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_QUESTION]      = {NULL,     conditional, PREC_CONDITIONAL},
 	[TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
 	[TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
+	[TOKEN_LEFT_BRACKET]  = {listLiteral, subscript, PREC_CALL},
+	[TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
 	[TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
 	[TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -752,11 +976,8 @@ static void block() {
 	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-    // Create a new compiler for the function being compiled.
-    Compiler compiler;
-    initCompiler(&compiler, type);
-
+// compiles the parameter list of the function being compiled
+static void parameters() {
     // Begin a new scope for the function body.
     beginScope();
 
@@ -771,23 +992,96 @@ static void function(FunctionType type) {
             }
 
             // Parse the parameter name and add it as a local variable.
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA)); // Continue parsing parameters separated by commas.
     }
 
     // Ensure the parameter list is properly closed with a `)`.
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+}
+
+// the name might be a variable of an enclosing function, then the function being compiled gets an upvalue for it
+static void captureName(Token name) {
+	if (resolveLocal(current, &name) == -1) resolveUpvalue(current, &name);
+}
+
+// what block() does for a body that's compiled lazily: it only looks for the closing brace, and captures every name in
+// the body that an enclosing function has a variable (or upvalue) by, whether or not it really means that variable
+// a body can only ever capture too much that way (a local of its own that shadows one costs an unused upvalue), never too little
+static void skimBlock() {
+	int depth = 1;
+	while (!check(TOKEN_EOF)) {
+		if (check(TOKEN_LEFT_BRACE)) {
+			depth++;
+		} else if (check(TOKEN_RIGHT_BRACE)) {
+			if (--depth == 0) break;
+		} else if (parser.previous.type != TOKEN_DOT) {			// a property name isn't a variable
+			if (check(TOKEN_IDENTIFIER) || check(TOKEN_THIS)) {
+				captureName(parser.current);
+			} else if (check(TOKEN_SUPER)) {
+				captureName(syntheticToken("this"));
+				captureName(syntheticToken("super"));
+			}
+		}
+		advance();
+	}
+
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// endCompiler() for a function whose body only got skimmed, keeps what compileBody() needs to compile it on the first call
+// start is the '(' the parameter list opens with, the body gets compiled from there
+static ObjFunction* deferCompiler(Token* start) {
+	ObjFunction* function = current->function;
+	freeTable(&current->stringConstants);
+
+	LazyBody* lazy = ALLOCATE(LazyBody, 1);
+	lazy->source = parser.source;
+	lazy->start = (int)(start->start - parser.source->chars);
+	lazy->line = start->line;
+	lazy->type = current->type;
+	lazy->inClass = currentClass != NULL;
+	lazy->hasSuperclass = currentClass != NULL && currentClass->hasSuperclass;
+	lazy->upvalueNames = NULL;
+	if (function->upvalueCount > 0) {
+		lazy->upvalueNames = ALLOCATE(ObjString*, function->upvalueCount);
+		for (int i = 0; i < function->upvalueCount; i++) lazy->upvalueNames[i] = NULL;
+	}
+	function->lazy = lazy;
+	for (int i = 0; i < function->upvalueCount; i++) {
+		Token* name = &current->upvalues[i].name;
+		lazy->upvalueNames[i] = copyString(name->start, name->length);
+	}
+	writeBarrier((Obj*)function);
 
-    // Parse the function body enclosed in `{}`.
+	current = current->enclosing;
+	return function;
+}
+
+static void function(FunctionType type) {
+    // Create a new compiler for the function being compiled.
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    Token start = parser.current;
+
+    parameters();
+
+    // Parse the function body enclosed in `{}`, or with lazily compiled bodies skip it for now.
     consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-    block();
+    ObjFunction* function;
+    if (parser.source != NULL) {
+        skimBlock();
+        function = deferCompiler(&start);
+    } else {
+        block();
+        function = endCompiler();
+    }
 
     // Finalize the compilation of the function and emit it as a constant.
     // Emit the OP_CLOSURE instruction to create a closure for the function.
     // For each upvalue, emit whether it is local (1) or an upvalue from a higher scope (0),
     // followed by its index in the stack or upvalue array.
-    ObjFunction* function = endCompiler();
 	emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 	
 	for (int i = 0; i < function->upvalueCount; i++) {
@@ -825,7 +1119,7 @@ static void classDeclaration() {
 	declareVariable();
   
 	emitBytes(OP_CLASS, nameConstant);
-	defineVariable(nameConstant);
+	defineVariable(current->scopeDepth > 0 ? 0 : identifierGlobal(&className));
 
 	ClassCompiler classCompiler;
 	classCompiler.hasSuperclass = false;
@@ -866,7 +1160,7 @@ static void classDeclaration() {
 
 // compiles function declaration
 static void funDeclaration() {
-	uint8_t global = parseVariable("Expect function name.");
+	int global = parseVariable("Expect function name.");
 	markInitialized();
 	function(TYPE_FUNCTION);
 	defineVariable(global);
@@ -875,7 +1169,7 @@ static void funDeclaration() {
 // if var token is matched, jump to this function (parses and compiles var declaration)
 // if there is an initializer like '=' parse expression, if not, value within var is set to nil
 static void varDeclaration() {
-	uint8_t global = parseVariable("Expect variable name.");
+	int global = parseVariable("Expect variable name.");
   
 	if (match(TOKEN_EQUAL)) {
 	  	expression();
@@ -974,10 +1268,30 @@ static void continueStatement() {
 }
 
 // for parsing/compiling an if statement
+// compiles a statement that can never run (the untaken branch of a literal condition)
+// it still gets parsed and checked for errors like any other, its code is just thrown away afterwards
+static void deadStatement() {
+	int start = currentChunk()->count;
+	statement();
+	discardCode(start);
+}
+
 static void ifStatement() {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
 	expression();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+
+	// a literal condition picks the branch at compile time, so neither the test nor the other branch gets emitted
+	ExprConstant condition = lastConstant();
+	if (condition.isConstant) {
+		discardConstant(&condition);
+		bool isTrue = !constantIsFalsey(condition.value);
+		if (isTrue) statement(); else deadStatement();
+		if (match(TOKEN_ELSE)) {
+			if (isTrue) deadStatement(); else statement();
+		}
+		return;
+	}
   
 	int thenJump = emitJump(OP_JUMP_IF_FALSE);
 	emitByte(OP_POP);
@@ -992,16 +1306,177 @@ static void ifStatement() {
 	patchJump(elseJump);
 }
 
-// for parsing switch statement (might be changed later on to be more pythonic depending on efficiency)
+// a case label that can go in a switch's jump table, a number or string literal all by itself
+typedef struct {
+	Token token;						// the number or the string
+	bool negative;						// a '-' came before the number
+} CaseLabel;
+
+// the jump table a switch's leading literal cases are dispatched with, OP_SWITCH_INT or OP_SWITCH_STRING (see chunk.h)
+typedef struct {
+	OpCode kind;						// OP_POP when there's no table, every case gets tested one after the other
+	int32_t low;						// OP_SWITCH_INT: the label in slot 0
+	int size;							// # of slots
+	int missAt;							// offset of the miss jump, the slots come right after it
+	int end;							// offset just past the instruction, where its jumps count from
+	int miss;							// where a value none of the table's cases has goes, -1 until known
+	int targets[MAX_CASES];				// where the body of each case in the table starts
+} SwitchTable;
+
+// looks ahead through the switch's body (its '{' just consumed) for the case labels that are literals, from the first
+// case up to one that isn't or to the default, then puts the scanner back; returns how many it found
+// it goes by tokens only, a label that folds into a constant (1 + 2) is still tested the usual way
+static int scanCaseLabels(CaseLabel* labels) {
+	Token resume = parser.current;
+	Token token = parser.current;
+	int count = 0;
+	int depth = 0;
+	while (token.type != TOKEN_EOF && token.type != TOKEN_ERROR && count < MAX_CASES) {
+		if (token.type == TOKEN_LEFT_BRACE || token.type == TOKEN_LEFT_PAREN || token.type == TOKEN_LEFT_BRACKET) {
+			depth++;
+		} else if (token.type == TOKEN_RIGHT_BRACE || token.type == TOKEN_RIGHT_PAREN || token.type == TOKEN_RIGHT_BRACKET) {
+			if (--depth < 0) break;
+		} else if (depth == 0 && token.type == TOKEN_DEFAULT) {
+			break;
+		} else if (depth == 0 && token.type == TOKEN_CASE) {
+			CaseLabel* label = &labels[count];
+			label->token = scanToken();
+			label->negative = label->token.type == TOKEN_MINUS;
+			if (label->negative) label->token = scanToken();
+			bool literal = label->token.type == TOKEN_NUMBER || (label->token.type == TOKEN_STRING && !label->negative);
+			if (!literal || scanToken().type != TOKEN_COLON) break;
+			count++;
+		}
+		token = scanToken();
+	}
+
+	// a token's line is the one it ends on, so scanning goes on from right after it
+	initScanner(resume.start + resume.length, resume.line);
+	return count;
+}
+
+// the number a case label is, the same value number() and unary() would compile it to
+static double caseLabelNumber(CaseLabel* label) {
+	double value = strtod(label->token.start, NULL);
+	return label->negative ? -value : value;
+}
+
+// picks the table for the labels and emits the instruction, with every jump still to be filled in by finishSwitchTable()
+// ints that fill at least half the range from the lowest to the highest get a slot each, strings get a hash table twice
+// their number, anything else (a mix, a fraction, a handful of cases) no table at all
+static void beginSwitchTable(SwitchTable* table, CaseLabel* labels, int count) {
+	table->kind = OP_POP;
+	table->miss = -1;
+	if (count < SWITCH_TABLE_MIN) return;
+
+	bool strings = true;
+	bool ints = true;
+	double low = 0;
+	double high = 0;
+	for (int i = 0; i < count; i++) {
+		if (labels[i].token.type != TOKEN_STRING) {
+			strings = false;
+			double value = caseLabelNumber(&labels[i]);
+			if (!(value >= INT32_MIN && value <= INT32_MAX) || value != (int32_t)value) ints = false;
+			if (i == 0 || value < low) low = value;
+			if (i == 0 || value > high) high = value;
+		} else {
+			ints = false;
+		}
+	}
+
+	if (ints && high - low < 2.0 * count) {
+		table->kind = OP_SWITCH_INT;
+		table->low = (int32_t)low;
+		table->size = (int)(high - low) + 1;
+		emitByte(OP_SWITCH_INT);
+		emitBytes((table->low >> 24) & 0xff, (table->low >> 16) & 0xff);
+		emitBytes((table->low >> 8) & 0xff, table->low & 0xff);
+	} else if (strings) {
+		table->kind = OP_SWITCH_STRING;
+		table->size = 1;
+		while (table->size < 2 * count) table->size *= 2;
+		emitByte(OP_SWITCH_STRING);
+	} else {
+		return;
+	}
+	emitBytes((table->size >> 8) & 0xff, table->size & 0xff);
+
+	table->missAt = currentChunk()->count;
+	int slotBytes = table->kind == OP_SWITCH_INT ? 2 : 4;
+	for (int i = 0; i < 2 + slotBytes * table->size; i++) emitByte(0xff);
+	table->end = currentChunk()->count;
+}
+
+// writes a table jump from the end of the instruction to target
+static void patchSwitchJump(SwitchTable* table, int at, int target) {
+	int jump = target - table->end;
+	if (jump > UINT16_MAX) {
+		error("Too much code to jump over.");
+	}
+	currentChunk()->code[at] = (jump >> 8) & 0xff;
+	currentChunk()->code[at + 1] = jump & 0xff;
+}
+
+// fills the table in once every case's body has been compiled, where two cases have the same label the first one wins
+// (as it would testing them in order), and a slot no case has (OP_SWITCH_INT) goes where a miss does
+static void finishSwitchTable(SwitchTable* table, CaseLabel* labels, int count) {
+	patchSwitchJump(table, table->missAt, table->miss);
+	int* slots = ALLOCATE(int, table->size);
+	for (int i = 0; i < table->size; i++) slots[i] = -1;
+
+	if (table->kind == OP_SWITCH_INT) {
+		for (int i = 0; i < count; i++) {
+			int slot = (int32_t)caseLabelNumber(&labels[i]) - table->low;
+			if (slots[slot] == -1) slots[slot] = table->targets[i];
+		}
+		for (int i = 0; i < table->size; i++) {
+			patchSwitchJump(table, table->missAt + 2 + 2 * i, slots[i] == -1 ? table->miss : slots[i]);
+		}
+	} else {
+		// open addressing on the strings' hashes, there's always an empty slot to end a search on
+		for (int i = 0; i < count; i++) {
+			ObjString* string = copyString(labels[i].token.start + 1, labels[i].token.length - 2);
+			uint32_t slot = string->hash & (table->size - 1);
+			while (slots[slot] != -1 &&
+			       AS_STRING(currentChunk()->constants.values[slots[slot]]) != string) {
+				slot = (slot + 1) & (table->size - 1);
+			}
+			if (slots[slot] != -1) continue;
+
+			slots[slot] = makeConstant(OBJ_VAL(string));
+			int at = table->missAt + 2 + 4 * slot;
+			currentChunk()->code[at] = (slots[slot] >> 8) & 0xff;
+			currentChunk()->code[at + 1] = slots[slot] & 0xff;
+			patchSwitchJump(table, at + 2, table->targets[i]);
+		}
+	}
+	FREE_ARRAY(int, slots, table->size);
+}
+
+// a switch statement's cases are tested in order, the first one whose label equals the value runs (no falling through)
+// when the cases start with SWITCH_TABLE_MIN or more literal labels, those are looked up in a jump table instead: one
+// instruction sends the value to its case, and a miss on to the tests of the cases after them, the default or the end
+// the value is a local no name can refer to, so the locals of a case's blocks (and a continue's pops) count it in
 static void switchStatement() {
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+	beginScope();
 	expression();
+	addLocal(syntheticToken("switch"));
+	markInitialized();
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
 	consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+
+	CaseLabel labels[MAX_CASES];
+	SwitchTable table;
+	int tableCases = scanCaseLabels(labels);
+	beginSwitchTable(&table, labels, tableCases);
+	if (table.kind == OP_POP) tableCases = 0;
   
 	int state = 0; // 0: before all cases, 1: before default, 2: after default.
 	int caseEnds[MAX_CASES];
 	int caseCount = 0;
+	int cases = 0;
 	int previousCaseSkip = -1;
   
 	while (!match(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
@@ -1011,18 +1486,36 @@ static void switchStatement() {
 		if (state == 2) {
 		  error("Can't have another case or default after the default case.");
 		}
+		if (caseCount == MAX_CASES) {
+		  error("Too many cases in switch statement.");
+		  caseCount--;
+		}
   
 		if (state == 1) {
 		  // At the end of the previous case, jump over the others.
 		  caseEnds[caseCount++] = emitJump(OP_JUMP);
   
 		  // Patch its condition to jump to the next case (this one).
-		  patchJump(previousCaseSkip);
-		  emitByte(OP_POP);
+		  if (previousCaseSkip != -1) {
+			patchJump(previousCaseSkip);
+			emitByte(OP_POP);
+		  }
 		}
+		if (cases == tableCases && table.miss == -1) table.miss = currentChunk()->count;
   
-		if (caseType == TOKEN_CASE) {
+		if (caseType == TOKEN_CASE && cases < tableCases) {
 		  state = 1;
+
+		  // The table has the label, only its body gets compiled.
+		  expression();
+		  ExprConstant label = lastConstant();
+		  if (label.isConstant) discardConstant(&label);
+		  consume(TOKEN_COLON, "Expect ':' after case value.");
+		  table.targets[cases++] = currentChunk()->count;
+		  previousCaseSkip = -1;
+		} else if (caseType == TOKEN_CASE) {
+		  state = 1;
+		  cases++;
   
 		  // See if the case is equal to the value.
 		  emitByte(OP_DUP);
@@ -1049,18 +1542,21 @@ static void switchStatement() {
 	  }
 	}
   
-	// If we ended without a default case, patch its condition jump.
-	if (state == 1) {
+	// If we ended without a default case, patch its condition jump, the case that matched jumps over its pop.
+	if (state == 1 && previousCaseSkip != -1) {
+	  caseEnds[caseCount++] = emitJump(OP_JUMP);
 	  patchJump(previousCaseSkip);
 	  emitByte(OP_POP);
 	}
+	if (table.miss == -1) table.miss = currentChunk()->count;
   
 	// Patch all the case jumps to the end.
 	for (int i = 0; i < caseCount; i++) {
 	  patchJump(caseEnds[i]);
 	}
+	if (table.kind != OP_POP) finishSwitchTable(&table, labels, tableCases);
   
-	emitByte(OP_POP); // The switch value.
+	endScope(); // Pops the switch value.
 }
 
 // parses through expression expecting a semicolon token, and emits the print bytecode instruction
@@ -1085,6 +1581,17 @@ static void returnStatement() {
 	  
 		expression();
 		consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+		// a call that's the last thing the expression does is in tail position, its result is what gets returned
+		// (the OP_RETURN stays, it returns the result of anything the call can't replace the frame for, like a native)
+		Chunk* chunk = currentChunk();
+		if (current->lastCall == chunk->count - 2 && chunk->code[current->lastCall] == OP_CALL) {
+			chunk->code[current->lastCall] = OP_TAIL_CALL;
+		} else if (current->lastCall == chunk->count - 5 && chunk->code[current->lastCall] == OP_INVOKE) {
+			chunk->code[current->lastCall] = OP_TAIL_INVOKE;
+		} else if (current->lastCall == chunk->count - 5 && chunk->code[current->lastCall] == OP_SUPER_INVOKE) {
+			chunk->code[current->lastCall] = OP_TAIL_SUPER_INVOKE;
+		}
 		emitByte(OP_RETURN);
 	}
 }
@@ -1174,31 +1681,59 @@ static void statement() {
 	}
 }
 
-static void conditional()
-{
+// condition ? then : else, only the chosen branch gets evaluated (compiled with jumps just like an if statement)
+// with a literal condition the test is dropped along with the branch it never takes, and if the branch it does take is a
+// literal, the whole expression still counts as one to whatever consumes it
+static void conditional(bool canAssign) {
+	ExprConstant condition = lastConstant();
+	if (condition.isConstant) {
+		discardConstant(&condition);
+		bool isTrue = !constantIsFalsey(condition.value);
+
+		int start = currentChunk()->count;
+		parsePrecedence(PREC_CONDITIONAL);
+		ExprConstant thenBranch = lastConstant();
+		if (!isTrue) discardCode(start);
+
+		consume(TOKEN_COLON, "Expect ':' after then branch of conditional operator.");
+
+		start = currentChunk()->count;
+		parsePrecedence(PREC_ASSIGNMENT);
+		if (isTrue) {
+			discardCode(start);
+			current->lastConstant = thenBranch;
+		}
+		return;
+	}
+
+	int elseJump = emitJump(OP_JUMP_IF_FALSE);
+	emitByte(OP_POP);
   	// Compile the then branch.
   	parsePrecedence(PREC_CONDITIONAL);
+	int endJump = emitJump(OP_JUMP);
 
   	consume(TOKEN_COLON, "Expect ':' after then branch of conditional operator.");
 
+	patchJump(elseJump);
+	emitByte(OP_POP);
   	// Compile the else branch.
   	parsePrecedence(PREC_ASSIGNMENT);
-
-    // Emit bytecode for conditional operation
-    emitByte(OP_CONDITIONAL);
+	patchJump(endJump);
 }
 
 // takes source code and generates bytecode to store in a chunk
 // keep compiling declarations until hitting end of source file
+// with vm->compileLazily the functions' bodies are only skimmed, they get compiled (by compileBody()) when first called
 ObjFunction* compile(const char* source) {
-    initScanner(source);
+	// by then source may be gone, so they share a copy of it
+	parser.source = vm->compileLazily ? copyString(source, (int)strlen(source)) : NULL;
+    initScanner(parser.source != NULL ? parser.source->chars : source, 1);
 	Compiler compiler;
-	initCompiler(&compiler, TYPE_SCRIPT);
+	initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
 
 	parser.hadError = false;
 	parser.panicMode = false;
-	initTable(&stringConstants);
 
     advance();
     
@@ -1206,16 +1741,59 @@ ObjFunction* compile(const char* source) {
     	declaration();
   	}
 
-	freeTable(&stringConstants);
 	ObjFunction* function = endCompiler();
+	parser.source = NULL;
 	return parser.hadError ? NULL : function;
 }
 
+// it's the program that's running then, not another compile, and the compiler picks up where the function was declared:
+// the names the skim found captured are its upvalues, the class it's in is known by whether it has a superclass
+// a compile error gets reported as usual and leaves the function as it was
+bool compileBody(ObjFunction* function) {
+	LazyBody* lazy = function->lazy;
+	ClassCompiler classCompiler;
+	classCompiler.enclosing = NULL;
+	classCompiler.hasSuperclass = lazy->hasSuperclass;
+	currentClass = lazy->inClass ? &classCompiler : NULL;
+	innermostLoopStart = -1;
+	innermostLoopScopeDepth = 0;
+
+	parser.source = lazy->source;
+	parser.hadError = false;
+	parser.panicMode = false;
+	initScanner(lazy->source->chars + lazy->start, lazy->line);
+
+	int arity = function->arity;
+	function->arity = 0;					// the parameters get counted again
+	Compiler compiler;
+	initCompiler(&compiler, (FunctionType)lazy->type, function);
+	compiler.lazy = lazy;
+
+	advance();
+	parameters();
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block();
+	endCompiler();
+
+	currentClass = NULL;
+	parser.source = NULL;
+	if (parser.hadError) {
+		freeChunk(&function->chunk);		// the code emitted before the error
+		function->arity = arity;
+		return false;
+	}
+	freeLazyBody(function);
+	writeBarrier((Obj*)function);			// most likely old by now, and its chunk is all new constants
+	return true;
+}
+
 // for marking roots that compiler makes (compiler itself periodically grabs memory from the heap for literals and the constant table)
 void markCompilerRoots() {
+	markObject((Obj*)parser.source);
 	Compiler* compiler = current;
 	while (compiler != NULL) {
 		markObject((Obj*)compiler->function);
+		rememberObject((Obj*)compiler->function);		// still getting constants and a name, far too often for write barriers
 		compiler = compiler->enclosing;
 	}
 }
\ No newline at end of file
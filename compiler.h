@@ -6,6 +6,7 @@
 #include "vm.h"
 
 ObjFunction* compile(const char* source);
+bool compileBody(ObjFunction* function);    // compiles a lazily compiled function's body (see LazyBody), false on a compile error
 void markCompilerRoots();
 
 // End include guard
@@ -3,6 +3,7 @@
 #include "debug.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 // prints header for the chunk and loops through it's bytecode
 // Advances the offset according to the size of each instruction (some take 1 byte, others more)
@@ -15,7 +16,7 @@ void disassembleChunk(Chunk* chunk, const char* name) {
     }
 }
 
-// Handles instructions that use constants (OP_CONSTANT, OP_GET_GLOBAL, etc.)
+// Handles instructions that use constants (OP_CONSTANT, OP_GET_PROPERTY, etc.)
 // Prints the instruction name, constant index, and its human-readable value
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1]; // 1 byte for the constant index
@@ -26,15 +27,36 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
+// Handles global variable instructions, the operand is a 2 byte slot so the name comes from the VM rather than the constant table
+static int globalInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm->globalNames.count) printValue(vm->globalNames.values[slot]);
+    printf("'\n");
+    return offset + 3;                                                                      // 1 byte for instruction, 2 for the slot
+}
+
+// Handles property instructions (OP_GET_PROPERTY, OP_SET_PROPERTY)
+// like a constant instruction, followed by the 2 byte index of the instruction's inline cache
+static int propertyInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 2] << 8) | chunk->code[offset + 3]);
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' (cache %d)\n", cache);
+    return offset + 4;                                                                      // 1 byte for instruction, 1 for the constant, 2 for the cache
+}
+
 // Handles instructions that involve a method call (OP_INVOKE)
-// read the two operands and then print out both the method name and the argument count
+// read the operands and then print out the method name, the argument count and the inline cache index
 static int invokeInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     uint8_t argCount = chunk->code[offset + 2];
+    uint16_t cache = (uint16_t)((chunk->code[offset + 3] << 8) | chunk->code[offset + 4]);
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
-    printf("'\n");
-    return offset + 3;                                                                      // 1 byte for instruction, 2 for operands
+    printf("' (cache %d)\n", cache);
+    return offset + 5;                                                                      // 1 byte for instruction, 4 for operands
 }
 
 // For constants that use 3 bytes for the index (like OP_CONSTANT_LONG)
@@ -64,6 +86,12 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2; 
 }
 
+// For instructions that take two local slots (OP_ADD_LOCALS)
+static int localsInstruction(const char* name, Chunk* chunk, int offset) {
+    printf("%-16s %4d %4d\n", name, chunk->code[offset + 1], chunk->code[offset + 2]);
+    return offset + 3;
+}
+
 // For jump operations (OP_JUMP, OP_JUMP_IF_FALSE, OP_LOOP)
 // Prints where the jump goes based on the current offset and sign (forward or backward)
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
@@ -74,6 +102,34 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+// a switch's jump table, a line for the miss jump and then one for each slot's jump (the empty string slots left out)
+static int switchInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    bool ints = code[0] == OP_SWITCH_INT;
+    int32_t low = ints ? (int32_t)(((uint32_t)code[1] << 24) | (code[2] << 16) | (code[3] << 8) | code[4]) : 0;
+    int slots = ints ? (code[5] << 8) | code[6] : (code[1] << 8) | code[2];
+    int miss = ints ? 7 : 3;
+    int end = offset + miss + 2 + (ints ? 2 : 4) * slots;
+    printf("%-16s %4d slots\n", name, slots);
+    printf("%04d      |                     miss -> %d\n", offset + miss, end + ((code[miss] << 8) | code[miss + 1]));
+
+    for (int i = 0; i < slots; i++) {
+        if (ints) {
+            uint8_t* jump = code + 9 + 2 * i;
+            printf("%04d      |                     %d -> %d\n", offset + 9 + 2 * i, low + i,
+                   end + ((jump[0] << 8) | jump[1]));
+            continue;
+        }
+        uint8_t* slot = code + 5 + 4 * i;
+        int constant = (slot[0] << 8) | slot[1];
+        if (constant == 0xffff) continue;
+        printf("%04d      |                     ", offset + 5 + 4 * i);
+        printValue(chunk->constants.values[constant]);
+        printf(" -> %d\n", end + ((slot[2] << 8) | slot[3]));
+    }
+    return end;
+}
+
 // 1. Prints the current offset and line number
 // 2. Reads the opcode (uint8_t from chunk->code[offset])
 // 3. Uses a switch statement to match the opcode
@@ -108,19 +164,19 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+            return globalInstruction("OP_SET_GLOBAL", chunk, offset);
         case OP_GET_UPVALUE:
             return byteInstruction("OP_GET_UPVALUE", chunk, offset);
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+            return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
         case OP_GET_PROPERTY:
-            return constantInstruction("OP_GET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
         case OP_SET_PROPERTY:
-            return constantInstruction("OP_SET_PROPERTY", chunk, offset);
+            return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
         case OP_EQUAL:
@@ -157,10 +213,16 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE:
+            return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE: {
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -187,8 +249,94 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_INDEX_GET:
+            return simpleInstruction("OP_INDEX_GET", offset);
+        case OP_INDEX_SET:
+            return simpleInstruction("OP_INDEX_SET", offset);
+        case OP_SWITCH_INT:
+            return switchInstruction("OP_SWITCH_INT", chunk, offset);
+        case OP_SWITCH_STRING:
+            return switchInstruction("OP_SWITCH_STRING", chunk, offset);
+        case OP_ADD_LOCALS:
+            return localsInstruction("OP_ADD_LOCALS", chunk, offset);
+        case OP_ADD_CONSTANT:
+            return constantInstruction("OP_ADD_CONSTANT", chunk, offset);
+        case OP_SUBTRACT_CONSTANT:
+            return constantInstruction("OP_SUBTRACT_CONSTANT", chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+// name of an opcode as the disassembler prints it, for the profiler's report
+const char* opcodeName(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:              return "OP_CONSTANT";
+        case OP_NIL:                   return "OP_NIL";
+        case OP_TRUE:                  return "OP_TRUE";
+        case OP_FALSE:                 return "OP_FALSE";
+        case OP_POP:                   return "OP_POP";
+        case OP_GET_LOCAL:             return "OP_GET_LOCAL";
+        case OP_SET_LOCAL:             return "OP_SET_LOCAL";
+        case OP_GET_GLOBAL:            return "OP_GET_GLOBAL";
+        case OP_DEFINE_GLOBAL:         return "OP_DEFINE_GLOBAL";
+        case OP_SET_GLOBAL:            return "OP_SET_GLOBAL";
+        case OP_GET_UPVALUE:           return "OP_GET_UPVALUE";
+        case OP_SET_UPVALUE:           return "OP_SET_UPVALUE";
+        case OP_GET_PROPERTY:          return "OP_GET_PROPERTY";
+        case OP_SET_PROPERTY:          return "OP_SET_PROPERTY";
+        case OP_GET_SUPER:             return "OP_GET_SUPER";
+        case OP_DUP:                   return "OP_DUP";
+        case OP_EQUAL:                 return "OP_EQUAL";
+        case OP_GREATER:               return "OP_GREATER";
+        case OP_LESS:                  return "OP_LESS";
+        case OP_ADD:                   return "OP_ADD";
+        case OP_SUBTRACT:              return "OP_SUBTRACT";
+        case OP_MULTIPLY:              return "OP_MULTIPLY";
+        case OP_DIVIDE:                return "OP_DIVIDE";
+        case OP_NOT:                   return "OP_NOT";
+        case OP_NEGATE:                return "OP_NEGATE";
+        case OP_PRINT:                 return "OP_PRINT";
+        case OP_JUMP:                  return "OP_JUMP";
+        case OP_JUMP_IF_FALSE:         return "OP_JUMP_IF_FALSE";
+        case OP_LOOP:                  return "OP_LOOP";
+        case OP_CALL:                  return "OP_CALL";
+        case OP_TAIL_CALL:             return "OP_TAIL_CALL";
+        case OP_INVOKE:                return "OP_INVOKE";
+        case OP_SUPER_INVOKE:          return "OP_SUPER_INVOKE";
+        case OP_TAIL_INVOKE:           return "OP_TAIL_INVOKE";
+        case OP_TAIL_SUPER_INVOKE:     return "OP_TAIL_SUPER_INVOKE";
+        case OP_CLOSURE:               return "OP_CLOSURE";
+        case OP_CLOSE_UPVALUE:         return "OP_CLOSE_UPVALUE";
+        case OP_MODULUS:               return "OP_MODULUS";
+        case OP_CONSTANT_LONG:         return "OP_CONSTANT_LONG";
+        case OP_RETURN:                return "OP_RETURN";
+        case OP_CLASS:                 return "OP_CLASS";
+        case OP_INHERIT:               return "OP_INHERIT";
+        case OP_METHOD:                return "OP_METHOD";
+        case OP_BUILD_LIST:            return "OP_BUILD_LIST";
+        case OP_INDEX_GET:             return "OP_INDEX_GET";
+        case OP_INDEX_SET:             return "OP_INDEX_SET";
+        case OP_SWITCH_INT:            return "OP_SWITCH_INT";
+        case OP_SWITCH_STRING:         return "OP_SWITCH_STRING";
+        case OP_ADD_LOCALS:            return "OP_ADD_LOCALS";
+        case OP_ADD_CONSTANT:          return "OP_ADD_CONSTANT";
+        case OP_SUBTRACT_CONSTANT:     return "OP_SUBTRACT_CONSTANT";
+        case OP_POP_JUMP_IF_FALSE:     return "OP_POP_JUMP_IF_FALSE";
+        case OP_POP_JUMP_IF_TRUE:      return "OP_POP_JUMP_IF_TRUE";
+        case OP_JUMP_IF_NOT_LESS:      return "OP_JUMP_IF_NOT_LESS";
+        case OP_JUMP_IF_NOT_GREATER:   return "OP_JUMP_IF_NOT_GREATER";
+        default:                       return "OP_UNKNOWN";
+    }
+}
@@ -7,6 +7,7 @@
 // disassembler function declarations
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
 
 // end include guard
 #endif
\ No newline at end of file
@@ -0,0 +1,1072 @@
+// mmap()'s MAP_ANONYMOUS and sysconf() aren't C99
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+
+#ifdef JIT
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "optimizer.h"
+
+struct JitCode {
+    uint8_t* code;              // the executable mapping, starting with the prologue jitRun() calls
+    size_t size;                // bytes mapped
+    uint32_t* entries;          // for every bytecode offset that starts an instruction, where its template starts in code
+};
+
+// ----- the assembler -----
+// just the x86-64 instructions the templates need, encoded by hand
+
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15
+} Reg;
+
+// jitted code keeps the interpreter's state in callee-saved registers, the same in every function's code so it can
+// jump from a caller's straight into a callee's and back
+#define STACK_TOP RBX               // run()'s stackTop
+#define SLOTS     R12               // the frame's slots
+#define FRAME     R13               // the frame (vm->frames[vm->frameCount - 1]), its ip is only stored on the way out
+#define VM_REG    R14
+#define INT_TAG   R15               // QNAN | INT_BIT, or-ed onto a 32-bit result to box it as an int
+#define SCRATCH   R8                // for the type checks
+
+// condition codes, as in jcc and setcc
+typedef enum {
+    CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+    CC_S = 0x8, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF
+} Condition;
+
+// opcodes of "op r/m, reg" and the /digit of the same operation with an immediate
+#define ALU_ADD 0x01
+#define ALU_OR  0x09
+#define ALU_AND 0x21
+#define ALU_SUB 0x29
+#define ALU_XOR 0x31
+#define ALU_CMP 0x39
+#define IMM_ADD 0
+#define IMM_AND 4
+#define IMM_SUB 5
+#define IMM_CMP 7
+#define SHIFT_LEFT  4
+#define SHIFT_RIGHT 5
+
+// scalar double operations (F2 0F xx)
+#define SD_ADD 0x58
+#define SD_MUL 0x59
+#define SD_SUB 0x5C
+#define SD_DIV 0x5E
+
+// a rel32 to patch once its label is bound
+typedef struct {
+    int at;                     // offset of the 4 bytes, the jump is relative to the end of them
+    int label;
+} Fixup;
+
+typedef struct {
+    uint8_t* bytes;
+    int count;
+    int capacity;
+    int* labels;                // where each label got bound, -1 until it is
+    int labelCount;
+    int labelCapacity;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Assembler;
+
+static void* growArray(void* array, size_t size, int* capacity) {
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+static void emit8(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) as->bytes = growArray(as->bytes, 1, &as->capacity);
+    as->bytes[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t word) {
+    for (int i = 0; i < 4; i++) emit8(as, (uint8_t)(word >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t word) {
+    for (int i = 0; i < 8; i++) emit8(as, (uint8_t)(word >> (8 * i)));
+}
+
+static int newLabel(Assembler* as) {
+    if (as->labelCount == as->labelCapacity) as->labels = growArray(as->labels, sizeof(int), &as->labelCapacity);
+    as->labels[as->labelCount] = -1;
+    return as->labelCount++;
+}
+
+static void bind(Assembler* as, int label) {
+    as->labels[label] = as->count;
+}
+
+static void rel32(Assembler* as, int label) {
+    if (as->fixupCount == as->fixupCapacity) as->fixups = growArray(as->fixups, sizeof(Fixup), &as->fixupCapacity);
+    as->fixups[as->fixupCount++] = (Fixup){ as->count, label };
+    emit32(as, 0);
+}
+
+// the REX prefix for reg (in ModRM.reg) and base (ModRM.rm), left out when there's nothing to say
+static void rex(Assembler* as, bool wide, int reg, int base) {
+    uint8_t prefix = (uint8_t)(0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0));
+    if (prefix != 0x40) emit8(as, prefix);
+}
+
+// ModRM (and SIB and displacement) for [base + disp]
+static void memOperand(Assembler* as, int reg, int base, int32_t disp) {
+    int mod = disp == 0 && (base & 7) != RBP ? 0 : disp >= -128 && disp <= 127 ? 1 : 2;
+    emit8(as, (uint8_t)(mod << 6 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) emit8(as, 0x24);         // rsp and r12 as a base need a SIB byte
+    if (mod == 1) emit8(as, (uint8_t)disp);
+    if (mod == 2) emit32(as, (uint32_t)disp);
+}
+
+static void regOperand(Assembler* as, int reg, int rm) {
+    emit8(as, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+static void opMem(Assembler* as, bool wide, uint8_t opcode, int reg, int base, int32_t disp) {
+    rex(as, wide, reg, base);
+    emit8(as, opcode);
+    memOperand(as, reg, base, disp);
+}
+
+static void opReg(Assembler* as, bool wide, uint8_t opcode, int reg, int rm) {
+    rex(as, wide, reg, rm);
+    emit8(as, opcode);
+    regOperand(as, reg, rm);
+}
+
+static void load(Assembler* as, int dst, int base, int32_t disp) { opMem(as, true, 0x8B, dst, base, disp); }
+static void store(Assembler* as, int base, int32_t disp, int src) { opMem(as, true, 0x89, src, base, disp); }
+static void move(Assembler* as, int dst, int src) { opReg(as, true, 0x89, src, dst); }
+static void move32(Assembler* as, int dst, int src) { opReg(as, false, 0x89, src, dst); }   // zero-extends
+static void alu(Assembler* as, uint8_t opcode, int dst, int src) { opReg(as, true, opcode, src, dst); }
+static void alu32(Assembler* as, uint8_t opcode, int dst, int src) { opReg(as, false, opcode, src, dst); }
+static void lea(Assembler* as, int dst, int base, int32_t disp) { opMem(as, true, 0x8D, dst, base, disp); }
+
+static void aluImm(Assembler* as, bool wide, int operation, int dst, int32_t imm) {
+    rex(as, wide, 0, dst);
+    bool small = imm >= -128 && imm <= 127;
+    emit8(as, small ? 0x83 : 0x81);
+    regOperand(as, operation, dst);
+    if (small) emit8(as, (uint8_t)imm); else emit32(as, (uint32_t)imm);
+}
+
+static void aluMemImm(Assembler* as, int operation, int base, int32_t disp, int32_t imm) {    // on a 32-bit field
+    rex(as, false, 0, base);
+    bool small = imm >= -128 && imm <= 127;
+    emit8(as, small ? 0x83 : 0x81);
+    memOperand(as, operation, base, disp);
+    if (small) emit8(as, (uint8_t)imm); else emit32(as, (uint32_t)imm);
+}
+
+static void shift(Assembler* as, int direction, int dst, int bits) {
+    rex(as, true, 0, dst);
+    emit8(as, 0xC1);
+    regOperand(as, direction, dst);
+    emit8(as, (uint8_t)bits);
+}
+
+// the shortest mov of imm into dst, a 32-bit one zero-extends
+static void moveImm(Assembler* as, int dst, uint64_t imm) {
+    rex(as, imm > UINT32_MAX, 0, dst);
+    emit8(as, (uint8_t)(0xB8 | (dst & 7)));
+    if (imm > UINT32_MAX) emit64(as, imm); else emit32(as, (uint32_t)imm);
+}
+
+static void jump(Assembler* as, int label) {
+    emit8(as, 0xE9);
+    rel32(as, label);
+}
+
+static void jumpIf(Assembler* as, Condition condition, int label) {
+    emit8(as, 0x0F);
+    emit8(as, (uint8_t)(0x80 | condition));
+    rel32(as, label);
+}
+
+static void jumpTo(Assembler* as, int reg) {
+    rex(as, false, 0, reg);
+    emit8(as, 0xFF);
+    regOperand(as, 4, reg);
+}
+
+typedef void (*Helper)(void);              // any function, the machine code calls it with the right arguments
+
+// a C function, through rax (the code isn't mapped anywhere near it)
+static void callFunction(Assembler* as, Helper function) {
+    moveImm(as, RAX, (uint64_t)(uintptr_t)function);
+    emit8(as, 0xFF);
+    regOperand(as, 2, RAX);
+}
+
+static void pushReg(Assembler* as, int reg) {
+    rex(as, false, 0, reg);
+    emit8(as, (uint8_t)(0x50 | (reg & 7)));
+}
+
+static void popReg(Assembler* as, int reg) {
+    rex(as, false, 0, reg);
+    emit8(as, (uint8_t)(0x58 | (reg & 7)));
+}
+
+// as the low byte of reg (al, cl or dl only), then zero-extended from there
+static void setIf(Assembler* as, Condition condition, int reg) {
+    emit8(as, 0x0F);
+    emit8(as, (uint8_t)(0x90 | condition));
+    regOperand(as, 0, reg);
+    emit8(as, 0x0F);
+    emit8(as, 0xB6);
+    regOperand(as, reg, reg);
+}
+
+static void imul32(Assembler* as, int dst, int src) {
+    rex(as, false, dst, src);
+    emit8(as, 0x0F);
+    emit8(as, 0xAF);
+    regOperand(as, dst, src);
+}
+
+static void idiv32(Assembler* as, int divisor) {
+    emit8(as, 0x99);                                // cdq
+    rex(as, false, 0, divisor);
+    emit8(as, 0xF7);
+    regOperand(as, 7, divisor);
+}
+
+static void neg32(Assembler* as, int reg) {
+    rex(as, false, 0, reg);
+    emit8(as, 0xF7);
+    regOperand(as, 3, reg);
+}
+
+static void flipSign(Assembler* as, int reg) {     // btc reg, 63
+    rex(as, true, 0, reg);
+    emit8(as, 0x0F);
+    emit8(as, 0xBA);
+    regOperand(as, 7, reg);
+    emit8(as, 63);
+}
+
+static void testByte(Assembler* as) {              // test al, al
+    emit8(as, 0x84);
+    regOperand(as, RAX, RAX);
+}
+
+static void sse(Assembler* as, uint8_t prefix, bool wide, uint8_t opcode, int reg, int rm) {
+    emit8(as, prefix);
+    rex(as, wide, reg, rm);
+    emit8(as, 0x0F);
+    emit8(as, opcode);
+    regOperand(as, reg, rm);
+}
+
+static void toXmm(Assembler* as, int xmm, int reg) { sse(as, 0x66, true, 0x6E, xmm, reg); }          // movq
+static void fromXmm(Assembler* as, int reg, int xmm) { sse(as, 0x66, true, 0x7E, xmm, reg); }        // movq
+static void intToXmm(Assembler* as, int xmm, int reg) { sse(as, 0xF2, false, 0x2A, xmm, reg); }      // cvtsi2sd from 32 bits
+static void doubleOp(Assembler* as, uint8_t opcode, int xmm, int other) { sse(as, 0xF2, false, opcode, xmm, other); }
+static void compareDoubles(Assembler* as, int xmm, int other) { sse(as, 0x66, false, 0x2E, xmm, other); }   // ucomisd
+
+// ----- type checks on boxed values (see value.h) -----
+
+// equal: value is an int, all of SIGN_BIT | QNAN | INT_BIT are as IS_INT() wants them
+static void checkInt(Assembler* as, int value) {
+    move(as, SCRATCH, value);
+    shift(as, SHIFT_RIGHT, SCRATCH, 49);
+    aluImm(as, false, IMM_CMP, SCRATCH, 0x3FFF);
+}
+
+// equal: both are ints (ARE_INTS())
+static void checkInts(Assembler* as, int a, int b) {
+    move(as, SCRATCH, a);
+    alu(as, ALU_AND, SCRATCH, b);
+    shift(as, SHIFT_RIGHT, SCRATCH, 49);
+    aluImm(as, false, IMM_CMP, SCRATCH, 0x3FFF);
+}
+
+// equal: value is an object, SIGN_BIT and all of QNAN set
+static void checkObject(Assembler* as, int value) {
+    move(as, SCRATCH, value);
+    shift(as, SHIFT_RIGHT, SCRATCH, 50);
+    aluImm(as, false, IMM_CMP, SCRATCH, 0x3FFF);
+}
+
+// equal: value isn't a double, all of QNAN set
+static void checkNotDouble(Assembler* as, int value) {
+    move(as, SCRATCH, value);
+    shift(as, SHIFT_RIGHT, SCRATCH, 50);
+    aluImm(as, false, IMM_AND, SCRATCH, 0x1FFF);
+    aluImm(as, false, IMM_CMP, SCRATCH, 0x1FFF);
+}
+
+static void unboxObject(Assembler* as, int dst, int value) {
+    move(as, dst, value);
+    shift(as, SHIFT_LEFT, dst, 14);
+    shift(as, SHIFT_RIGHT, dst, 14);
+}
+
+// AS_NUMBER(value) into xmm, fail unless value is a number
+static void unboxNumber(Assembler* as, int xmm, int value, int fail) {
+    int isDouble = newLabel(as);
+    int done = newLabel(as);
+    checkInt(as, value);
+    jumpIf(as, CC_NE, isDouble);
+    intToXmm(as, xmm, value);
+    jump(as, done);
+    bind(as, isDouble);
+    checkNotDouble(as, value);
+    jumpIf(as, CC_E, fail);
+    toXmm(as, xmm, value);
+    bind(as, done);
+}
+
+// rcx = BOOL_VAL(condition), from the flags (clobbers rax)
+static void boxBool(Assembler* as, Condition condition) {
+    setIf(as, condition, RCX);
+    moveImm(as, RAX, FALSE_VAL);
+    alu(as, ALU_ADD, RCX, RAX);                     // TRUE_VAL is FALSE_VAL + 1
+}
+
+// below or equal: value is falsey (nil or false, which are one apart)
+static void checkFalsey(Assembler* as, int value) {
+    moveImm(as, SCRATCH, NIL_VAL);
+    alu(as, ALU_SUB, value, SCRATCH);
+    aluImm(as, true, IMM_CMP, value, 1);
+}
+
+// ----- the templates -----
+
+typedef struct {
+    Assembler as;
+    Chunk* chunk;
+    int* exits;                 // label of each instruction's way out to run(), -1 until one needs it
+    bool* starts;               // whether an instruction starts at each offset
+    int leave;                  // stores vm->stackTop and returns to jitRun(), frame->ip stored already
+    int leaveStored;            // vm->stackTop stored too
+    int error;                  // a runtime error was reported
+    int switchFrame;            // rcx is the new top frame, run its code or leave to run() if it has none
+} JitCompiler;
+
+// the way out that hands the instruction at offset to the interpreter: it stores the ip and stackTop and run() picks
+// up there, with the stack exactly as the interpreter would have it (the templates only change it once they can't fail)
+static int exitAt(JitCompiler* compiler, int offset) {
+    if (compiler->exits[offset] == -1) compiler->exits[offset] = newLabel(&compiler->as);
+    return compiler->exits[offset];
+}
+
+// where a jump lands, the label of the instruction at target
+// a target the compiler never meant to be reached (one past the end, say) is left to the interpreter's handling
+static int jumpTarget(JitCompiler* compiler, int offset, int target) {
+    if (target < 0 || target >= compiler->chunk->count || !compiler->starts[target]) return exitAt(compiler, offset);
+    return target;
+}
+
+// what a template does before calling back into the VM: frame->ip past the instruction (for the error line and
+// for the return of a call) and vm->stackTop
+static void storeState(JitCompiler* compiler, int next) {
+    Assembler* as = &compiler->as;
+    moveImm(as, RAX, (uint64_t)(uintptr_t)(compiler->chunk->code + next));
+    store(as, FRAME, offsetof(CallFrame, ip), RAX);
+    store(as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+}
+
+static void reloadStack(Assembler* as) {
+    load(as, STACK_TOP, VM_REG, offsetof(VM, stackTop));
+}
+
+static void failOnFalse(JitCompiler* compiler) {
+    testByte(&compiler->as);
+    jumpIf(&compiler->as, CC_E, compiler->error);
+}
+
+// after a call, a closure's new frame (or a fiber switch) gets the code of whatever frame is on top now
+static void afterCall(JitCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    failOnFalse(compiler);
+    opMem(as, false, 0x8B, RCX, VM_REG, offsetof(VM, frameCount));
+    aluImm(as, true, IMM_SUB, RCX, 1);
+    opReg(as, true, 0x6B, RCX, RCX);                // imul rcx, rcx, sizeof(CallFrame)
+    emit8(as, (uint8_t)sizeof(CallFrame));
+    opMem(as, true, 0x03, RCX, VM_REG, offsetof(VM, frames));
+    alu(as, ALU_CMP, RCX, FRAME);
+    jumpIf(as, CC_NE, compiler->switchFrame);
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    reloadStack(as);
+}
+
+// the operands of an arithmetic instruction: the two on top of the stack, two locals, or the top and a constant
+typedef enum {
+    ON_STACK,
+    ON_LOCALS,
+    WITH_CONSTANT
+} Operands;
+
+// OP_ADD to OP_GREATER and the superinstructions that fuse them: ints in 32-bit registers, numbers in xmm registers
+// anything else leaves to the interpreter, but for OP_ADD on strings, which calls concatenate()
+static void arithmetic(JitCompiler* compiler, int offset, int next, OpCode op, Operands operands,
+                       int a, int b, Value constant) {
+    Assembler* as = &compiler->as;
+    int exit = exitAt(compiler, offset);
+    int numbers = newLabel(as);
+    int result = newLabel(as);
+    int done = newLabel(as);
+    int strings = op == OP_ADD && operands != WITH_CONSTANT ? newLabel(as) : exit;
+
+    switch (operands) {
+        case ON_STACK:
+            load(as, RAX, STACK_TOP, -16);
+            load(as, RDX, STACK_TOP, -8);
+            break;
+        case ON_LOCALS:
+            load(as, RAX, SLOTS, 8 * a);
+            load(as, RDX, SLOTS, 8 * b);
+            break;
+        case WITH_CONSTANT:
+            load(as, RAX, STACK_TOP, -8);
+            moveImm(as, RDX, constant);
+            break;
+    }
+
+    // two ints, whatever would overflow (or come out -0) is left to the interpreter, which makes it a double
+    if (op != OP_DIVIDE) {
+        checkInts(as, RAX, RDX);
+        jumpIf(as, CC_NE, op == OP_MODULUS ? exit : numbers);
+        switch (op) {
+            case OP_ADD:
+            case OP_SUBTRACT:
+                move32(as, RCX, RAX);
+                alu32(as, op == OP_ADD ? ALU_ADD : ALU_SUB, RCX, RDX);
+                jumpIf(as, CC_O, exit);
+                break;
+            case OP_MULTIPLY: {
+                int nonZero = newLabel(as);
+                move32(as, RCX, RAX);
+                imul32(as, RCX, RDX);
+                jumpIf(as, CC_O, exit);
+                alu32(as, 0x85, RCX, RCX);
+                jumpIf(as, CC_NE, nonZero);
+                move32(as, SCRATCH, RAX);
+                alu32(as, ALU_OR, SCRATCH, RDX);
+                jumpIf(as, CC_S, exit);                 // 0 times a negative number is -0
+                bind(as, nonZero);
+                break;
+            }
+            case OP_MODULUS: {
+                int nonZero = newLabel(as);
+                move32(as, RCX, RDX);
+                aluImm(as, false, IMM_CMP, RCX, 0);
+                jumpIf(as, CC_E, exit);
+                aluImm(as, false, IMM_CMP, RCX, -1);
+                jumpIf(as, CC_E, exit);
+                move32(as, R9, RAX);
+                idiv32(as, RCX);
+                alu32(as, 0x85, RDX, RDX);
+                jumpIf(as, CC_NE, nonZero);
+                alu32(as, 0x85, R9, R9);
+                jumpIf(as, CC_S, exit);                 // fmod() keeps the dividend's sign, that's a -0
+                bind(as, nonZero);
+                move32(as, RCX, RDX);
+                break;
+            }
+            case OP_LESS:
+            case OP_GREATER:
+                alu32(as, ALU_CMP, RAX, RDX);
+                boxBool(as, op == OP_LESS ? CC_L : CC_G);
+                jump(as, result);
+                break;
+            default:
+                break;
+        }
+        if (op != OP_LESS && op != OP_GREATER) {
+            alu(as, ALU_OR, RCX, INT_TAG);
+            jump(as, result);
+        }
+    }
+
+    if (op != OP_MODULUS) {
+        bind(as, numbers);
+        unboxNumber(as, 0, RAX, strings);
+        unboxNumber(as, 1, RDX, strings);
+        switch (op) {
+            case OP_ADD:      doubleOp(as, SD_ADD, 0, 1); break;
+            case OP_SUBTRACT: doubleOp(as, SD_SUB, 0, 1); break;
+            case OP_MULTIPLY: doubleOp(as, SD_MUL, 0, 1); break;
+            case OP_DIVIDE:   doubleOp(as, SD_DIV, 0, 1); break;
+            default: break;
+        }
+        if (op == OP_LESS) {
+            compareDoubles(as, 1, 0);                   // b above a, false if either is NaN
+            boxBool(as, CC_A);
+        } else if (op == OP_GREATER) {
+            compareDoubles(as, 0, 1);
+            boxBool(as, CC_A);
+        } else {
+            fromXmm(as, RCX, 0);
+        }
+    }
+
+    bind(as, result);
+    switch (operands) {
+        case ON_STACK:
+            store(as, STACK_TOP, -16, RCX);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            break;
+        case ON_LOCALS:
+            store(as, STACK_TOP, 0, RCX);
+            aluImm(as, true, IMM_ADD, STACK_TOP, 8);
+            break;
+        case WITH_CONSTANT:
+            store(as, STACK_TOP, -8, RCX);
+            break;
+    }
+
+    if (strings != exit) {
+        jump(as, done);
+        bind(as, strings);
+        if (operands == ON_LOCALS) {
+            store(as, STACK_TOP, 0, RAX);
+            store(as, STACK_TOP, 8, RDX);
+            aluImm(as, true, IMM_ADD, STACK_TOP, 16);
+        }
+        storeState(compiler, next);
+        callFunction(as, (Helper)jitAddStrings);
+        failOnFalse(compiler);
+        reloadStack(as);
+    }
+    bind(as, done);
+}
+
+// OP_JUMP_IF_NOT_LESS and OP_JUMP_IF_NOT_GREATER: both operands popped, then the jump unless a < b (a > b)
+static void compareAndJump(JitCompiler* compiler, int offset, bool less, int target) {
+    Assembler* as = &compiler->as;
+    int exit = exitAt(compiler, offset);
+    int numbers = newLabel(as);
+    load(as, RAX, STACK_TOP, -16);
+    load(as, RDX, STACK_TOP, -8);
+    checkInts(as, RAX, RDX);
+    jumpIf(as, CC_NE, numbers);
+    aluImm(as, true, IMM_SUB, STACK_TOP, 16);
+    alu32(as, ALU_CMP, RAX, RDX);
+    jumpIf(as, less ? CC_GE : CC_LE, target);
+    jump(as, jumpTarget(compiler, offset, offset + 3));
+
+    bind(as, numbers);
+    unboxNumber(as, 0, RAX, exit);
+    unboxNumber(as, 1, RDX, exit);
+    aluImm(as, true, IMM_SUB, STACK_TOP, 16);
+    if (less) compareDoubles(as, 1, 0); else compareDoubles(as, 0, 1);
+    jumpIf(as, CC_BE, target);                      // NaN compares unordered, which jumps too
+}
+
+// OP_INDEX_GET and OP_INDEX_SET on a list or a buffer with an int index, left to the interpreter otherwise
+static void indexing(JitCompiler* compiler, int offset, bool set) {
+    Assembler* as = &compiler->as;
+    int exit = exitAt(compiler, offset);
+    int buffer = newLabel(as);
+    int done = newLabel(as);
+    int depth = set ? -24 : -16;                    // where the list is
+
+    load(as, RAX, STACK_TOP, depth);
+    load(as, RDX, STACK_TOP, depth + 8);
+    if (set) load(as, RSI, STACK_TOP, -8);
+    checkObject(as, RAX);
+    jumpIf(as, CC_NE, exit);
+    checkInt(as, RDX);
+    jumpIf(as, CC_NE, exit);
+    unboxObject(as, RCX, RAX);
+    move32(as, RDX, RDX);                           // just the int
+
+    aluMemImm(as, IMM_CMP, RCX, offsetof(Obj, type), OBJ_LIST);
+    jumpIf(as, CC_NE, buffer);
+    opMem(as, false, 0x3B, RDX, RCX, offsetof(ObjList, items) + offsetof(ValueArray, count));
+    jumpIf(as, CC_AE, exit);                        // unsigned, so a negative index is out of range too
+    shift(as, SHIFT_LEFT, RDX, 3);
+    opMem(as, true, 0x03, RDX, RCX, offsetof(ObjList, items) + offsetof(ValueArray, values));
+    if (set) {
+        store(as, RDX, 0, RSI);
+        store(as, STACK_TOP, -24, RSI);             // the value replaces the list
+        aluImm(as, true, IMM_SUB, STACK_TOP, 16);
+        checkObject(as, RSI);
+        jumpIf(as, CC_NE, done);
+        move(as, RDI, RCX);
+        callFunction(as, (Helper)jitWriteBarrier);
+    } else {
+        load(as, RAX, RDX, 0);
+        store(as, STACK_TOP, -16, RAX);
+        aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+    }
+    jump(as, done);
+
+    bind(as, buffer);
+    aluMemImm(as, IMM_CMP, RCX, offsetof(Obj, type), OBJ_BUFFER);
+    jumpIf(as, CC_NE, exit);
+    opMem(as, false, 0x3B, RDX, RCX, offsetof(ObjBuffer, length));
+    jumpIf(as, CC_AE, exit);
+    shift(as, SHIFT_LEFT, RDX, 3);
+    alu(as, ALU_ADD, RDX, RCX);
+    if (set) {
+        unboxNumber(as, 0, RSI, exit);
+        fromXmm(as, RAX, 0);
+        store(as, RDX, offsetof(ObjBuffer, values), RAX);
+        store(as, STACK_TOP, -24, RSI);
+        aluImm(as, true, IMM_SUB, STACK_TOP, 16);
+    } else {
+        load(as, RAX, RDX, offsetof(ObjBuffer, values));       // NUMBER_VAL() of a double is its bits
+        store(as, STACK_TOP, -16, RAX);
+        aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+    }
+    bind(as, done);
+}
+
+static void pushRax(Assembler* as) {
+    store(as, STACK_TOP, 0, RAX);
+    aluImm(as, true, IMM_ADD, STACK_TOP, 8);
+}
+
+static void pushConstant(Assembler* as, Value value) {
+    moveImm(as, RAX, value);
+    pushRax(as);
+}
+
+// rcx = the frame's closure's upvalue at slot
+static void loadUpvalue(Assembler* as, int slot) {
+    load(as, RCX, FRAME, offsetof(CallFrame, closure));
+    load(as, RCX, RCX, offsetof(ObjClosure, upvalues));
+    load(as, RCX, RCX, 8 * slot);
+}
+
+// rcx = vm->globalValues.values, which moves as globals are added
+static void loadGlobals(Assembler* as) {
+    load(as, RCX, VM_REG, offsetof(VM, globalValues) + offsetof(ValueArray, values));
+}
+
+static uint16_t readShort(uint8_t* code) {
+    return (uint16_t)(code[0] << 8 | code[1]);
+}
+
+static void compileInstruction(JitCompiler* compiler, int offset, int next) {
+    Assembler* as = &compiler->as;
+    Chunk* chunk = compiler->chunk;
+    uint8_t* code = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+
+    switch ((OpCode)code[0]) {
+        case OP_CONSTANT:      pushConstant(as, constants[code[1]]); break;
+        case OP_CONSTANT_LONG: pushConstant(as, constants[code[1] | code[2] << 8 | code[3] << 16]); break;
+        case OP_NIL:           pushConstant(as, NIL_VAL); break;
+        case OP_TRUE:          pushConstant(as, TRUE_VAL); break;
+        case OP_FALSE:         pushConstant(as, FALSE_VAL); break;
+        case OP_POP:           aluImm(as, true, IMM_SUB, STACK_TOP, 8); break;
+        case OP_DUP:
+            load(as, RAX, STACK_TOP, -8);
+            pushRax(as);
+            break;
+        case OP_GET_LOCAL:
+            load(as, RAX, SLOTS, 8 * code[1]);
+            pushRax(as);
+            break;
+        case OP_SET_LOCAL:
+            load(as, RAX, STACK_TOP, -8);
+            store(as, SLOTS, 8 * code[1], RAX);
+            break;
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+            // an undefined one is the interpreter's to report
+            loadGlobals(as);
+            load(as, RAX, RCX, 8 * readShort(code + 1));
+            moveImm(as, RDX, UNDEFINED_VAL);
+            alu(as, ALU_CMP, RAX, RDX);
+            jumpIf(as, CC_E, exitAt(compiler, offset));
+            if (code[0] == OP_GET_GLOBAL) {
+                pushRax(as);
+            } else {
+                load(as, RAX, STACK_TOP, -8);
+                store(as, RCX, 8 * readShort(code + 1), RAX);
+            }
+            break;
+        case OP_DEFINE_GLOBAL:
+            loadGlobals(as);
+            load(as, RAX, STACK_TOP, -8);
+            store(as, RCX, 8 * readShort(code + 1), RAX);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            break;
+        case OP_GET_UPVALUE:
+            loadUpvalue(as, code[1]);
+            load(as, RAX, RCX, offsetof(ObjUpvalue, location));
+            load(as, RAX, RAX, 0);
+            pushRax(as);
+            break;
+        case OP_SET_UPVALUE: {
+            int done = newLabel(as);
+            loadUpvalue(as, code[1]);
+            load(as, RSI, STACK_TOP, -8);
+            load(as, RAX, RCX, offsetof(ObjUpvalue, location));
+            store(as, RAX, 0, RSI);
+            checkObject(as, RSI);
+            jumpIf(as, CC_NE, done);
+            move(as, RDI, RCX);
+            callFunction(as, (Helper)jitWriteBarrier);
+            bind(as, done);
+            break;
+        }
+        case OP_CLOSE_UPVALUE:
+            lea(as, RDI, STACK_TOP, -8);
+            callFunction(as, (Helper)jitCloseUpvalues);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            break;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+            storeState(compiler, next);
+            moveImm(as, RDI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            moveImm(as, RSI, (uint64_t)(uintptr_t)&chunk->caches[readShort(code + 2)]);
+            callFunction(as, code[0] == OP_GET_PROPERTY ? (Helper)jitGetProperty : (Helper)jitSetProperty);
+            failOnFalse(compiler);
+            reloadStack(as);
+            break;
+        case OP_EQUAL: {
+            int slow = newLabel(as);
+            int done = newLabel(as);
+            load(as, RAX, STACK_TOP, -16);
+            load(as, RDX, STACK_TOP, -8);
+            checkInts(as, RAX, RDX);
+            jumpIf(as, CC_NE, slow);
+            alu32(as, ALU_CMP, RAX, RDX);
+            boxBool(as, CC_E);
+            store(as, STACK_TOP, -16, RCX);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            jump(as, done);
+            bind(as, slow);
+            store(as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+            callFunction(as, (Helper)jitEqual);
+            reloadStack(as);
+            bind(as, done);
+            break;
+        }
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULUS:
+        case OP_LESS:
+        case OP_GREATER:
+            arithmetic(compiler, offset, next, (OpCode)code[0], ON_STACK, 0, 0, NIL_VAL);
+            break;
+        case OP_ADD_LOCALS:
+            arithmetic(compiler, offset, next, OP_ADD, ON_LOCALS, code[1], code[2], NIL_VAL);
+            break;
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+            arithmetic(compiler, offset, next, code[0] == OP_ADD_CONSTANT ? OP_ADD : OP_SUBTRACT, WITH_CONSTANT,
+                       0, 0, constants[code[1]]);
+            break;
+        case OP_NOT:
+            load(as, RAX, STACK_TOP, -8);
+            checkFalsey(as, RAX);
+            boxBool(as, CC_BE);
+            store(as, STACK_TOP, -8, RCX);
+            break;
+        case OP_NEGATE: {
+            int exit = exitAt(compiler, offset);
+            int isDouble = newLabel(as);
+            int done = newLabel(as);
+            load(as, RAX, STACK_TOP, -8);
+            checkInt(as, RAX);
+            jumpIf(as, CC_NE, isDouble);
+            move32(as, RCX, RAX);
+            alu32(as, 0x85, RCX, RCX);
+            jumpIf(as, CC_E, exit);                     // -0 is a double
+            neg32(as, RCX);
+            jumpIf(as, CC_O, exit);
+            alu(as, ALU_OR, RCX, INT_TAG);
+            store(as, STACK_TOP, -8, RCX);
+            jump(as, done);
+            bind(as, isDouble);
+            checkNotDouble(as, RAX);
+            jumpIf(as, CC_E, exit);
+            flipSign(as, RAX);
+            store(as, STACK_TOP, -8, RAX);
+            bind(as, done);
+            break;
+        }
+        case OP_PRINT:
+            store(as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+            callFunction(as, (Helper)jitPrint);
+            reloadStack(as);
+            break;
+        case OP_JUMP:
+            jump(as, jumpTarget(compiler, offset, next + readShort(code + 1)));
+            break;
+        case OP_LOOP:
+            jump(as, jumpTarget(compiler, offset, next - readShort(code + 1)));
+            break;
+        case OP_JUMP_IF_FALSE:
+            load(as, RAX, STACK_TOP, -8);
+            checkFalsey(as, RAX);
+            jumpIf(as, CC_BE, jumpTarget(compiler, offset, next + readShort(code + 1)));
+            break;
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            load(as, RAX, STACK_TOP, -8);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            checkFalsey(as, RAX);
+            jumpIf(as, code[0] == OP_POP_JUMP_IF_FALSE ? CC_BE : CC_A,
+                   jumpTarget(compiler, offset, next + readShort(code + 1)));
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            compareAndJump(compiler, offset, code[0] == OP_JUMP_IF_NOT_LESS,
+                           jumpTarget(compiler, offset, next + readShort(code + 1)));
+            break;
+        case OP_INDEX_GET:
+        case OP_INDEX_SET:
+            indexing(compiler, offset, code[0] == OP_INDEX_SET);
+            break;
+        case OP_CALL:
+            storeState(compiler, next);
+            moveImm(as, RDI, code[1]);
+            callFunction(as, (Helper)jitCallValue);
+            afterCall(compiler);
+            break;
+        case OP_INVOKE:
+            storeState(compiler, next);
+            moveImm(as, RDI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            moveImm(as, RSI, code[2]);
+            moveImm(as, RDX, (uint64_t)(uintptr_t)&chunk->caches[readShort(code + 3)]);
+            callFunction(as, (Helper)jitInvoke);
+            afterCall(compiler);
+            break;
+        case OP_SUPER_INVOKE:
+            load(as, RAX, STACK_TOP, -8);
+            unboxObject(as, RDI, RAX);
+            aluImm(as, true, IMM_SUB, STACK_TOP, 8);
+            storeState(compiler, next);
+            moveImm(as, RSI, (uint64_t)(uintptr_t)AS_STRING(constants[code[1]]));
+            moveImm(as, RDX, code[2]);
+            moveImm(as, RCX, (uint64_t)(uintptr_t)&chunk->caches[readShort(code + 3)]);
+            callFunction(as, (Helper)jitSuperInvoke);
+            afterCall(compiler);
+            break;
+        case OP_SWITCH_INT:
+        case OP_SWITCH_STRING:
+            // the VM looks the case up, its code is found the way a call's is (the frame just stays the same)
+            storeState(compiler, next);
+            moveImm(as, RDI, (uint64_t)(uintptr_t)code);
+            callFunction(as, (Helper)jitSwitchTarget);
+            store(as, FRAME, offsetof(CallFrame, ip), RAX);
+            move(as, RCX, FRAME);
+            jump(as, compiler->switchFrame);
+            break;
+        case OP_RETURN: {
+            // the bottom frame's return is the interpreter's (the script or a fiber ends), any other returns to
+            // its caller's code right here
+            int closed = newLabel(as);
+            aluMemImm(as, IMM_CMP, VM_REG, offsetof(VM, frameCount), 1);
+            jumpIf(as, CC_E, exitAt(compiler, offset));
+            load(as, RAX, STACK_TOP, -8);
+            load(as, RCX, VM_REG, offsetof(VM, openUpvalues));
+            alu(as, 0x85, RCX, RCX);
+            jumpIf(as, CC_E, closed);
+            load(as, RDX, RCX, offsetof(ObjUpvalue, location));
+            alu(as, ALU_CMP, RDX, SLOTS);
+            jumpIf(as, CC_B, closed);
+            store(as, RSP, 0, RAX);
+            move(as, RDI, SLOTS);
+            callFunction(as, (Helper)jitCloseUpvalues);
+            load(as, RAX, RSP, 0);
+            bind(as, closed);
+            aluMemImm(as, IMM_SUB, VM_REG, offsetof(VM, frameCount), 1);
+            store(as, SLOTS, 0, RAX);
+            lea(as, STACK_TOP, SLOTS, 8);
+            store(as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+            lea(as, RCX, FRAME, -(int32_t)sizeof(CallFrame));
+            jump(as, compiler->switchFrame);
+            break;
+        }
+        default:
+            // OP_CLOSURE, OP_CLASS, OP_METHOD... run once, not in loops, and the tail calls and invokes take the frame over
+            jump(as, exitAt(compiler, offset));
+            break;
+    }
+}
+
+// the machine code for the frame's ip, NULL if its function has none
+static uint8_t* entryFor(CallFrame* frame) {
+    ObjFunction* function = frame->closure->function;
+    if (function->jit == NULL) return NULL;
+    return function->jit->code + function->jit->entries[frame->ip - function->chunk.code];
+}
+
+// called by jitRun() as int (*)(VM* vm, CallFrame* frame, uint8_t* target), it returns 1 once it has left the state
+// to run() and 0 after a runtime error, the machine code in between runs on an aligned stack with 8 bytes to spare at [rsp]
+static void prologue(Assembler* as) {
+    pushReg(as, RBP);
+    pushReg(as, RBX);
+    pushReg(as, R12);
+    pushReg(as, R13);
+    pushReg(as, R14);
+    pushReg(as, R15);
+    aluImm(as, true, IMM_SUB, RSP, 8);
+    move(as, VM_REG, RDI);
+    move(as, FRAME, RSI);
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    load(as, STACK_TOP, VM_REG, offsetof(VM, stackTop));
+    moveImm(as, INT_TAG, QNAN | INT_BIT);
+    jumpTo(as, RDX);
+}
+
+static void epilogue(JitCompiler* compiler) {
+    Assembler* as = &compiler->as;
+    int done = newLabel(as);
+    int* exits = compiler->exits;
+    for (int offset = 0; offset < compiler->chunk->count; offset++) {
+        if (exits[offset] == -1) continue;
+        bind(as, exits[offset]);
+        moveImm(as, RAX, (uint64_t)(uintptr_t)(compiler->chunk->code + offset));
+        store(as, FRAME, offsetof(CallFrame, ip), RAX);
+        jump(as, compiler->leave);
+    }
+
+    bind(as, compiler->leave);
+    store(as, VM_REG, offsetof(VM, stackTop), STACK_TOP);
+    bind(as, compiler->leaveStored);
+    moveImm(as, RAX, 1);
+    bind(as, done);
+    aluImm(as, true, IMM_ADD, RSP, 8);
+    popReg(as, R15);
+    popReg(as, R14);
+    popReg(as, R13);
+    popReg(as, R12);
+    popReg(as, RBX);
+    popReg(as, RBP);
+    emit8(as, 0xC3);
+
+    bind(as, compiler->error);
+    alu32(as, ALU_XOR, RAX, RAX);
+    jump(as, done);
+
+    bind(as, compiler->switchFrame);
+    move(as, FRAME, RCX);
+    move(as, RDI, RCX);
+    callFunction(as, (Helper)entryFor);
+    alu(as, 0x85, RAX, RAX);
+    jumpIf(as, CC_E, compiler->leaveStored);
+    load(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    reloadStack(as);
+    jumpTo(as, RAX);
+}
+
+static void freeAssembler(Assembler* as) {
+    free(as->bytes);
+    free(as->labels);
+    free(as->fixups);
+}
+
+// asked every time, a cached copy would be shared by every isolate's thread (compiling isn't frequent enough to matter)
+static size_t pageSize() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+bool jitCompile(ObjFunction* function) {
+    if (function->jit != NULL) return true;
+    Chunk* chunk = &function->chunk;
+    JitCompiler compiler;
+    memset(&compiler, 0, sizeof(compiler));
+    compiler.chunk = chunk;
+    Assembler* as = &compiler.as;
+
+    // a label for every bytecode offset comes first, label n is offset n (one that doesn't start an instruction
+    // never gets bound)
+    for (int i = 0; i < chunk->count; i++) newLabel(as);
+    compiler.exits = (int*)malloc(sizeof(int) * chunk->count);
+    if (compiler.exits == NULL) exit(1);
+    compiler.starts = (bool*)calloc(chunk->count, sizeof(bool));
+    if (compiler.starts == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) compiler.exits[i] = -1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) compiler.starts[offset] = true;
+    compiler.leave = newLabel(as);
+    compiler.leaveStored = newLabel(as);
+    compiler.error = newLabel(as);
+    compiler.switchFrame = newLabel(as);
+
+    prologue(as);
+    for (int offset = 0; offset < chunk->count; ) {
+        int next = offset + instructionLength(chunk, offset);
+        bind(as, offset);
+        compileInstruction(&compiler, offset, next);
+        offset = next;
+    }
+    epilogue(&compiler);
+
+    bool ok = true;
+    for (int i = 0; i < as->fixupCount; i++) {
+        Fixup* fixup = &as->fixups[i];
+        int target = as->labels[fixup->label];
+        if (target == -1) {            // can't happen, but code jumping to a random place would be worse than none
+            ok = false;
+            break;
+        }
+        uint32_t distance = (uint32_t)(target - (fixup->at + 4));
+        memcpy(as->bytes + fixup->at, &distance, 4);
+    }
+
+    JitCode* jit = NULL;
+    if (ok) {
+        size_t page = pageSize();
+        size_t size = ((size_t)as->count + page - 1) / page * page;
+        void* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        jit = (JitCode*)malloc(sizeof(JitCode));
+        uint32_t* entries = (uint32_t*)calloc(chunk->count, sizeof(uint32_t));
+        if (code != MAP_FAILED) memcpy(code, as->bytes, as->count);
+        // writable or executable, never both, and where executable memory isn't allowed at all (SELinux's
+        // deny_execmem, PaX) the function just stays interpreted
+        if (code == MAP_FAILED || jit == NULL || entries == NULL || mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+            if (code != MAP_FAILED) munmap(code, size);
+            free(jit);
+            free(entries);
+            jit = NULL;
+        } else {
+            for (int i = 0; i < chunk->count; i++) {
+                if (as->labels[i] != -1) entries[i] = (uint32_t)as->labels[i];
+            }
+            jit->code = (uint8_t*)code;
+            jit->size = size;
+            jit->entries = entries;
+        }
+    }
+
+    free(compiler.exits);
+    free(compiler.starts);
+    freeAssembler(as);
+    function->jit = jit;
+    if (jit == NULL) function->hotness = INT32_MIN;         // don't try again
+    return jit != NULL;
+}
+
+typedef int (*JitEntry)(VM* isolate, CallFrame* frame, uint8_t* target);
+
+bool jitRun(CallFrame* frame) {
+    JitEntry entry;
+    uint8_t* code = frame->closure->function->jit->code;
+    memcpy(&entry, &code, sizeof(entry));           // C has no cast from a data pointer to a function pointer
+    return entry(vm, frame, entryFor(frame)) != 0;
+}
+
+void jitFree(ObjFunction* function) {
+    if (function->jit == NULL) return;
+    munmap(function->jit->code, function->jit->size);
+    free(function->jit->entries);
+    free(function->jit);
+    function->jit = NULL;
+}
+#endif
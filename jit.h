@@ -0,0 +1,41 @@
+// include guard
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef JIT
+// baseline JIT: once a function has been called or gone round its loops JIT_HOTNESS times, each of its instructions is
+// translated into a fixed machine code template, stitched together into one executable block (see jit.c)
+// the templates keep the VM's stack and frames exactly as run() would have them, so the interpreter can take over
+// at any instruction: the machine code leaves to it on a type guard failing (a double where ints were compiled for is
+// fine, a string in a subtraction isn't), and for the instructions it has no template for
+#ifndef JIT_HOTNESS
+#define JIT_HOTNESS 1000
+#endif
+
+typedef struct JitCode JitCode;                 // a function's machine code, ObjFunction's jit (private to jit.c)
+
+bool jitCompile(ObjFunction* function);     // false if it can't be (function->hotness is set so it isn't tried again)
+bool jitRun(CallFrame* frame);              // runs the top frame's code from its ip until it leaves to run(), false after a runtime error
+void jitFree(ObjFunction* function);
+
+// the VM's side of it (in vm.c): what the templates call for the instructions that do more than arithmetic
+// frame->ip (past the instruction) and vm->stackTop are stored before each, they return false after a runtime error
+bool jitCallValue(int argCount);
+bool jitInvoke(ObjString* name, int argCount, InlineCache* cache);
+bool jitSuperInvoke(ObjClass* superclass, ObjString* name, int argCount, InlineCache* cache);
+bool jitGetProperty(ObjString* name, InlineCache* cache);
+bool jitSetProperty(ObjString* name, InlineCache* cache);
+bool jitAddStrings();
+void jitEqual();
+void jitPrint();
+uint8_t* jitSwitchTarget(uint8_t* ip);      // where the switch instruction at ip sends the value on top, nothing's stored for it
+void jitCloseUpvalues(Value* last);
+void jitWriteBarrier(Obj* object, Value value);
+#endif
+
+// end include guard
+#endif
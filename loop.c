@@ -0,0 +1,491 @@
+// getaddrinfo() and the sockets are POSIX, not part of C99 (macOS and the BSDs show them anyway, and
+// would hide kqueue's types if asked for POSIX only)
+#ifdef __linux__
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "loop.h"
+#include "memory.h"
+#include "output.h"
+#include "vm.h"
+
+#ifdef EVENT_LOOP
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef EVENT_LOOP_EPOLL
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+// events taken from the kernel per wait
+#define EVENT_BATCH 64
+#endif
+
+#ifdef EVENT_LOOP
+// a fiber asleep until deadline (seconds on the monotonic clock)
+typedef struct {
+    double deadline;
+    ObjFiber* fiber;
+} Timer;
+
+// the fibers waiting to read and to write an fd
+typedef struct {
+    ObjFiber* reader;
+    ObjFiber* writer;
+    int registered;             // the epoll events it's registered for, 0 if it isn't (kqueue's go away once they fire)
+} Watch;
+#endif
+
+struct EventLoop {
+    int readyStart;             // the ready fibers, a ring buffer
+    int readyCount;
+    int readyCapacity;
+    ObjFiber** ready;
+    int untilPoll;              // fibers to run before the waiting ones get another look while some are ready
+
+#ifdef EVENT_LOOP
+    int timerCount;             // sleeping fibers, a binary min-heap on the deadline
+    int timerCapacity;
+    Timer* timers;
+    int watchCapacity;          // indexed by fd
+    Watch* watches;
+    int watching;               // # of fibers waiting on an fd
+    int poller;                 // the epoll or kqueue descriptor, -1 until the first wait
+#endif
+};
+
+static EventLoop* getLoop() {
+    if (vm->loop != NULL) return vm->loop;
+    EventLoop* loop = (EventLoop*)calloc(1, sizeof(EventLoop));
+    if (loop == NULL) exit(1);
+#ifdef EVENT_LOOP
+    loop->poller = -1;
+#endif
+    vm->loop = loop;
+    return loop;
+}
+
+void loopReady(ObjFiber* fiber) {
+    EventLoop* loop = getLoop();
+    if (loop->readyCount == loop->readyCapacity) {
+        // unwrap the ring into the bigger array
+        int capacity = loop->readyCapacity;
+        ObjFiber** ready = (ObjFiber**)malloc(sizeof(ObjFiber*) * GROW_CAPACITY(capacity));
+        if (ready == NULL) exit(1);
+        for (int i = 0; i < loop->readyCount; i++) ready[i] = loop->ready[(loop->readyStart + i) % capacity];
+        free(loop->ready);
+        loop->ready = ready;
+        loop->readyStart = 0;
+        loop->readyCapacity = GROW_CAPACITY(capacity);
+    }
+    fiber->state = FIBER_READY;
+    loop->ready[(loop->readyStart + loop->readyCount++) % loop->readyCapacity] = fiber;
+}
+
+int loopReadyCount() {
+    return vm->loop == NULL ? 0 : vm->loop->readyCount;
+}
+
+bool loopIdle() {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return true;
+#ifdef EVENT_LOOP
+    return loop->readyCount == 0 && loop->timerCount == 0 && loop->watching == 0;
+#else
+    return loop->readyCount == 0;
+#endif
+}
+
+#ifdef EVENT_LOOP
+static void* growArray(void* array, size_t size, int* capacity) {
+    *capacity = GROW_CAPACITY(*capacity);
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+void loopSleep(ObjFiber* fiber, double seconds) {
+    EventLoop* loop = getLoop();
+    if (loop->timerCount == loop->timerCapacity) {
+        loop->timers = (Timer*)growArray(loop->timers, sizeof(Timer), &loop->timerCapacity);
+    }
+    fiber->state = FIBER_WAITING;
+
+    // sift the new timer up to where it belongs
+    Timer timer = { monotonicSeconds() + seconds, fiber };
+    int i = loop->timerCount++;
+    while (i > 0 && loop->timers[(i - 1) / 2].deadline > timer.deadline) {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i] = timer;
+}
+
+// takes the timer with the earliest deadline off the heap
+static void popTimer(EventLoop* loop) {
+    Timer last = loop->timers[--loop->timerCount];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= loop->timerCount) break;
+        if (child + 1 < loop->timerCount && loop->timers[child + 1].deadline < loop->timers[child].deadline) child++;
+        if (loop->timers[child].deadline >= last.deadline) break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    if (loop->timerCount > 0) loop->timers[i] = last;
+}
+
+static void openPoller(EventLoop* loop) {
+    if (loop->poller >= 0) return;
+#ifdef EVENT_LOOP_EPOLL
+    loop->poller = epoll_create1(EPOLL_CLOEXEC);
+#else
+    loop->poller = kqueue();
+#endif
+    if (loop->poller < 0) {
+        perror("Can't start the event loop");
+        exit(1);
+    }
+}
+
+#ifdef EVENT_LOOP_EPOLL
+// has epoll wait for what the fibers on fd's watch are waiting for (and nothing once no fiber is)
+static void updateWatch(EventLoop* loop, int fd) {
+    Watch* watch = &loop->watches[fd];
+    int events = (watch->reader != NULL ? EPOLLIN : 0) | (watch->writer != NULL ? EPOLLOUT : 0);
+    if (events == watch->registered) return;
+
+    struct epoll_event event;
+    event.events = (uint32_t)events;
+    event.data.fd = fd;
+    int operation = events == 0 ? EPOLL_CTL_DEL : watch->registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    epoll_ctl(loop->poller, operation, fd, &event);
+    watch->registered = events;
+}
+#endif
+
+bool loopWatch(ObjFiber* fiber, int fd, bool write) {
+    EventLoop* loop = getLoop();
+    openPoller(loop);
+    while (fd >= loop->watchCapacity) {
+        int oldCapacity = loop->watchCapacity;
+        loop->watches = (Watch*)growArray(loop->watches, sizeof(Watch), &loop->watchCapacity);
+        memset(loop->watches + oldCapacity, 0, sizeof(Watch) * (loop->watchCapacity - oldCapacity));
+    }
+
+    ObjFiber** waiter = write ? &loop->watches[fd].writer : &loop->watches[fd].reader;
+    if (*waiter != NULL) return false;
+    *waiter = fiber;
+    fiber->state = FIBER_WAITING;
+    loop->watching++;
+
+#ifdef EVENT_LOOP_EPOLL
+    updateWatch(loop, fd);
+#else
+    struct kevent change;
+    EV_SET(&change, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    kevent(loop->poller, &change, 1, NULL, 0, NULL);
+#endif
+    return true;
+}
+
+bool loopWatched(int fd) {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL || fd < 0 || fd >= loop->watchCapacity) return false;
+    return loop->watches[fd].reader != NULL || loop->watches[fd].writer != NULL;
+}
+
+// queues the fiber waiting to read (or write) fd, if there is one
+static void wakeWatcher(EventLoop* loop, int fd, bool write) {
+    ObjFiber** waiter = write ? &loop->watches[fd].writer : &loop->watches[fd].reader;
+    if (*waiter == NULL) return;
+    loopReady(*waiter);
+    *waiter = NULL;
+    loop->watching--;
+}
+
+// waits for a socket or a timer, as long as the earliest timer (no longer than timeout seconds, forever below 0),
+// and queues the fibers that were waiting for whatever happened, what's been printed so far gets written out first
+static void pollEvents(EventLoop* loop, double timeout) {
+    openPoller(loop);
+    if (loop->timerCount > 0) {
+        double untilTimer = loop->timers[0].deadline - monotonicSeconds();
+        if (untilTimer < 0) untilTimer = 0;
+        if (timeout < 0 || untilTimer < timeout) timeout = untilTimer;
+    }
+    // the program may not print again until whatever it waits for happens, or ever if it gets killed meanwhile
+    if (timeout != 0) flushOutput();
+
+#ifdef EVENT_LOOP_EPOLL
+    struct epoll_event events[EVENT_BATCH];
+    // rounded up, so a timer that's due in less than a millisecond isn't waited for over and over with a timeout of 0
+    int milliseconds = timeout < 0 ? -1 : (int)(timeout * 1000 + 0.999);
+    int count = epoll_wait(loop->poller, events, EVENT_BATCH, milliseconds);
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        // errors and hang-ups wake both, whatever they try next finds out what happened
+        uint32_t ready = events[i].events;
+        if (ready & (EPOLLIN | EPOLLERR | EPOLLHUP)) wakeWatcher(loop, fd, false);
+        if (ready & (EPOLLOUT | EPOLLERR | EPOLLHUP)) wakeWatcher(loop, fd, true);
+        updateWatch(loop, fd);
+    }
+#else
+    struct kevent events[EVENT_BATCH];
+    struct timespec wait;
+    if (timeout >= 0) {
+        wait.tv_sec = (time_t)timeout;
+        wait.tv_nsec = (long)((timeout - (double)wait.tv_sec) * 1e9);
+    }
+    int count = kevent(loop->poller, NULL, 0, events, EVENT_BATCH, timeout < 0 ? NULL : &wait);
+    for (int i = 0; i < count; i++) {
+        wakeWatcher(loop, (int)events[i].ident, events[i].filter == EVFILT_WRITE);
+    }
+#endif
+
+    double time = monotonicSeconds();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= time) {
+        ObjFiber* fiber = loop->timers[0].fiber;
+        popTimer(loop);
+        loopReady(fiber);
+    }
+}
+#endif
+
+ObjFiber* loopNext() {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return NULL;
+
+#ifdef EVENT_LOOP
+    // while fibers keep being ready the ones waiting still get a look in, once per round of the queue
+    if (loop->readyCount > 0 && (loop->timerCount > 0 || loop->watching > 0) && --loop->untilPoll <= 0) {
+        pollEvents(loop, 0);
+        loop->untilPoll = loop->readyCount;
+    }
+    while (loop->readyCount == 0) {
+        if (loop->timerCount == 0 && loop->watching == 0) return NULL;
+        pollEvents(loop, -1);
+    }
+#else
+    if (loop->readyCount == 0) return NULL;
+#endif
+
+    ObjFiber* fiber = loop->ready[loop->readyStart];
+    loop->readyStart = (loop->readyStart + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    return fiber;
+}
+
+void abandonFiber(ObjFiber* fiber) {
+    while (fiber != NULL && fiber != vm->rootFiber) {
+        ObjFiber* caller = fiber->caller;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber->retryArgs = -1;
+        ioCancel(fiber);
+        fiber = caller;
+    }
+}
+
+void resetLoop() {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return;
+    for (int i = 0; i < loop->readyCount; i++) {
+        abandonFiber(loop->ready[(loop->readyStart + i) % loop->readyCapacity]);
+    }
+    loop->readyCount = 0;
+#ifdef EVENT_LOOP
+    for (int i = 0; i < loop->timerCount; i++) abandonFiber(loop->timers[i].fiber);
+    loop->timerCount = 0;
+    for (int fd = 0; fd < loop->watchCapacity; fd++) {
+        abandonFiber(loop->watches[fd].reader);
+        abandonFiber(loop->watches[fd].writer);
+    }
+    memset(loop->watches, 0, sizeof(Watch) * loop->watchCapacity);
+    loop->watching = 0;
+    // what it was registered for goes with it
+    if (loop->poller >= 0) close(loop->poller);
+    loop->poller = -1;
+#endif
+}
+
+void ioCancel(ObjFiber* fiber) {
+#ifdef EVENT_LOOP
+    if (fiber->ioFd >= 0 && fiber->ioChars != NULL) close(fiber->ioFd);       // readFile()'s own file, a socket isn't
+#endif
+    free(fiber->ioChars);
+    fiber->ioFd = -1;
+    fiber->ioDone = 0;
+    fiber->ioChars = NULL;
+    fiber->ioCapacity = 0;
+}
+
+void markLoopRoots() {
+    EventLoop* loop = vm->loop;
+    for (int i = 0; i < loop->readyCount; i++) {
+        markObject((Obj*)loop->ready[(loop->readyStart + i) % loop->readyCapacity]);
+    }
+#ifdef EVENT_LOOP
+    for (int i = 0; i < loop->timerCount; i++) markObject((Obj*)loop->timers[i].fiber);
+    for (int fd = 0; fd < loop->watchCapacity; fd++) {
+        markObject((Obj*)loop->watches[fd].reader);
+        markObject((Obj*)loop->watches[fd].writer);
+    }
+#endif
+}
+
+void freeLoop() {
+    EventLoop* loop = vm->loop;
+    if (loop == NULL) return;
+    free(loop->ready);
+#ifdef EVENT_LOOP
+    free(loop->timers);
+    free(loop->watches);
+    if (loop->poller >= 0) close(loop->poller);
+#endif
+    free(loop);
+    vm->loop = NULL;
+}
+
+#ifdef EVENT_LOOP
+// ----- the system calls -----
+
+// what the last call that failed said, getaddrinfo() has error codes of its own
+static THREAD_LOCAL const char* lastError = NULL;
+
+const char* ioError() {
+    return lastError != NULL ? lastError : "unknown error";
+}
+
+static int failed() {
+    lastError = strerror(errno);
+    return IO_ERROR;
+}
+
+static bool setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0 && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+// a new non-blocking socket (which doesn't raise SIGPIPE where that's a socket option rather than a send() flag)
+static int newSocket(int family) {
+    int fd = socket(family, SOCK_STREAM, 0);
+    if (fd < 0) return failed();
+    if (!setNonBlocking(fd)) {
+        int result = failed();
+        close(fd);
+        return result;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+
+int ioListen(int port) {
+    int fd = newSocket(AF_INET);
+    if (fd < 0) return fd;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        int result = failed();
+        close(fd);
+        return result;
+    }
+    return fd;
+}
+
+int ioAccept(int listener) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? IO_AGAIN : failed();
+    if (!setNonBlocking(fd)) {
+        int result = failed();
+        close(fd);
+        return result;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    return fd;
+}
+
+int ioConnect(const char* host, int port) {
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses;
+    int status = getaddrinfo(host, service, &hints, &addresses);
+    if (status != 0) {
+        lastError = gai_strerror(status);
+        return IO_ERROR;
+    }
+
+    // the first address a connection can be started to, whether it gets made shows when the socket is used
+    int fd = IO_ERROR;
+    for (struct addrinfo* address = addresses; address != NULL; address = address->ai_next) {
+        fd = newSocket(address->ai_family);
+        if (fd < 0) continue;
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS) break;
+        failed();
+        close(fd);
+        fd = IO_ERROR;
+    }
+    freeaddrinfo(addresses);
+    return fd;
+}
+
+long ioRead(int fd, char* chars, size_t size) {
+    ssize_t count = read(fd, chars, size);
+    if (count < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? IO_AGAIN : failed();
+    return (long)count;
+}
+
+long ioSend(int socket, const char* chars, size_t size) {
+#ifdef MSG_NOSIGNAL
+    ssize_t count = send(socket, chars, size, MSG_NOSIGNAL);
+#else
+    ssize_t count = send(socket, chars, size, 0);
+#endif
+    // ENOTCONN: a connection that's still being made where send() doesn't say EAGAIN for that
+    if (count < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOTCONN ? IO_AGAIN : failed();
+    return (long)count;
+}
+
+int ioOpen(const char* path) {
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return failed();
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+bool ioAlwaysReady(int fd) {
+    struct stat status;
+    return fstat(fd, &status) == 0 && S_ISREG(status.st_mode);
+}
+
+int ioClose(int fd) {
+    return close(fd) == 0 ? 0 : failed();
+}
+#endif
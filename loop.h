@@ -0,0 +1,48 @@
+// include guard
+#ifndef clox_loop_h
+#define clox_loop_h
+
+#include "common.h"
+#include "object.h"
+
+// the scheduler behind spawn() and the event loop behind the I/O natives in vm.c, one of each per VM (vm->loop)
+// fibers that are ready to run wait their turn in a queue, the ones waiting for a timer or a socket get queued once
+// that's done, and when nothing is ready the loop sleeps in epoll_wait()/kevent() until something is
+// only the queue is there without EVENT_LOOP, fibers can still spawn() and yield() to each other then
+
+typedef struct EventLoop EventLoop;
+
+void loopReady(ObjFiber* fiber);                    // queues fiber (it becomes FIBER_READY) behind the ones already queued
+ObjFiber* loopNext();                               // the next fiber to run, waits for one if none is ready, NULL if nothing's even waiting
+bool loopIdle();                                    // no fiber is queued or waiting for anything
+int loopReadyCount();
+void abandonFiber(ObjFiber* fiber);                 // marks it done (and the fibers blocked in resuming it, up to the main one)
+void resetLoop();                                   // abandons every fiber that's queued or waiting, after a runtime error
+void ioCancel(ObjFiber* fiber);                     // drops whatever an I/O native had under way for fiber
+void markLoopRoots();
+void freeLoop();
+
+#ifdef EVENT_LOOP
+void loopSleep(ObjFiber* fiber, double seconds);    // fiber waits that long (it becomes FIBER_WAITING)
+bool loopWatch(ObjFiber* fiber, int fd, bool write);    // fiber waits until fd can be read (or written), false if another one already is
+bool loopWatched(int fd);                           // whether a fiber waits on fd
+
+// the non-blocking system calls the I/O natives make: they return what the call gives back, IO_AGAIN when it would have
+// to wait (the fiber then waits with loopWatch() and the native tries again) or IO_ERROR, ioError() says what went wrong
+#define IO_ERROR (-1)
+#define IO_AGAIN (-2)
+
+int ioListen(int port);                             // a TCP socket listening on every interface
+int ioAccept(int listener);
+int ioConnect(const char* host, int port);          // the connection is made in the background, reading or writing waits for it
+                                                    // (looking host up doesn't, getaddrinfo() has no non-blocking form)
+long ioRead(int fd, char* chars, size_t size);      // 0 at the end
+long ioSend(int socket, const char* chars, size_t size);
+int ioOpen(const char* path);                       // for reading
+bool ioAlwaysReady(int fd);                         // a regular file, which epoll/kqueue can't wait for (reading one never has to)
+int ioClose(int fd);
+const char* ioError();
+#endif
+
+// end include guard
+#endif
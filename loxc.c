@@ -0,0 +1,434 @@
+// open(), fstat() and mmap() are POSIX, not part of C99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "loxc.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+/* Layout of a .loxc file, every integer is a little-endian u32 unless noted:
+    "LOXC", version, source hash (u64), source length, payload hash (u64, of everything after it)
+    string count, then each string as its length + characters (every string the functions use, each once)
+    global count, then the string index of the name in each global slot (the compiler baked the slots into the code)
+    the script's function, where a function is:
+        arity, upvalue count, name (string index + 1, 0 for the script)
+        code length + code bytes, line count + (offset, line) pairs, inline cache count
+        constant count + constants, each a tag byte then a number (u64 bits), string index or function
+*/
+
+// a file being mapped, the functions loaded from it point into it for their code
+typedef struct Mapping {
+    struct Mapping* next;
+    void* bytes;
+    size_t size;
+} Mapping;
+
+// the same hash as the strings', all 64 bits of it since a collision here means running stale code
+// (the payload gets one too, the code in it is run as read so a damaged file must not get that far)
+static uint64_t hashSource(const char* source, size_t length) {
+    return hashBytes(source, length);
+}
+
+// script.lox -> script.loxc, the caller frees it
+static char* cachePath(const char* path) {
+    size_t length = strlen(path);
+    char* result = (char*)malloc(length + 2);
+    if (result == NULL) exit(1);
+    memcpy(result, path, length);
+    result[length] = 'c';
+    result[length + 1] = '\0';
+    return result;
+}
+
+// ----- writing -----
+
+// a growing byte buffer (plain realloc, writing a cache has nothing for the GC to collect)
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    Buffer strings;             // the string section, without its count
+    Buffer body;                // globals and functions
+    uint32_t stringCount;
+    Table stringIndex;          // string -> its index in the string section
+    bool failed;                // hit a constant the format can't hold
+} Writer;
+
+static void writeBytes(Buffer* buffer, const void* bytes, size_t count) {
+    if (count == 0) return;
+    if (buffer->capacity < buffer->count + count) {
+        while (buffer->capacity < buffer->count + count) buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        buffer->bytes = (uint8_t*)realloc(buffer->bytes, buffer->capacity);
+        if (buffer->bytes == NULL) exit(1);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+
+static void writeByte(Buffer* buffer, uint8_t byte) {
+    writeBytes(buffer, &byte, 1);
+}
+
+static void writeU32(Buffer* buffer, uint32_t value) {
+    uint8_t bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff };
+    writeBytes(buffer, bytes, 4);
+}
+
+static void writeU64(Buffer* buffer, uint64_t value) {
+    writeU32(buffer, (uint32_t)value);
+    writeU32(buffer, (uint32_t)(value >> 32));
+}
+
+// index of string in the string section, adding it the first time it comes up
+static uint32_t stringRef(Writer* writer, ObjString* string) {
+    Value index;
+    if (tableGet(&writer->stringIndex, string, &index)) return (uint32_t)AS_INT(index);
+
+    uint32_t result = writer->stringCount++;
+    tableSet(&writer->stringIndex, string, INT_VAL(result));
+    writeU32(&writer->strings, (uint32_t)string->length);
+    writeBytes(&writer->strings, string->chars, string->length);
+    return result;
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    Buffer* out = &writer->body;
+    Chunk* chunk = &function->chunk;
+
+    writeU32(out, (uint32_t)function->arity);
+    writeU32(out, (uint32_t)function->upvalueCount);
+    writeU32(out, function->name == NULL ? 0 : stringRef(writer, function->name) + 1);
+
+    writeU32(out, (uint32_t)chunk->count);
+    writeBytes(out, chunk->code, chunk->count);
+    writeU32(out, (uint32_t)chunk->lineCount);
+    for (int i = 0; i < chunk->lineCount; i++) {
+        writeU32(out, (uint32_t)chunk->lines[i].offset);
+        writeU32(out, (uint32_t)chunk->lines[i].line);
+    }
+    writeU32(out, (uint32_t)chunk->cacheCount);
+
+    writeU32(out, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeByte(out, 'n');
+            writeU64(out, bits);
+        } else if (IS_STRING(constant)) {
+            writeByte(out, 's');
+            writeU32(out, stringRef(writer, AS_STRING(constant)));
+        } else if (IS_FUNCTION(constant)) {
+            writeByte(out, 'f');
+            writeFunction(writer, AS_FUNCTION(constant));
+        } else {
+            writer->failed = true;
+        }
+    }
+}
+
+// to a temporary file first and renamed over the old one, so a reader never sees a half written cache
+void saveCompiled(const char* path, const char* source, ObjFunction* function) {
+    Writer writer = { { NULL, 0, 0 }, { NULL, 0, 0 }, 0, { 0 }, false };
+    initTable(&writer.stringIndex);
+
+    writeU32(&writer.body, (uint32_t)vm->globalNames.count);
+    for (int i = 0; i < vm->globalNames.count; i++) {
+        writeU32(&writer.body, stringRef(&writer, AS_STRING(vm->globalNames.values[i])));
+    }
+    writeFunction(&writer, function);
+
+    if (!writer.failed) {
+        Buffer payload = { NULL, 0, 0 };
+        writeU32(&payload, writer.stringCount);
+        writeBytes(&payload, writer.strings.bytes, writer.strings.count);
+        writeBytes(&payload, writer.body.bytes, writer.body.count);
+
+        size_t length = strlen(source);
+        Buffer header = { NULL, 0, 0 };
+        writeBytes(&header, "LOXC", 4);
+        writeU32(&header, LOXC_VERSION);
+        writeU64(&header, hashSource(source, length));
+        writeU32(&header, (uint32_t)length);
+        writeU64(&header, hashBytes((const char*)payload.bytes, payload.count));
+
+        char* target = cachePath(path);
+        char* temporary = (char*)malloc(strlen(target) + 5);
+        if (temporary == NULL) exit(1);
+        sprintf(temporary, "%s.tmp", target);
+
+        FILE* file = fopen(temporary, "wb");
+        if (file != NULL) {
+            bool written = fwrite(header.bytes, 1, header.count, file) == header.count &&
+                           fwrite(payload.bytes, 1, payload.count, file) == payload.count;
+            if (fclose(file) != 0) written = false;
+            if (!written || rename(temporary, target) != 0) remove(temporary);
+        }
+
+        free(temporary);
+        free(target);
+        free(header.bytes);
+        free(payload.bytes);
+    }
+
+    freeTable(&writer.stringIndex);
+    free(writer.strings.bytes);
+    free(writer.body.bytes);
+}
+
+// ----- reading -----
+
+// a string of the string section, turned into an ObjString the first time a function uses it
+typedef struct {
+    const char* chars;
+    uint32_t length;
+    ObjString* string;
+} StringRef;
+
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+    StringRef* strings;
+    uint32_t stringCount;
+    bool failed;                // ran off the end of the file or hit something malformed, nothing read after that counts
+} Reader;
+
+// the next count bytes of the file (NULL if there aren't that many left)
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint32_t readU32(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static uint64_t readU64(Reader* reader) {
+    uint64_t low = readU32(reader);
+    return low | ((uint64_t)readU32(reader) << 32);
+}
+
+// the string with the given index, interned like any other (so it's the same object the compiler would have made)
+static ObjString* readString(Reader* reader, uint32_t index) {
+    if (index >= reader->stringCount) {
+        reader->failed = true;
+        return NULL;
+    }
+
+    StringRef* ref = &reader->strings[index];
+    if (ref->string == NULL) ref->string = copyString(ref->chars, (int)ref->length);
+    return ref->string;
+}
+
+// the function, its constants and nested functions, each kept on the stack while it's being filled in
+static ObjFunction* readFunction(Reader* reader) {
+    ObjFunction* function = newFunction();
+    push(OBJ_VAL(function));
+    Chunk* chunk = &function->chunk;
+
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    uint32_t name = readU32(reader);
+    if (name != 0) {
+        function->name = readString(reader, name - 1);
+        writeBarrier((Obj*)function);
+    }
+
+    // borrowed straight from the mapping, capacity 0 tells freeChunk() the code isn't its to free
+    uint32_t codeCount = readU32(reader);
+    chunk->code = (uint8_t*)readBytes(reader, codeCount);
+    chunk->count = reader->failed ? 0 : (int)codeCount;
+
+    uint32_t lineCount = readU32(reader);
+    if (!reader->failed && (size_t)(reader->end - reader->current) / 8 >= lineCount && lineCount > 0) {
+        chunk->lines = ALLOCATE(LineStart, lineCount);
+        chunk->lineCapacity = (int)lineCount;
+        for (uint32_t i = 0; i < lineCount; i++) {
+            chunk->lines[i].offset = (int)readU32(reader);
+            chunk->lines[i].line = (int)readU32(reader);
+        }
+        chunk->lineCount = (int)lineCount;
+    }
+
+    uint32_t cacheCount = readU32(reader);
+    if (!reader->failed && cacheCount <= UINT16_MAX + 1) {
+        for (uint32_t i = 0; i < cacheCount; i++) addInlineCache(chunk);
+    } else {
+        reader->failed = true;
+    }
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+        const uint8_t* tag = readBytes(reader, 1);
+        if (tag == NULL) break;
+
+        Value constant;
+        if (*tag == 'n') {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            constant = numberValue(number);                 // ints are stored as doubles, see value.h
+        } else if (*tag == 's') {
+            ObjString* string = readString(reader, readU32(reader));
+            if (string == NULL) break;
+            constant = OBJ_VAL(string);
+        } else if (*tag == 'f') {
+            constant = OBJ_VAL(readFunction(reader));
+        } else {
+            reader->failed = true;
+            break;
+        }
+
+        addConstant(chunk, constant);
+        writeBarrierValue((Obj*)function, constant);
+    }
+
+    // worked out again like the compiler does, what call() makes room for isn't taken from a file
+    if (!reader->failed) function->maxSlots = maxStackDepth(chunk, function->arity + 1);
+    pop();
+    return function;
+}
+
+// maps the whole file read-only, NULL if it can't be opened
+static void* mapFile(const char* path, size_t* size) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER fileSize;
+    void* bytes = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            bytes = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);               // the view keeps the mapping alive
+        }
+        *size = (size_t)fileSize.QuadPart;
+    }
+    CloseHandle(file);
+    return bytes;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+
+    struct stat info;
+    void* bytes = NULL;
+    if (fstat(file, &info) == 0 && info.st_size > 0) {
+        bytes = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (bytes == MAP_FAILED) bytes = NULL;
+        *size = (size_t)info.st_size;
+    }
+    close(file);                                // the mapping outlives the descriptor
+    return bytes;
+#endif
+}
+
+static void unmapFile(void* bytes, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(bytes);
+#else
+    munmap(bytes, size);
+#endif
+}
+
+// 1. Map the file and check it was written by this version, for exactly this source, and is what was written
+// (anything else returns NULL: interpretFile() then compiles the script and writes a good cache over the bad one)
+// 2. Find the strings (without making objects for them yet) and claim the same global slots the compiler would have
+// 3. Read the functions, each chunk's code pointing into the mapping, which stays mapped until freeCompiled()
+ObjFunction* loadCompiled(const char* path, const char* source) {
+    char* file = cachePath(path);
+    size_t size = 0;
+    void* bytes = mapFile(file, &size);
+    free(file);
+    if (bytes == NULL) return NULL;
+
+    size_t length = strlen(source);
+    Reader reader = { (const uint8_t*)bytes, (const uint8_t*)bytes + size, NULL, 0, false };
+    const uint8_t* magic = readBytes(&reader, 4);
+    if (magic == NULL || memcmp(magic, "LOXC", 4) != 0 ||
+        readU32(&reader) != LOXC_VERSION ||
+        readU64(&reader) != hashSource(source, length) ||
+        readU32(&reader) != length) {
+        unmapFile(bytes, size);
+        return NULL;
+    }
+    uint64_t payloadHash = readU64(&reader);
+    if (reader.failed || hashBytes((const char*)reader.current, (size_t)(reader.end - reader.current)) != payloadHash) {
+        unmapFile(bytes, size);
+        return NULL;
+    }
+
+    // every string takes at least its 4 byte length, which bounds a sane count
+    reader.stringCount = readU32(&reader);
+    if (reader.failed || reader.stringCount > (size_t)(reader.end - reader.current) / 4) {
+        unmapFile(bytes, size);
+        return NULL;
+    }
+    reader.strings = (StringRef*)malloc(sizeof(StringRef) * (reader.stringCount + 1));
+    if (reader.strings == NULL) exit(1);
+    for (uint32_t i = 0; i < reader.stringCount; i++) {
+        reader.strings[i].length = readU32(&reader);
+        reader.strings[i].chars = (const char*)readBytes(&reader, reader.strings[i].length);
+        reader.strings[i].string = NULL;
+    }
+
+    // the code refers to globals by slot, so this run has to hand out the same slot for every name
+    uint32_t globalCount = readU32(&reader);
+    for (uint32_t i = 0; i < globalCount && !reader.failed; i++) {
+        ObjString* name = readString(&reader, readU32(&reader));
+        if (name != NULL && globalSlot(name) != (int)i) reader.failed = true;
+    }
+
+    ObjFunction* function = NULL;
+    if (!reader.failed) function = readFunction(&reader);
+    free(reader.strings);
+
+    // anything half read is garbage, nothing points at its code but the GC
+    if (reader.failed || reader.current != reader.end) {
+        unmapFile(bytes, size);
+        return NULL;
+    }
+
+    Mapping* mapping = (Mapping*)malloc(sizeof(Mapping));
+    if (mapping == NULL) exit(1);
+    mapping->next = vm->mappings;
+    mapping->bytes = bytes;
+    mapping->size = size;
+    vm->mappings = mapping;
+    return function;
+}
+
+void freeCompiled() {
+    while (vm->mappings != NULL) {
+        Mapping* next = vm->mappings->next;
+        unmapFile(vm->mappings->bytes, vm->mappings->size);
+        free(vm->mappings);
+        vm->mappings = next;
+    }
+}
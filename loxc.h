@@ -0,0 +1,21 @@
+// include guard
+#ifndef clox_loxc_h
+#define clox_loxc_h
+
+#include "object.h"
+
+// compiled scripts are cached next to their source (script.lox -> script.loxc) so later runs can skip the compiler
+// bump LOXC_VERSION whenever the bytecode changes (opcodes, operands, how the compiler hands out global slots) or this format does
+#define LOXC_VERSION 8
+
+// the script compiled from source, read from the cache file of path, or NULL if there is none or it's stale
+// (source changed, or written by another version), the chunks' code is used straight out of the memory-mapped file
+ObjFunction* loadCompiled(const char* path, const char* source);
+// writes the cache file of path for the script compiled from source, errors (e.g. a read-only directory) just mean no cache
+// function must be reachable by the GC (e.g. on the stack)
+void saveCompiled(const char* path, const char* source, ObjFunction* function);
+// unmaps every cache file loaded, only once the functions borrowing their code are freed
+void freeCompiled();
+
+// end include guard
+#endif
@@ -5,11 +5,15 @@
 #include "common.h"
 #include "chunk.h"
 #include "debug.h"
+#include "memory.h"
+#include "output.h"
+#include "profiler.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* isolate) {
     char line[1024];
     for (;;) {
+        flushOutput();              // the last line's output before the prompt
         printf("> ");
   
         if (!fgets(line, sizeof(line), stdin)) {
@@ -17,7 +21,7 @@ static void repl() {
             break;
         }
   
-        interpret(line);
+        interpret(isolate, line);
     }
 }
 
@@ -50,27 +54,108 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+// returns the exit code: 65 for a compile error, 70 for a runtime error
+static int runFile(VM* isolate, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpretFile(isolate, path, source);
     free(source); 
   
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+// the debug options, spelled the same as flags (--trace) and in the CLOX_DEBUG environment variable (CLOX_DEBUG=trace,log-gc)
+static const struct {
+    const char* name;
+    int flag;
+} debugOptions[] = {
+    { "print-code", DEBUG_PRINT_CODE },
+    { "trace",      DEBUG_TRACE_EXECUTION },
+    { "stress-gc",  DEBUG_STRESS_GC },
+    { "log-gc",     DEBUG_LOG_GC },
+};
+
+// the DebugFlags of the option called name (its first length characters), 0 if there's none
+static int debugFlag(const char* name, size_t length) {
+    for (size_t i = 0; i < sizeof(debugOptions) / sizeof(debugOptions[0]); i++) {
+        if (strlen(debugOptions[i].name) == length && memcmp(debugOptions[i].name, name, length) == 0) return debugOptions[i].flag;
+    }
+    return 0;
 }
 
+// CLOX_DEBUG is a comma separated list of them, so a program can be diagnosed without touching how it's started
+// (a name it doesn't know only gets a warning, it shouldn't stop the program)
+static int debugFlagsFromEnvironment() {
+    const char* names = getenv("CLOX_DEBUG");
+    int flags = 0;
+    while (names != NULL && *names != '\0') {
+        size_t length = strcspn(names, ",");
+        if (length > 0) {
+            int flag = debugFlag(names, length);
+            if (flag == 0) fprintf(stderr, "Unknown CLOX_DEBUG option \"%.*s\".\n", (int)length, names);
+            flags |= flag;
+        }
+        names += length;
+        if (*names == ',') names++;
+    }
+    return flags;
+}
+
+// clox [--profile[=folded stacks file]] [--gc-stats] [--heap-grow=factor] [--lazy] [--no-jit] [--print-code] [--trace] [--log-gc] [--stress-gc] [path]
 int main(int argc, const char* argv[]) {
-    initVM();                                           // Sets up vm and prepares stack so it is ready to execute bytecode
+    int debugFlags = debugFlagsFromEnvironment();
+    const char* profilePath = NULL;                     // where --profile writes the folded stacks, NULL without it
+    bool gcStats = false;                               // print vm->gcStats to stderr at the end
+    bool lazy = false;                                  // compile function bodies on their first call
+    bool jit = true;                                    // compile hot functions to machine code (where there's a JIT)
+    double heapGrowFactor = 0;                          // what the heap may grow by between full collections, 0 leaves the VM's default
 
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        int flag = debugFlag(argv[arg] + 2, strlen(argv[arg] + 2));
+        if (flag != 0) {
+            debugFlags |= flag;
+        } else if (strncmp(argv[arg], "--profile", 9) == 0 && (argv[arg][9] == '\0' || argv[arg][9] == '=')) {
+            profilePath = argv[arg][9] == '=' ? argv[arg] + 10 : "profile.folded";
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            gcStats = true;
+        } else if (strncmp(argv[arg], "--heap-grow=", 12) == 0) {
+            char* end;
+            heapGrowFactor = strtod(argv[arg] + 12, &end);
+            if (*end != '\0' || !(heapGrowFactor > 1)) {
+                fprintf(stderr, "The heap growth factor must be a number above 1.\n");
+                exit(64);
+            }
+        } else if (strcmp(argv[arg], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[arg], "--no-jit") == 0) {
+            jit = false;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\".\n", argv[arg]);
+            exit(64);
+        }
+    }
+
+    VM* isolate = newVM(debugFlags);                    // Sets up vm and prepares stack so it is ready to execute bytecode
+    isolate->compileLazily = lazy;
+    isolate->jitEnabled = jit;
+    if (heapGrowFactor > 0) isolate->heapGrowFactor = heapGrowFactor;
+    if (profilePath != NULL) startProfiler(profilePath);
+
+    int status = 0;
+    if (arg == argc) {
+        repl(isolate);
+    } else if (arg == argc - 1) {
+        status = runFile(isolate, argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--profile[=file]] [--gc-stats] [--heap-grow=factor] [--lazy] [--no-jit] [--print-code] [--trace] [--log-gc] [--stress-gc] [path]\n");
         exit(64);
     }
     
-    freeVM();
-    return 0;
+    flushOutput();
+    stopProfiler();                                     // prints the report if there is one
+    if (gcStats) printGCStats(stderr);
+    freeVM(isolate);
+    return status;
 }
\ No newline at end of file
@@ -1,33 +1,261 @@
+// clock_gettime() and mmap() are POSIX, not part of C99, and MAP_ANONYMOUS and MAP_NORESERVE aren't even that
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+#define _DEFAULT_SOURCE
+#endif
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE
+#endif
+
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "compiler.h"
+#include "jit.h"
+#include "loop.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
 
-#ifdef DEBUG_LOG_GC
 #include <stdio.h>
-#include "debug.h"
-#endif
 
+// what vm->heapGrowFactor starts out as, an embedder (or clox --heap-grow) can change it per VM
+#ifndef GC_HEAP_GROW_FACTOR
 #define GC_HEAP_GROW_FACTOR 2
+#endif
+// bytes of new objects allowed to pile up in the young generation before a minor collection
+#define NURSERY_SIZE (1024 * 1024)
+
+// pause-time budget of an incremental full collection, all of them can be overridden with -D at build time
+// a slice runs every GC_SLICE_BYTES of allocation and blackens (or sweeps) up to GC_SLICE_WORK objects,
+// or when GC_SLICE_MICROS is defined, keeps going for that many microseconds instead
+// a slice has to get through objects faster than the program allocates them, or the heap outgrows the collection
+#ifndef GC_SLICE_BYTES
+#define GC_SLICE_BYTES (32 * 1024)
+#endif
+#ifndef GC_SLICE_WORK
+#define GC_SLICE_WORK 1024
+#endif
+
+// what DEBUG_STRESS_GC turns that into: a slice or a minor collection at every allocation, which is what flushes out a missing
+// write barrier or root, tiny slices so the barriers get exercised in the middle of every collection, and the next full
+// collection only a few allocations after the last one ends (the gap in between is when minor collections get their turn)
+#define STRESS_SLICE_WORK 8
+#define STRESS_IDLE_BYTES 256
+
+static void collectSlice();
+static void startCollection();
+
+// seconds on a monotonic clock, GC pauses are wall time (CPU time would count a parallel trace once per thread)
+double monotonicSeconds() {
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+#endif
+}
 
-// useful for reallocating memory
+// a value stack lives at the same address for as long as it's around, frames and open upvalues point into it: the address
+// space for limit slots, and their openUpvalueAt entries right after them, is reserved up front and grows by committing
+// more of it (POSIX commits a page the first time it's touched anyway, Windows has to be asked), zeroed either way
+// the reservation is only address space, a stack costs memory for as much of it as has been used
+Value* newStack(int limit) {
+	size_t size = (size_t)limit * (sizeof(Value) + sizeof(ObjUpvalue*));
+#ifdef _WIN32
+	void* stack = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (stack == NULL) exit(1);
+#else
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+	void* stack = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (stack == MAP_FAILED) exit(1);
+#endif
+	return (Value*)stack;
+}
+
+// makes the first count slots of a stack from newStack() (and their openUpvalueAt entries) usable
+void commitStack(Value* stack, int limit, int count) {
+#ifdef _WIN32
+	if (VirtualAlloc(stack, (size_t)count * sizeof(Value), MEM_COMMIT, PAGE_READWRITE) == NULL ||
+	    VirtualAlloc(stackUpvalues(stack, limit), (size_t)count * sizeof(ObjUpvalue*), MEM_COMMIT, PAGE_READWRITE) == NULL) {
+		exit(1);
+	}
+#else
+	(void)stack;
+	(void)limit;
+	(void)count;
+#endif
+}
+
+void freeStack(Value* stack, int limit) {
+	if (stack == NULL) return;
+#ifdef _WIN32
+	(void)limit;
+	VirtualFree(stack, 0, MEM_RELEASE);
+#else
+	munmap(stack, (size_t)limit * (sizeof(Value) + sizeof(ObjUpvalue*)));
+#endif
+}
+
+#ifdef POOL_ALLOCATOR
+// blocks of up to POOL_MAX_SIZE bytes come from size classes POOL_GRANULE bytes apart, which covers every object struct in
+// object.h, strings' characters and the small arrays (closure upvalues, table entries, instance fields) that dominate a heap
+// a class hands out its free list first, otherwise carves a block off the current arena (all classes share it,
+// so objects allocated together end up next to each other), freeing pushes the block back on its class's list
+// memory in the pools goes back to the OS only when the VM is freed
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASSES (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_ARENA_SIZE (64 * 1024)
+
+// a free block, the link lives in the block itself
+typedef struct PoolBlock {
+	struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct Pool {
+	PoolBlock* freeBlocks[POOL_CLASSES];	// free list of every size class
+	char* arenaNext;						// where the next new block gets carved from
+	char* arenaEnd;
+	void* arenas;							// every arena malloc'd so far, linked through their first word
+} Pool;
+
+// index of the size class a block of size bytes (1 to POOL_MAX_SIZE) belongs to
+static inline int sizeClass(size_t size) {
+	return (int)((size - 1) / POOL_GRANULE);
+}
+
+static void* poolAllocate(size_t size) {
+	Pool* pool = vm->pool;
+	int index = sizeClass(size);
+	PoolBlock* block = pool->freeBlocks[index];
+	if (block != NULL) {
+		pool->freeBlocks[index] = block->next;
+		return block;
+	}
+
+	size_t blockSize = (size_t)(index + 1) * POOL_GRANULE;
+	if (pool->arenaNext == NULL || (size_t)(pool->arenaEnd - pool->arenaNext) < blockSize) {
+		// the rest of the old arena (less than one block) is given up on, the first granule keeps the arena list
+		char* arena = (char*)malloc(POOL_ARENA_SIZE);
+		if (arena == NULL) exit(1);
+		*(void**)arena = pool->arenas;
+		pool->arenas = arena;
+		pool->arenaNext = arena + POOL_GRANULE;
+		pool->arenaEnd = arena + POOL_ARENA_SIZE;
+	}
+
+	void* result = pool->arenaNext;
+	pool->arenaNext += blockSize;
+	return result;
+}
+
+// gives back a block of (old) size bytes, to its pool or to malloc
+static void releaseBlock(void* pointer, size_t size) {
+	if (pointer == NULL) return;
+	if (size > POOL_MAX_SIZE) {
+		free(pointer);
+		return;
+	}
+
+	PoolBlock* block = (PoolBlock*)pointer;
+	int index = sizeClass(size);
+	Pool* pool = vm->pool;
+	block->next = pool->freeBlocks[index];
+	pool->freeBlocks[index] = block;
+}
+
+// reallocate() for when either size is a pooled one, a block that stays in its size class doesn't move at all
+static void* poolReallocate(void* pointer, size_t oldSize, size_t newSize) {
+	if (pointer != NULL && newSize <= POOL_MAX_SIZE && sizeClass(oldSize) == sizeClass(newSize)) return pointer;
+
+	void* result = newSize <= POOL_MAX_SIZE ? poolAllocate(newSize) : malloc(newSize);
+	if (result == NULL) exit(1);
+	if (pointer != NULL) {
+		memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+		releaseBlock(pointer, oldSize);
+	}
+	return result;
+}
+
+// hands every arena back to the OS, nothing allocated from the pools may be used after this
+static void freePools() {
+	void* arena = vm->pool->arenas;
+	while (arena != NULL) {
+		void* next = *(void**)arena;
+		free(arena);
+		arena = next;
+	}
+	free(vm->pool);
+	vm->pool = NULL;
+}
+#endif
+
+// the collector's thresholds and the VM's pools, set up by newVM() before the first allocation (stress testing turns the
+// thresholds all the way down)
+void initGC() {
+  #ifdef POOL_ALLOCATOR
+	vm->pool = (Pool*)calloc(1, sizeof(Pool));
+	if (vm->pool == NULL) exit(1);
+  #endif
+	bool stress = (vm->debug & DEBUG_STRESS_GC) != 0;
+	vm->nextGC = stress ? 0 : 1024 * 1024;      // initial threshold is arbitrary, goal is to not trigger the first few GCs too quickly but also to not wait too long
+	vm->heapGrowFactor = GC_HEAP_GROW_FACTOR;
+	vm->nurserySize = stress ? 0 : NURSERY_SIZE;
+	vm->sliceInterval = stress ? 0 : GC_SLICE_BYTES;
+	vm->sliceWork = stress ? STRESS_SLICE_WORK : GC_SLICE_WORK;
+}
+
+// the heap without the young objects, what's left after a minor collection (the young arrays and strings' characters
+// aren't told apart, they count here until their objects die)
+static inline size_t oldBytes() {
+	return vm->bytesAllocated > vm->youngBytes ? vm->bytesAllocated - vm->youngBytes : 0;
+}
+
+// useful for reallocating memory (every caller passes the exact size it got last time, that's how a block finds its pool)
 // if newsize 0 then we know to free it
 // if reallocating more memory then use our garbage collector function
-// Might trigger GC if memory use exceeds threshold
+// Might trigger GC if memory use exceeds threshold: a full collection is started once the old generation outgrows nextGC
+// and then advanced a slice at a time, otherwise a minor one runs once enough new objects have piled up
+// (short-lived objects never reach the old generation, so they keep the minor collections busy and not the full ones)
+// (minor collections wait while a full one is marking, the young objects get traced along with everything else)
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
-	vm.bytesAllocated += newSize - oldSize;
+	vm->bytesAllocated += newSize - oldSize;
 	if (newSize > oldSize) {
-  #ifdef DEBUG_STRESS_GC
-		collectGarbage();
-  #endif
-		
-  		if (vm.bytesAllocated > vm.nextGC) {
-			collectGarbage();
-  		}
+		vm->sliceBytes += newSize - oldSize;
+		vm->gcStats.bytesAllocated += newSize - oldSize;
+		if (vm->gcPhase != GC_IDLE) {
+			if (vm->sliceBytes > vm->sliceInterval) collectSlice();
+  		} else if (oldBytes() > vm->nextGC) {
+			startCollection();
+		}
+		if (vm->gcPhase != GC_MARKING && vm->youngBytes > vm->nurserySize) collectYoung();
+	} else {
+		vm->gcStats.bytesFreed += oldSize - newSize;
 	}
 		
+  #ifdef POOL_ALLOCATOR
+	if (newSize == 0) {
+		releaseBlock(pointer, oldSize);
+		return NULL;
+	}
+	if (oldSize <= POOL_MAX_SIZE || newSize <= POOL_MAX_SIZE) return poolReallocate(pointer, oldSize, newSize);
+  #endif
+
 	if (newSize == 0) {
     	free(pointer);
     	return NULL;
@@ -38,29 +266,136 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   		return result;
 }
 
+// adds an object to the gray worklist (uses plain realloc, the GC must not trigger itself)
+#ifdef GC_PARALLEL_MARK
+// a trace that's still going after GC_PARALLEL_MARK_AFTER objects is shared out among GC_MARK_THREADS threads (the program's
+// own one included), a smaller one isn't worth waking the others for, both can be overridden with -D at build time
+// by default there's one thread per core, up to 8, defining GC_MARK_THREADS asks for exactly that many
+// every thread traces from a gray stack of its own and claims an object by setting its mark with an atomic exchange, so each
+// object still gets blackened exactly once; one that has plenty left hands half of it to the shared pool whenever another
+// has run out, and the trace is done when all of them are out of work with nothing left in the pool
+// incremental slices are too short for it, and --log-gc keeps everything on one thread so its output stays in order
+#ifndef GC_PARALLEL_MARK_AFTER
+#define GC_PARALLEL_MARK_AFTER 4096
+#endif
+#ifdef GC_MARK_THREADS
+#define MAX_TRACERS GC_MARK_THREADS
+#else
+#define MAX_TRACERS 8
+#endif
+// a thread only gives work away while it has more than this many gray objects, and takes at most TAKE_MAX back at once
+#define SHARE_MIN 64
+#define TAKE_MAX 256
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct {
+	Obj** objects;
+	int count;
+	int capacity;
+} GrayStack;
+
+typedef struct {
+	VM* vm;                                 // whose heap it traces
+	pthread_t thread;
+	GrayStack stack;
+} Tracer;
+
+// a VM's tracer threads, every VM with a big enough heap gets its own
+typedef struct Tracers {
+	int count;                              // threads tracing together, 1 if there's no one to help
+	Tracer tracer[MAX_TRACERS];             // tracer[0] is the program's thread, the others are helpers
+	GrayStack pool;                         // gray objects handed over for whichever thread runs out first
+	int idle;                               // threads waiting on the pool
+	int running;                            // helpers not done with the current trace yet
+	unsigned int trace;                     // counts the traces started, a helper waits for it to change
+	bool stopping;
+	pthread_mutex_t lock;                   // guards everything above but the stacks
+	pthread_cond_t started;                 // a trace started (or the helpers are told to stop)
+	pthread_cond_t changed;                 // work arrived in the pool, or the trace is done
+	pthread_cond_t finished;                // the last helper finished the trace
+} Tracers;
+
+// the calling thread's own gray stack while it's in a parallel trace, markObject() pushes onto it instead of vm->grayStack
+static THREAD_LOCAL GrayStack* localGray = NULL;
+
+static void pushLocal(GrayStack* stack, Obj* object) {
+	if (stack->capacity < stack->count + 1) {
+		stack->capacity = GROW_CAPACITY(stack->capacity);
+		stack->objects = (Obj**)realloc(stack->objects, sizeof(Obj*) * stack->capacity);
+
+		if (stack->objects == NULL) exit(1);
+	}
+
+	stack->objects[stack->count++] = object;
+}
+#endif
+
+static void pushGray(Obj* object) {
+	if (vm->grayCapacity < vm->grayCount + 1) {
+		vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+		vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+
+		if (vm->grayStack == NULL) exit(1);
+	}
+	
+	vm->grayStack[vm->grayCount++] = object;
+}
+
 // checks if it is a valid obj to be marked (#'s, booleans, and nil require no heap allocation)
 // avoids double-marking, marks object as reachable or not, and adds to grayStack worklist to be explored later by blackenObject()
 // When an object turns gray, in addition to setting the mark field we’ll also add it to the gray entry worklist
+// a minor collection stops at old objects, only a full one (while marking) traces them
 void markObject(Obj* object) {
 	if (object == NULL) return;
+  #ifdef GC_PARALLEL_MARK
+	if (__atomic_load_n(&object->isMarked, __ATOMIC_RELAXED)) return;      // other tracer threads may be setting it
+  #else
 	if (object->isMarked) return;
+  #endif
+	if (object->isOld && vm->gcPhase != GC_MARKING) return;
 
-  #ifdef DEBUG_LOG_GC
-	printf("%p mark ", (void*)object);
-	printValue(OBJ_VAL(object));
-	printf("\n");
+	if (vm->debug & DEBUG_LOG_GC) {
+		printf("%p mark ", (void*)object);
+		printValue(OBJ_VAL(object));
+		printf("\n");
+	}
+
+  #ifdef GC_PARALLEL_MARK
+	if (localGray != NULL) {
+		if (__atomic_exchange_n(&object->isMarked, true, __ATOMIC_RELAXED)) return;     // another thread got to it first
+		pushLocal(localGray, object);
+		return;
+	}
   #endif
 
 	object->isMarked = true;
-	
-	if (vm.grayCapacity < vm.grayCount + 1) {
-		vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-		vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+	pushGray(object);
+}
 
-		if (vm.grayStack == NULL) exit(1);
+// adds an object to the remembered set, the next minor collection traces it like a root (or while marking, the next slice)
+// (the write barriers call this, and so does markCompilerRoots() for the functions it is still filling in)
+void rememberObject(Obj* object) {
+	if (object->isRemembered) return;
+	object->isRemembered = true;
+
+	if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+		vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+		vm->remembered = (Obj**)realloc(vm->remembered, sizeof(Obj*) * vm->rememberedCapacity);
+
+		if (vm->remembered == NULL) exit(1);
 	}
-	
-	vm.grayStack[vm.grayCount++] = object;
+
+	vm->remembered[vm->rememberedCount++] = object;
+}
+
+// empties the remembered set
+static void forgetRemembered() {
+	for (int i = 0; i < vm->rememberedCount; i++) {
+		vm->remembered[i]->isRemembered = false;
+	}
+	vm->rememberedCount = 0;
 }
 
 // marks value if it is an object on the heap
@@ -76,20 +411,39 @@ static void markArray(ValueArray* array) {
 	}
 }
 
+// marks everything the inline caches of a chunk point at
+// entries hold classes strongly, otherwise a dead class's memory could be reused by a new class and produce a false hit
+static void markInlineCaches(Chunk* chunk) {
+	for (int i = 0; i < chunk->cacheCount; i++) {
+		InlineCache* cache = &chunk->caches[i];
+		for (int j = 0; j < cache->count; j++) {
+			InlineCacheEntry* entry = &cache->entries[j];
+			markObject((Obj*)entry->klass);
+			markObject((Obj*)entry->shape);
+			markObject((Obj*)entry->transition);
+			markValue(entry->method);
+		}
+	}
+}
+
 // processes a gray object/entry and marks everything it references (its children) to make it a black entry 
 // OBJ_CLOSURE → Marks function + all upvalues.
-// OBJ_FUNCTION → Marks function name and all constants in its bytecode
-// OBJ_UPVALUE → Marks the closed-over value.
-// OBJ_STRING/OBJ_NATIVE → No child references; no action needed
+// OBJ_FIBER → Marks what it runs, its caller, and while it's switched out everything on its stack (the running one's is in vm, a root)
+// OBJ_FUNCTION → Marks function name, all constants in its bytecode and whatever its inline caches point at (or, body not compiled yet, its source and upvalue names)
+// OBJ_UPVALUE → Marks the closed-over value, or while it's open, the fiber whose stack holds the variable
+// OBJ_ROPE → Marks both halves, or once flattened, the string it forwards to
+// OBJ_STRING/OBJ_NATIVE/OBJ_BUFFER → No child references; no action needed
 // OBJ_CLASS → Marks class name to keep the string alive as well as the class methods table
-// OBJ_INSTANCE → Marks the class instance belongs to, as well as its references (a field table)
+// OBJ_INSTANCE → Marks the class instance belongs to, its shape, and the values in its fields array
+// OBJ_LIST → Marks every element
+// OBJ_SHAPE → Marks its parent, the field name it added, and both of its tables (field names and child shapes)
 // OBJ_BOUND_METHOD → Marks the method and reciever
 static void blackenObject(Obj* object) {
-#ifdef DEBUG_LOG_GC
-	printf("%p blacken ", (void*)object);
-	printValue(OBJ_VAL(object));
-	printf("\n");
-#endif
+	if (vm->debug & DEBUG_LOG_GC) {
+		printf("%p blacken ", (void*)object);
+		printValue(OBJ_VAL(object));
+		printf("\n");
+	}
 
 	switch (object->type) {
 		case OBJ_BOUND_METHOD: {
@@ -112,21 +466,68 @@ static void blackenObject(Obj* object) {
 			}
 			break;
 		}
+		case OBJ_FIBER: {
+			ObjFiber* fiber = (ObjFiber*)object;
+			markObject((Obj*)fiber->closure);
+			markObject((Obj*)fiber->caller);
+			markValue(fiber->transfer);
+			for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+				markValue(*slot);
+			}
+			for (int i = 0; i < fiber->frameCount; i++) {
+				markObject((Obj*)fiber->frames[i].closure);
+			}
+			for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+				markObject((Obj*)upvalue);
+			}
+			break;
+		}
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			markObject((Obj*)function->name);
+			markObject((Obj*)function->closure);
 			markArray(&function->chunk.constants);
+			markInlineCaches(&function->chunk);
+			if (function->lazy != NULL) {
+				markObject((Obj*)function->lazy->source);
+				for (int i = 0; i < function->upvalueCount; i++) {
+					markObject((Obj*)function->lazy->upvalueNames[i]);
+				}
+			}
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
 			markObject((Obj*)instance->klass);
-			markTable(&instance->fields);
+			markObject((Obj*)instance->shape);
+			for (int i = 0; i < instance->shape->fieldCount; i++) {
+				markValue(instance->fields[i]);
+			}
+			break;
+		}
+		case OBJ_LIST:
+			markArray(&((ObjList*)object)->items);
+			break;
+		case OBJ_SHAPE: {
+			ObjShape* shape = (ObjShape*)object;
+			markObject((Obj*)shape->parent);
+			markObject((Obj*)shape->name);
+			markTable(&shape->fieldIndex);
+			markTable(&shape->transitions);
+			break;
+		}
+		case OBJ_ROPE: {
+			ObjRope* rope = (ObjRope*)object;
+			markObject(rope->left);
+			markObject(rope->right);
+			markObject((Obj*)rope->flat);
 			break;
 		}
 		case OBJ_UPVALUE:
 			markValue(((ObjUpvalue*)object)->closed);
+			markObject((Obj*)((ObjUpvalue*)object)->fiber);
 			break;
+		case OBJ_BUFFER:
 		case OBJ_NATIVE:
 		case OBJ_STRING:
 			break;
@@ -139,54 +540,86 @@ static void blackenObject(Obj* object) {
 // VM also needs to know how to deallocate a nativefunction obj
 // when done with a closure, you free it's memory (and that array of Upvalues it points to)
 // Same thing for UpValue struct and class struct
-// free an object instance, along with its field-table
+// free an object instance (its inline slots go with it), plus its fields array if it outgrew them
+// a list frees its array of elements, a buffer's go with it
+// a shape frees both of its tables
+// a fiber frees its stack and frames (unless it finished and did that already) and whatever an I/O native had under way
 // Free the bound method when it is no longer needed
 static void freeObject(Obj* object) {
-  #ifdef DEBUG_LOG_GC
-  	printf("%p free type %d\n", (void*)object, object->type);
-  #endif
+	if (vm->debug & DEBUG_LOG_GC) printf("%p free type %d\n", (void*)object, object->type);
 
+	GCTypeStats* stats = &vm->gcStats.types[object->type];
+	size_t size = 0;                            // the object's own block, freed last
 	switch (object->type) {
 		case OBJ_BOUND_METHOD:
-			FREE(ObjBoundMethod, object);
+			size = sizeof(ObjBoundMethod);
 			break;
-		case OBJ_CLASS: {
-			ObjClass* klass = (ObjClass*)object;
-			freeTable(&klass->methods);
-			FREE(ObjClass, object);
+		case OBJ_BUFFER:
+			size = sizeof(ObjBuffer) + sizeof(double) * ((ObjBuffer*)object)->length;
+			break;
+		case OBJ_CLASS:
+			freeTable(&((ObjClass*)object)->methods);
+			size = sizeof(ObjClass);
 			break;
-		} 
 		case OBJ_CLOSURE: {
 			ObjClosure* closure = (ObjClosure*)object;
 			FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-			FREE(ObjClosure, object);
+			size = sizeof(ObjClosure);
 			break;
 		}
+		case OBJ_FIBER:
+			releaseFiber((ObjFiber*)object);
+			size = sizeof(ObjFiber);
+			break;
 		case OBJ_FUNCTION: {
 			ObjFunction* function = (ObjFunction*)object;
 			freeChunk(&function->chunk);
-			FREE(ObjFunction, object);
+			freeLazyBody(function);
+#ifdef JIT
+			jitFree(function);
+#endif
+			size = sizeof(ObjFunction);
 			break;
 		}
 		case OBJ_INSTANCE: {
 			ObjInstance* instance = (ObjInstance*)object;
-			freeTable(&instance->fields);
-			FREE(ObjInstance, object);
+			if (instance->fields != instance->inlineFields) {
+				FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+			}
+			size = sizeof(ObjInstance) + sizeof(Value) * instance->inlineCapacity;
 			break;
 		}
+		case OBJ_LIST:
+			freeValueArray(&((ObjList*)object)->items);
+			size = sizeof(ObjList);
+			break;
 		case OBJ_NATIVE:
-			FREE(ObjNative, object);
+			size = sizeof(ObjNative);
+			break;
+		case OBJ_SHAPE: {
+			ObjShape* shape = (ObjShape*)object;
+			freeTable(&shape->fieldIndex);
+			freeTable(&shape->transitions);
+			size = sizeof(ObjShape);
 			break;
+		}
 	  	case OBJ_STRING: {
 			ObjString* string = (ObjString*)object;
 			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, object);
+			stats->bytesFreed += string->length + 1;
+			size = sizeof(ObjString);
 			break;
 	  	}
+		case OBJ_ROPE:
+			size = sizeof(ObjRope);
+			break;
 		case OBJ_UPVALUE:
-		  	FREE(ObjUpvalue, object);
+			size = sizeof(ObjUpvalue);
 		  	break;
 	}
+	stats->freed++;
+	stats->bytesFreed += size;
+	reallocate(object, size, 0);
 }
 
 // root is an object or value that is reachable and serves as a starting point for determining which objects in memory are still in use
@@ -198,98 +631,488 @@ static void freeObject(Obj* object) {
 // Most roots are local variables or temporaries sitting right in the VM’s value stack, so we start by walking that
 // Some roots are in another separate stack, the CallFrame stack, and some are in the open upvalue list 
 static void markRoots() {
-	for (Value* slot = vm.stack; slot < vm.stack + vm.stackCount; slot++) {
+	for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
 	  	markValue(*slot);
 	}
 
-	for (int i = 0; i < vm.frameCount; i++) {
-		markObject((Obj*)vm.frames[i].closure);
+	for (int i = 0; i < vm->frameCount; i++) {
+		markObject((Obj*)vm->frames[i].closure);
 	}
 
 	
-	for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+	for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
 	 	markObject((Obj*)upvalue);
     }
 
-	markTable(&vm.globals);
+	markArray(&vm->globalValues);
+	markArray(&vm->globalNames);
+	markTable(&vm->globalSlots);
+	markTable(&vm->listMethods);
 	markCompilerRoots();
-	markObject((Obj*)vm.initString);
+	markObject((Obj*)vm->initString);
+	markObject((Obj*)vm->emptyShape);
+	markObject((Obj*)vm->fiber);
+	markObject((Obj*)vm->rootFiber);
+	if (vm->loop != NULL) markLoopRoots();
+	if (vm->profiler != NULL) markProfilerRoots();
+}
+
+#ifdef GC_PARALLEL_MARK
+// hands the bottom half of the stack (the oldest gray objects, likely the roots of the biggest parts left) to the pool
+static void shareWork(GrayStack* stack) {
+	Tracers* tracers = vm->tracers;
+	int half = stack->count / 2;
+	pthread_mutex_lock(&tracers->lock);
+	for (int i = 0; i < half; i++) {
+		pushLocal(&tracers->pool, stack->objects[i]);
+	}
+	pthread_cond_broadcast(&tracers->changed);
+	pthread_mutex_unlock(&tracers->lock);
+
+	stack->count -= half;
+	memmove(stack->objects, stack->objects + half, sizeof(Obj*) * stack->count);
+}
+
+// waits for work in the pool and moves some of it onto the (empty) stack
+// returns false once every thread is waiting and the pool is empty, no one is left to add to it so the trace is done
+static bool takeWork(GrayStack* stack) {
+	Tracers* tracers = vm->tracers;
+	pthread_mutex_lock(&tracers->lock);
+	__atomic_add_fetch(&tracers->idle, 1, __ATOMIC_RELAXED);
+	while (tracers->pool.count == 0 && tracers->idle < tracers->count) {
+		pthread_cond_wait(&tracers->changed, &tracers->lock);
+	}
+
+	if (tracers->pool.count == 0) {
+		pthread_cond_broadcast(&tracers->changed);
+		pthread_mutex_unlock(&tracers->lock);
+		return false;
+	}
+
+	__atomic_sub_fetch(&tracers->idle, 1, __ATOMIC_RELAXED);
+	int take = tracers->pool.count < TAKE_MAX ? tracers->pool.count : TAKE_MAX;
+	tracers->pool.count -= take;
+	for (int i = 0; i < take; i++) {
+		pushLocal(stack, tracers->pool.objects[tracers->pool.count + i]);
+	}
+	pthread_mutex_unlock(&tracers->lock);
+	return true;
 }
 
+// one thread's part of a parallel trace, returns when the whole trace is done
+static void traceShare(GrayStack* stack) {
+	do {
+		while (stack->count > 0) {
+			blackenObject(stack->objects[--stack->count]);
+			if (stack->count > SHARE_MIN && __atomic_load_n(&vm->tracers->idle, __ATOMIC_RELAXED) > 0) shareWork(stack);
+		}
+	} while (takeWork(stack));
+}
+
+static void* tracerThread(void* argument) {
+	Tracer* tracer = (Tracer*)argument;
+	vm = tracer->vm;
+	localGray = &tracer->stack;
+	Tracers* tracers = vm->tracers;
+	unsigned int seen = 0;
+
+	pthread_mutex_lock(&tracers->lock);
+	for (;;) {
+		while (tracers->trace == seen && !tracers->stopping) {
+			pthread_cond_wait(&tracers->started, &tracers->lock);
+		}
+		if (tracers->stopping) break;
+		seen = tracers->trace;
+		pthread_mutex_unlock(&tracers->lock);
+
+		traceShare(localGray);
+
+		pthread_mutex_lock(&tracers->lock);
+		if (--tracers->running == 0) pthread_cond_signal(&tracers->finished);
+	}
+	pthread_mutex_unlock(&tracers->lock);
+	return NULL;
+}
+
+// starts the VM's helpers the first time they're needed (none on a single core, the count stays 1 then)
+static void startTracers() {
+	if (vm->tracers != NULL) return;
+
+  #ifdef GC_MARK_THREADS
+	int count = GC_MARK_THREADS;
+  #else
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = cores < MAX_TRACERS ? (int)cores : MAX_TRACERS;
+  #endif
+
+	Tracers* tracers = (Tracers*)calloc(1, sizeof(Tracers));
+	if (tracers == NULL) exit(1);
+	vm->tracers = tracers;
+	pthread_mutex_init(&tracers->lock, NULL);
+	pthread_cond_init(&tracers->started, NULL);
+	pthread_cond_init(&tracers->changed, NULL);
+	pthread_cond_init(&tracers->finished, NULL);
+	tracers->count = 1;
+	while (tracers->count < count) {
+		Tracer* tracer = &tracers->tracer[tracers->count];
+		tracer->vm = vm;
+		if (pthread_create(&tracer->thread, NULL, tracerThread, tracer) != 0) break;
+		tracers->count++;
+	}
+}
+
+// tells the helpers to stop, waits for them and frees what they used
+static void stopTracers() {
+	Tracers* tracers = vm->tracers;
+	if (tracers == NULL) return;
+
+	pthread_mutex_lock(&tracers->lock);
+	tracers->stopping = true;
+	pthread_cond_broadcast(&tracers->started);
+	pthread_mutex_unlock(&tracers->lock);
+	for (int i = 1; i < tracers->count; i++) {
+		pthread_join(tracers->tracer[i].thread, NULL);
+	}
+
+	for (int i = 0; i < MAX_TRACERS; i++) {
+		free(tracers->tracer[i].stack.objects);
+	}
+	free(tracers->pool.objects);
+	pthread_mutex_destroy(&tracers->lock);
+	pthread_cond_destroy(&tracers->started);
+	pthread_cond_destroy(&tracers->changed);
+	pthread_cond_destroy(&tracers->finished);
+	free(tracers);
+	vm->tracers = NULL;
+}
+
+// finishes the trace on every tracer thread, what's left on vm->grayStack goes to the pool to start it off
+// returns false (having done nothing) when it can't, the caller keeps tracing by itself then
+static bool traceParallel() {
+	if (vm->debug & DEBUG_LOG_GC) return false;
+	startTracers();
+	Tracers* tracers = vm->tracers;
+	if (tracers->count < 2) return false;
+
+	pthread_mutex_lock(&tracers->lock);
+	for (int i = 0; i < vm->grayCount; i++) {
+		pushLocal(&tracers->pool, vm->grayStack[i]);
+	}
+	vm->grayCount = 0;
+	tracers->idle = 0;
+	tracers->running = tracers->count - 1;
+	tracers->trace++;
+	pthread_cond_broadcast(&tracers->started);
+	pthread_mutex_unlock(&tracers->lock);
+
+	localGray = &tracers->tracer[0].stack;
+	traceShare(localGray);
+	localGray = NULL;
+
+	pthread_mutex_lock(&tracers->lock);
+	while (tracers->running > 0) {
+		pthread_cond_wait(&tracers->finished, &tracers->lock);
+	}
+	pthread_mutex_unlock(&tracers->lock);
+	return true;
+}
+#endif
+
 // Recursively marks all objects referenced by the roots through walking the object graph either from white to gray or gray to black until grayStack empties
 // (Until the stack empties, we keep pulling out gray objects, traversing their references, and then marking them black)
+// a big trace finishes on several threads (see traceParallel())
 static void traceReferences() {
-	while (vm.grayCount > 0) {
-		Obj* object = vm.grayStack[--vm.grayCount];
+	for (int work = 0; vm->grayCount > 0; work++) {
+	  #ifdef GC_PARALLEL_MARK
+		if (work == GC_PARALLEL_MARK_AFTER && traceParallel()) return;
+	  #endif
+		Obj* object = vm->grayStack[--vm->grayCount];
 		blackenObject(object);
 	}
 }
 
-// frees all unreachable objects 
-// If an object is marked, reset the mark and move on. If an object is not marked, it’s unreachable
-// Remove non-marked object from list and free its memory
-static void sweep() {
-	Obj* previous = NULL;
-	Obj* object = vm.objects;
+// whether a slice that has already done this many objects' worth of work used up its budget
+static bool sliceExhausted(int work, double start) {
+#ifdef GC_SLICE_MICROS
+	// reading the clock isn't free either, so only every 64 objects
+	return work % 64 == 0 && (monotonicSeconds() - start) * 1000000 >= (double)GC_SLICE_MICROS;
+#else
+	(void)start;
+	return work >= vm->sliceWork;
+#endif
+}
+
+// traceReferences(), but stops when the slice's budget runs out, returns true once the gray stack is empty
+static bool traceSlice(double start) {
+	for (int work = 0; vm->grayCount > 0; work++) {
+		if (sliceExhausted(work, start)) return false;
+		blackenObject(vm->grayStack[--vm->grayCount]);
+	}
+	return true;
+}
+
+// the barriers' half of an incremental mark, the objects written to since the last slice that were already marked go back
+// to gray and get traced again (the unmarked ones will be traced whenever they're reached anyway)
+static void regrayRemembered() {
+	for (int i = 0; i < vm->rememberedCount; i++) {
+		if (vm->remembered[i]->isMarked) pushGray(vm->remembered[i]);
+	}
+	forgetRemembered();
+}
+
+// frees the unreachable old objects still waiting on vm->sweepObjects, the marked ones are unmarked and put back on vm->objects
+// bounded by the slice's budget unless told otherwise, returns true once the list is empty
+// objects allocated since marking finished are young, so the sweep never has to tell them apart from the dead
+// a dead string takes itself out of the intern table like in sweepYoung(), until then interning can still bring it back
+// (see findInterned() in object.c)
+static bool sweep(bool bounded, double start) {
+	for (int work = 0; vm->sweepObjects != NULL; work++) {
+		if (bounded && sliceExhausted(work, start)) return false;
+
+		Obj* object = vm->sweepObjects;
+		vm->sweepObjects = object->next;
+		if (object->isMarked) {
+			object->isMarked = false;
+			object->next = vm->objects;
+			vm->objects = object;
+		} else {
+			if (object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString*)object);
+			freeObject(object);
+		}
+	}
+	return true;
+}
+
+// frees the unreachable young objects and promotes the rest by moving them onto the old list
+// only walks the young list, so a minor collection never looks at the old generation
+// a dead string takes itself out of the intern table, instead of scanning the whole table with tableRemoveWhite()
+static void sweepYoung() {
+	Obj* object = vm->youngObjects;
 	while (object != NULL) {
+		Obj* next = object->next;
 		if (object->isMarked) {
 			object->isMarked = false;
-			previous = object;
-			object = object->next;
+			object->isOld = true;
+			object->next = vm->objects;
+			vm->objects = object;
 		} else {
-			Obj* unreached = object;
-			object = object->next;
-			if (previous != NULL) {
-				previous->next = object;
-			} else {
-				vm.objects = object;
-			}
-	
-			freeObject(unreached);
-	    }
+			if (object->type == OBJ_STRING) tableDelete(&vm->strings, (ObjString*)object);
+			freeObject(object);
+		}
+		object = next;
 	}
+
+	vm->youngObjects = NULL;
+	vm->youngBytes = 0;
 }
 
-// uses tri-color abstraction, orchestrates a full GC Cycle
+// a minor collection: only finds out which young objects are still alive, its cost follows the young data instead of the whole heap
+// counts a pause of the program that began at start
+static void endPause(double start) {
+	double pause = monotonicSeconds() - start;
+	vm->gcStats.pauses++;
+	vm->gcStats.pauseTotal += pause;
+	if (pause > vm->gcStats.pauseMax) vm->gcStats.pauseMax = pause;
+
+	int bucket = 0;
+	for (double limit = 1e-6; pause >= limit && bucket < GC_PAUSE_BUCKETS - 1; limit *= 2) bucket++;
+	vm->gcStats.pauseBuckets[bucket]++;
+}
+
+// marking the roots stops at old objects (and promotes whatever young is reached)
+// the only other way to reach a young object is through an old one it was stored into, which the write barriers remembered
+// 1. Mark roots (only the young ones turn gray)
+// 2. Trace from them and from every remembered object
+// 3. Free the dead young objects, promote the survivors
+// nextGC is left alone, promoted objects count towards the next full collection
+// can run while a full collection is sweeping (the old objects it hasn't reached yet are either still marked or unreachable)
+void collectYoung() {
+	if (vm->debug & DEBUG_LOG_GC) printf("-- minor gc begin\n");
+	size_t before = vm->bytesAllocated;
+	double start = monotonicSeconds();
+
+	markRoots();
+	for (int i = 0; i < vm->rememberedCount; i++) {
+		pushGray(vm->remembered[i]);
+	}
+	forgetRemembered();
+	traceReferences();
+	sweepYoung();
+	vm->gcStats.minorCollections++;
+	endPause(start);
+
+	if (vm->debug & DEBUG_LOG_GC) {
+		printf("-- minor gc end\n");
+		printf("   collected %zu bytes (from %zu to %zu)\n", before - vm->bytesAllocated, before, vm->bytesAllocated);
+	}
+}
+
+
+// uses tri-color abstraction, a full GC cycle is spread over many slices interleaved with the program
 // The mark-and-sweep garbage collector for interpreter, recycles memory that can no longer be used (unreachable)
 // white entries = objects that are not marked and may possibly be unreachable
-// Gray entries = marked, but references haven’t been followed yet
+// Gray entries = marked, but references haven't been followed yet
 // black entries = marked and fully traced (all children marked)
-// 1. Mark roots (makes the root a gray entry, initially everything is a white entry)
-// 2. Trace references from roots (mark everything reachable from root, which makes root a black entry)
-// 3. Remove white entries from the interned strings table
-// 4. Remove everything unreachable (sweep the white entries) 
+// the program keeps running in between, so a black object can be handed a white one: the write barriers remember it
+// and it's traced again, stores that skip the barriers (the stack, globals, open upvalues) are caught by marking the roots again at the end
+// 1. Mark roots (makes the root a gray entry, initially everything is a white entry), nothing to unmark since the last sweep did it
+// 2. Trace references a slice at a time (objects allocated meanwhile start out white, they survive if reached by the end)
+// 3. Once the gray stack runs dry, finish marking in one short pause (see finishMarking())
+// 4. Remove everything unreachable (sweep the white entries), the old generation a slice at a time, every survivor ends up old
 // 5. Adjust the GC threshold to avoid future GC triggers
-void collectGarbage() {
-#ifdef DEBUG_LOG_GC
-  	printf("-- gc begin\n");
-	size_t before = vm.bytesAllocated;
-#endif
+static void beginCycle() {
+	if (vm->debug & DEBUG_LOG_GC) printf("-- gc begin\n");
+	vm->cycleStartBytes = vm->bytesAllocated;
+
+	forgetRemembered();                     // from here on it holds objects to trace again, the old -> young ones get traced anyway
+	vm->gcPhase = GC_MARKING;
+	vm->sliceBytes = 0;
+	markRoots();
+}
+
+// mark, then trace the roots and every remembered object once more, this time to the end
+// then free the dead young objects right away, the dead old strings leave the intern table as the sweep gets to them
+// the old list is set aside for the lazy sweep, so what gets promoted from now on doesn't get swept along with it
+static void finishMarking() {
+	markRoots();
+	regrayRemembered();
+	traceReferences();
+
+	vm->sweepObjects = vm->objects;
+	vm->objects = NULL;
+	sweepYoung();
+	vm->gcPhase = GC_SWEEPING;
+
+	if (vm->debug & DEBUG_LOG_GC) printf("-- gc mark end\n");
+}
+
+static void endCycle() {
+	vm->gcPhase = GC_IDLE;
+	// never below a nursery's worth, or a small old generation would have full collections coming before minor ones
+	vm->nextGC = vm->debug & DEBUG_STRESS_GC ? vm->bytesAllocated + STRESS_IDLE_BYTES : (size_t)(oldBytes() * vm->heapGrowFactor);
+	if (vm->nextGC < vm->nurserySize) vm->nextGC = vm->nurserySize;
+	vm->gcStats.nextGCHistory[vm->gcStats.fullCollections % GC_HISTORY] = vm->nextGC;
+	vm->gcStats.fullCollections++;
+
+	if (vm->debug & DEBUG_LOG_GC) {
+  		printf("-- gc end\n");
+		// the program kept allocating while the cycle ran, so the heap can end up bigger than it started
+		printf("   heap went from %zu to %zu bytes, next at %zu\n", vm->cycleStartBytes, vm->bytesAllocated, vm->nextGC);
+	}
+}
 
-markRoots();
-traceReferences();
-tableRemoveWhite(&vm.strings);
-sweep();
+// one bounded step of the running full collection
+static void collectSlice() {
+	double start = monotonicSeconds();
+	vm->sliceBytes = 0;
 
-vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+	if (vm->gcPhase == GC_MARKING) {
+		regrayRemembered();
+		if (traceSlice(start)) finishMarking();
+	} else if (sweep(true, start)) {
+		endCycle();
+	}
+	endPause(start);
+}
 
-#ifdef DEBUG_LOG_GC
-  	printf("-- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-        before - vm.bytesAllocated, before, vm.bytesAllocated,
-        vm.nextGC);
+static void startCollection() {
+#ifdef GC_INCREMENTAL
+	double start = monotonicSeconds();
+	beginCycle();
+	endPause(start);
+#else
+	collectGarbage();
 #endif
 }
 
-// Frees all objects in the VM's object linked list
-// also frees the gray stack used during GC
+// a whole full collection in one pause (the one under way is finished first)
+void collectGarbage() {
+	double start = monotonicSeconds();
+	if (vm->gcPhase != GC_IDLE) {
+		if (vm->gcPhase == GC_MARKING) finishMarking();
+		sweep(false, 0);
+		endCycle();
+	}
+
+	beginCycle();
+	finishMarking();
+	sweep(false, 0);
+	endCycle();
+	endPause(start);
+}
+
+void readGCStats(VM* isolate, GCStats* stats) {
+	*stats = isolate->gcStats;
+	stats->heapBytes = isolate->bytesAllocated;
+	stats->nextGC = isolate->nextGC;
+	stats->heapGrowFactor = isolate->heapGrowFactor;
+	stats->strings = isolate->strings.count;
+	stats->stringCapacity = isolate->strings.capacity;
+}
+
+// names of the ObjTypes in gcStats() and the JSON below
+const char* const objTypeNames[OBJ_TYPE_COUNT] = {
+	"bound_method", "buffer", "class", "closure", "fiber", "function", "instance",
+	"list", "native", "rope", "shape", "string", "upvalue"
+};
+
+// one line of JSON, so benchmark scripts can read it
+// pause_buckets follows GC_PAUSE_BUCKETS, next_gc_history is oldest first, per type it's live objects and their bytes
+void printGCStats(FILE* file) {
+	GCStats stats;
+	readGCStats(vm, &stats);
+	fprintf(file, "{\"bytes_allocated\": %zu, \"bytes_freed\": %zu, \"heap_bytes\": %zu, \"next_gc\": %zu, "
+		"\"heap_grow_factor\": %g, \"minor_collections\": %d, \"full_collections\": %d, \"pauses\": %d, "
+		"\"pause_total_ms\": %.3f, \"pause_max_ms\": %.3f, \"strings\": %d, \"string_capacity\": %d, \"pause_buckets\": [",
+		stats.bytesAllocated, stats.bytesFreed, stats.heapBytes, stats.nextGC, stats.heapGrowFactor, stats.minorCollections,
+		stats.fullCollections, stats.pauses, stats.pauseTotal * 1000, stats.pauseMax * 1000, stats.strings, stats.stringCapacity);
+	for (int i = 0; i < GC_PAUSE_BUCKETS; i++) fprintf(file, "%s%d", i > 0 ? ", " : "", stats.pauseBuckets[i]);
+	fprintf(file, "], \"next_gc_history\": [");
+	int first = stats.fullCollections > GC_HISTORY ? stats.fullCollections - GC_HISTORY : 0;
+	for (int i = first; i < stats.fullCollections; i++) {
+		fprintf(file, "%s%zu", i > first ? ", " : "", stats.nextGCHistory[i % GC_HISTORY]);
+	}
+	fprintf(file, "], \"objects\": {");
+	for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+		GCTypeStats* counts = &stats.types[type];
+		fprintf(file, "%s\"%s\": {\"live\": %zu, \"live_bytes\": %zu, \"allocated\": %zu, \"bytes_allocated\": %zu}",
+			type > 0 ? ", " : "", objTypeNames[type], counts->allocated - counts->freed,
+			counts->bytesAllocated - counts->bytesFreed, counts->allocated, counts->bytesAllocated);
+	}
+	fprintf(file, "}}\n");
+}
+
+// Frees all objects in the VM's object linked lists (both generations, and whatever a lazy sweep hadn't got to)
+// also frees the gray stack and remembered set used during GC, and the pools (has to be the last thing freeVM() frees)
 void freeObjects() {
-	Obj* object = vm.objects;
+	Obj* object = vm->objects;
+	while (object != NULL) {
+	  	Obj* next = object->next;
+	  	freeObject(object);
+	  	object = next;
+	}
+
+	object = vm->sweepObjects;
+	while (object != NULL) {
+	  	Obj* next = object->next;
+	  	freeObject(object);
+	  	object = next;
+	}
+
+	object = vm->youngObjects;
 	while (object != NULL) {
 	  	Obj* next = object->next;
 	  	freeObject(object);
 	  	object = next;
 	}
 	
-	free(vm.grayStack);
+	free(vm->grayStack);
+	free(vm->remembered);
+  #ifdef GC_PARALLEL_MARK
+	stopTracers();
+  #endif
+
+  #ifdef POOL_ALLOCATOR
+	freePools();
+  #endif
 }
\ No newline at end of file
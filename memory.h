@@ -2,8 +2,11 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 // macro functions using reallocate() (kindof a memory allocator) 
 /* Important detail: 
@@ -29,7 +32,37 @@ reallocate(pointer, sizeof(type) * (oldCount), 0)
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 void markObject(Obj* object);
 void markValue(Value value);
+void rememberObject(Obj* object);
+void initGC();
 void collectGarbage();
+void collectYoung();
+void printGCStats(FILE* file);     // vm->gcStats as a line of JSON
+Value* newStack(int limit);                             // a value stack that never moves, for up to limit slots
+void commitStack(Value* stack, int limit, int count);   // makes its first count slots usable (it starts with none)
+void freeStack(Value* stack, int limit);
+// the openUpvalueAt array of a stack from newStack(), where it's indexed by slot
+static inline ObjUpvalue** stackUpvalues(Value* stack, int limit) {
+    return (ObjUpvalue**)(stack + limit);
+}
+double monotonicSeconds();          // cheap enough to read around every call, the GC's pauses, the profiler and the timers use it
+extern const char* const objTypeNames[OBJ_TYPE_COUNT];
 void freeObjects();
 
+// write barrier, call it whenever a reference is stored into an object (before the next allocation)
+// between full collections it's generational: old objects aren't traced by a minor collection, so one that might now
+// point at a young object has to be remembered
+// while a full collection is marking it keeps the tri-color invariant: an object that's already marked (maybe fully traced)
+// might now point at an unmarked one, so it's remembered to be traced again
+static inline void writeBarrier(Obj* object) {
+    bool traced = vm->gcPhase == GC_MARKING ? object->isMarked : object->isOld;
+    if (traced && !object->isRemembered) rememberObject(object);
+}
+
+// same, for a single stored value: only a young object (or while marking, an unmarked one) can break either invariant
+static inline void writeBarrierValue(Obj* object, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* stored = AS_OBJ(value);
+    if (vm->gcPhase == GC_MARKING ? !stored->isMarked : !stored->isOld) writeBarrier(object);
+}
+
 #endif   // end include guard
\ No newline at end of file
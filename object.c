@@ -1,8 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "loop.h"
 #include "memory.h"
 #include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
@@ -17,13 +20,17 @@ static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     object->isMarked = false;
+    object->isOld = false;
+    object->isRemembered = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    // every object is born young, a minor collection that finds it still reachable promotes it to vm->objects
+    object->next = vm->youngObjects;
+    vm->youngObjects = object;
+    vm->youngBytes += size;
+    vm->gcStats.types[type].allocated++;
+    vm->gcStats.types[type].bytesAllocated += size;
     
-  #ifdef DEBUG_LOG_GC
-    printf("%p allocate %zu for %d\n", (void*)object, size, type);
-  #endif
+    if (vm->debug & DEBUG_LOG_GC) printf("%p allocate %zu for %d\n", (void*)object, size, type);
 
     return object;
 }
@@ -44,9 +51,63 @@ ObjClass* newClass(ObjString* name) {
     klass->name = name; 
     klass->initializer = NIL_VAL;
     initTable(&klass->methods);
+    klass->fieldCapacityHint = 0;
+    klass->version = 0;
     return klass;
 }
 
+// a fiber's stack and frames start out much smaller than the main one's, there can be thousands of them
+// (they grow the same way, see call())
+ObjFiber* newFiber(ObjClosure* closure) {
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->state = closure == NULL ? FIBER_RUNNING : FIBER_NEW;
+    fiber->spawned = false;
+    fiber->closure = closure;
+    fiber->caller = NULL;
+    fiber->transfer = NIL_VAL;
+    fiber->retryArgs = -1;
+    fiber->ioFd = -1;
+    fiber->ioDone = 0;
+    fiber->ioChars = NULL;
+    fiber->ioCapacity = 0;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackEnd = NULL;
+    fiber->stackLimit = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->openUpvalueAt = NULL;
+    if (closure == NULL) return fiber;
+
+    fiber->stack = newStack(FIBER_STACK_MAX);
+    commitStack(fiber->stack, FIBER_STACK_MAX, FIBER_STACK_INITIAL);
+    fiber->openUpvalueAt = stackUpvalues(fiber->stack, FIBER_STACK_MAX);
+    fiber->frames = (CallFrame*)malloc(FIBER_FRAMES_INITIAL * sizeof(CallFrame));
+    if (fiber->frames == NULL) exit(1);
+    fiber->stackTop = fiber->stack;
+    fiber->stackEnd = fiber->stack + FIBER_STACK_INITIAL;
+    fiber->stackLimit = fiber->stack + FIBER_STACK_MAX;
+    fiber->frameCapacity = FIBER_FRAMES_INITIAL;
+    return fiber;
+}
+
+void releaseFiber(ObjFiber* fiber) {
+    freeStack(fiber->stack, (int)(fiber->stackLimit - fiber->stack));      // openUpvalueAt goes with it
+    free(fiber->frames);
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackEnd = NULL;
+    fiber->stackLimit = NULL;
+    fiber->openUpvalueAt = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->openUpvalues = NULL;
+    ioCancel(fiber);
+}
+
 // Creates a closure, which is a function bundled with references to its captured variables (upvalues)
 ObjClosure* newClosure(ObjFunction* function) {
     ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
@@ -67,19 +128,53 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 0;
     function->name = NULL;
+    function->closure = NULL;
+    function->lazy = NULL;
+    function->hotness = 0;
+    function->jit = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-// store a reference to the instance's class, initialize field-table with an empty hash-table
+void freeLazyBody(ObjFunction* function) {
+    if (function->lazy == NULL) return;
+    FREE_ARRAY(ObjString*, function->lazy->upvalueNames, function->upvalueCount);
+    FREE(LazyBody, function->lazy);
+    function->lazy = NULL;
+}
+
+// store a reference to the instance's class, every instance starts out with the empty shape (no fields)
+// room for as many fields as the class's instances have needed so far is allocated inline, right after the struct,
+// so instances that settle into the usual layout cost a single allocation
 ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+    int inlineCapacity = klass->fieldCapacityHint;
+    ObjInstance* instance = (ObjInstance*)allocateObject(
+        sizeof(ObjInstance) + sizeof(Value) * inlineCapacity, OBJ_INSTANCE);
     instance->klass = klass;
-    initTable(&instance->fields);
+    instance->shape = vm->emptyShape;
+    instance->fields = instance->inlineFields;
+    instance->fieldCapacity = inlineCapacity;
+    instance->inlineCapacity = inlineCapacity;
     return instance;
 }
 
+// a buffer of length zeros
+ObjBuffer* newBuffer(int length) {
+    ObjBuffer* buffer = (ObjBuffer*)allocateObject(sizeof(ObjBuffer) + sizeof(double) * length, OBJ_BUFFER);
+    buffer->length = length;
+    memset(buffer->values, 0, sizeof(double) * length);
+    return buffer;
+}
+
+// an empty list, its array is allocated by the first element that goes in
+ObjList* newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
 // takes a C function pointer to wrap in an ObjNative
 // sets up the object header and stores the function
 ObjNative* newNative(NativeFn function) {
@@ -88,6 +183,107 @@ ObjNative* newNative(NativeFn function) {
     return native;
 }
 
+// makes the shape reached from parent by adding the field name (or the empty root shape when parent is NULL)
+// the child copies its parent's field indices, gives name the next index, and is registered as parent's transition for name
+// the new shape is stashed on the stack while its tables grow since nothing else can reach it yet
+ObjShape* newShape(ObjShape* parent, ObjString* name) {
+    ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+    shape->parent = parent;
+    shape->name = name;
+    shape->fieldCount = 0;
+    initTable(&shape->fieldIndex);
+    initTable(&shape->transitions);
+    if (parent == NULL) return shape;
+
+    push(OBJ_VAL(shape));
+    tableAddAll(&parent->fieldIndex, &shape->fieldIndex);
+    tableSet(&shape->fieldIndex, name, INT_VAL(parent->fieldCount));
+    shape->fieldCount = parent->fieldCount + 1;
+    tableSet(&parent->transitions, name, OBJ_VAL(shape));
+    writeBarrier((Obj*)shape);
+    writeBarrier((Obj*)parent);
+    pop();
+    return shape;
+}
+
+// follows (or creates) the transition out of shape for adding the field name
+static ObjShape* shapeTransition(ObjShape* shape, ObjString* name) {
+    Value child;
+    if (tableGet(&shape->transitions, name, &child)) {
+        return (ObjShape*)AS_OBJ(child);
+    }
+    return newShape(shape, name);
+}
+
+// returns the index of the field name in instances of this shape, or -1 if the shape doesn't have it
+int shapeFieldIndex(ObjShape* shape, ObjString* name) {
+    Value index;
+    if (!tableGet(&shape->fieldIndex, name, &index)) return -1;
+    return AS_INT(index);
+}
+
+// the shape with every field of shape except name, in the same order
+// replays the transitions for the fields added after name on top of the shape name was added to
+static ObjShape* shapeWithout(ObjShape* shape, ObjString* name) {
+    if (shape->name == name) return shape->parent;
+    return shapeTransition(shapeWithout(shape->parent, name), shape->name);
+}
+
+// looks the field up through the instance's shape, copies it into value if it exists
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value) {
+    int index = shapeFieldIndex(instance->shape, name);
+    if (index == -1) return false;
+
+    *value = instance->fields[index];
+    return true;
+}
+
+// overwrites an existing field in place, otherwise moves the instance to the shape with name added
+// (growing the fields array past its inline slots if needed) and stores value in the new last slot
+// instance and value must be reachable from the stack, making a shape or growing the array can trigger the GC
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value) {
+    int index = shapeFieldIndex(instance->shape, name);
+    if (index != -1) {
+        instance->fields[index] = value;
+        writeBarrierValue((Obj*)instance, value);
+        return;
+    }
+
+    ObjShape* shape = shapeTransition(instance->shape, name);
+    if (shape->fieldCount > instance->fieldCapacity) {
+        int capacity = instance->fieldCapacity < 4 ? 4 : instance->fieldCapacity * 2;
+        Value* fields = ALLOCATE(Value, capacity);
+        memcpy(fields, instance->fields, sizeof(Value) * instance->shape->fieldCount);
+        if (instance->fields != instance->inlineFields) {
+            FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+        }
+        instance->fields = fields;
+        instance->fieldCapacity = capacity;
+    }
+
+    instance->fields[shape->fieldCount - 1] = value;
+    instance->shape = shape;
+    writeBarrier((Obj*)instance);                                           // the shape may be as new as the value
+    if (shape->fieldCount > instance->klass->fieldCapacityHint) {
+        instance->klass->fieldCapacityHint = shape->fieldCount;
+    }
+}
+
+// moves the instance to the shape without name and shifts the fields after it down one slot
+// returns false if the instance had no such field
+bool instanceDeleteField(ObjInstance* instance, ObjString* name) {
+    int index = shapeFieldIndex(instance->shape, name);
+    if (index == -1) return false;
+
+    ObjShape* shape = shapeWithout(instance->shape, name);
+    for (int i = index; i < shape->fieldCount; i++) {
+        instance->fields[i] = instance->fields[i + 1];
+    }
+    instance->shape = shape;
+    writeBarrier((Obj*)instance);
+    return true;
+}
+
 // creates a new ObjString on the heap and then initializes its fields, pass in it's hash code as well
 // resizing string pool can trigger GC, so we stash new string on stack, since it initially is not reachable anywhere and will therefore not be marked by GC
 static ObjString* allocateString(char* chars, int length, uint32_t hash) {
@@ -95,30 +291,122 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
+    vm->gcStats.types[OBJ_STRING].bytesAllocated += length + 1;        // the characters were allocated before it, by the caller
     
     push(OBJ_VAL(string));
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&vm->strings, string, NIL_VAL);
     pop();
 
     return string;
 }
 
-// hashing algorithm used in function is called "FNV-1a"
-// starts initial hash as some value, then "mixes bits mathematically" to get output (hash code)
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+// 64x64 -> 128 bit multiply, the mixing step of the hash below
+static inline void multiply128(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    // schoolbook on 32 bit halves for compilers without a 128 bit type
+    uint64_t ha = *a >> 32, la = (uint32_t)*a, hb = *b >> 32, lb = (uint32_t)*b;
+    uint64_t high = ha * hb, middle0 = ha * lb, middle1 = hb * la, low = la * lb;
+    uint64_t t = low + (middle0 << 32);
+    uint64_t carry = t < low;
+    uint64_t lo = t + (middle1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
+}
+
+// both halves of the product folded together
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    multiply128(&a, &b);
+    return a ^ b;
+}
+
+// unaligned reads (memcpy compiles down to a single load)
+static inline uint64_t read64(const uint8_t* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// hashing algorithm used in function is modeled on wyhash: eats 8 bytes at a time (48 per round in three independent lanes
+// for long strings) and mixes them in with 128 bit multiplies, instead of FNV-1a's multiply per byte
+// short strings (most identifiers) are up to 16 bytes read as a few overlapping words without any loop
+uint64_t hashBytes(const char* key, size_t length) {
+    static const uint64_t secret[4] = { 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull };
+    const uint8_t* p = (const uint8_t*)key;
+    uint64_t seed = mix(secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t middle = (length >> 3) << 2;             // 0 or 4: the two pairs of 4 byte reads overlap to cover 4..16 bytes
+            a = (read32(p) << 32) | read32(p + middle);
+            b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);                             // the last 16 bytes, overlapping what came before if need be
+        b = read64(p + i - 8);
     }
-    return hash;
+
+    a ^= secret[1];
+    b ^= seed;
+    multiply128(&a, &b);
+    return mix(a ^ secret[0] ^ length, b ^ secret[1]);
+}
+
+// the hash code of a string, both halves of hashBytes() folded into 32 bits
+static uint32_t hashString(const char* key, int length) {
+    uint64_t hash = hashBytes(key, (size_t)length);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// the interned string with these characters, if there is one
+// an old one that wasn't marked while a full collection is sweeping is one the sweep may not have freed yet (dead strings
+// stay in the table until then), marking it keeps it: nothing else can reach it, and a string has nothing of its own to trace
+// (one the sweep already went past just stays marked until the next sweep, which at worst keeps it a cycle longer)
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    if (interned != NULL && vm->gcPhase == GC_SWEEPING && interned->obj.isOld) interned->obj.isMarked = true;
+    return interned;
 }
 
 // claims ownership of the string given (useful for string concatenation when dynamically allocating char array on heap - no need for a redundant copy)
 // modfified to also calculate the hash code and pass it on, includes string interning
 ObjString* takeString(char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
         return interned;
@@ -131,7 +419,7 @@ ObjString* takeString(char* chars, int length) {
 ObjString* copyString(const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL) return interned;
 
     char* heapChars = ALLOCATE(char, length + 1);
@@ -140,24 +428,151 @@ ObjString* copyString(const char* chars, int length) {
     return allocateString(heapChars, length, hash);
 }
 
+// a + b for two strings (either kind), both have to stay reachable (e.g. on the stack) since this allocates
+// a result of at least ROPE_MIN_LENGTH characters becomes a rope, anything shorter is copied and interned as before
+Value concatenateStrings(Value a, Value b) {
+    if (stringLength(a) == 0) return b;
+    if (stringLength(b) == 0) return a;
+
+    int length = stringLength(a) + stringLength(b);
+    if (length < ROPE_MIN_LENGTH) {
+        ObjString* x = AS_STRING(a);                // no rope is that short, so both are flat
+        ObjString* y = AS_STRING(b);
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, x->chars, x->length);
+        memcpy(chars + x->length, y->chars, y->length);
+        chars[length] = '\0';
+        return OBJ_VAL(takeString(chars, length));
+    }
+
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->flat = NULL;
+    // a half that's been flattened already is replaced by its string, so the old node can be freed
+    rope->left = IS_ROPE(a) && AS_ROPE(a)->flat != NULL ? (Obj*)AS_ROPE(a)->flat : AS_OBJ(a);
+    rope->right = IS_ROPE(b) && AS_ROPE(b)->flat != NULL ? (Obj*)AS_ROPE(b)->flat : AS_OBJ(b);
+    return OBJ_VAL(rope);
+}
+
+// copies the characters of a rope into chars (rope->length of them), without allocating anything on the heap
+// fills it from the end, stacking the left halves and going right: the left-leaning ropes that appending in a loop builds
+// then never need more than one entry, however deep they are (the scratch stack uses realloc directly, like the gray stack)
+static void copyRopeChars(ObjRope* rope, char* chars) {
+    Obj** stack = NULL;
+    int count = 0;
+    int capacity = 0;
+    char* end = chars + rope->length;
+
+    Obj* part = (Obj*)rope;
+    for (;;) {
+        if (part->type == OBJ_ROPE && ((ObjRope*)part)->flat == NULL) {
+            if (capacity < count + 1) {
+                capacity = GROW_CAPACITY(capacity);
+                stack = (Obj**)realloc(stack, sizeof(Obj*) * capacity);
+                if (stack == NULL) exit(1);
+            }
+            stack[count++] = ((ObjRope*)part)->left;
+            part = ((ObjRope*)part)->right;
+            continue;
+        }
+
+        ObjString* string = part->type == OBJ_ROPE ? ((ObjRope*)part)->flat : (ObjString*)part;
+        end -= string->length;
+        memcpy(end, string->chars, string->length);
+        if (count == 0) break;
+        part = stack[--count];
+    }
+
+    free(stack);
+}
+
+// the interned string with the rope's characters, built the first time it's asked for and kept in rope->flat
+// the rope has to be reachable, building the string can trigger a collection
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    char* chars = ALLOCATE(char, rope->length + 1);
+    copyRopeChars(rope, chars);
+    chars[rope->length] = '\0';
+    ObjString* flat = takeString(chars, rope->length);
+
+    rope->flat = flat;
+    rope->left = NULL;                              // the halves aren't needed anymore
+    rope->right = NULL;
+    writeBarrier((Obj*)rope);
+    return flat;
+}
+
+// a string value (either kind) as an interned ObjString, e.g. to use it as a table key
+ObjString* flatString(Value value) {
+    return IS_STRING(value) ? AS_STRING(value) : flattenRope(AS_ROPE(value));
+}
+
+// whether a and b, two different objects, are the same string anyway, which takes a rope (two ObjStrings never are, they're interned)
+// only flattens them when they're strings of the same length, so both have to be reachable
+bool stringsEqual(Value a, Value b) {
+    if (!IS_ROPE(a) && !IS_ROPE(b)) return false;
+    if (!isAnyString(a) || !isAnyString(b)) return false;
+    if (stringLength(a) != stringLength(b)) return false;
+    return flatString(a) == flatString(b);
+}
+
 // Creates a new ObjUpvalue, which is used to close over variables from enclosing functions
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
     upvalue->next = NULL;
+    upvalue->fiber = vm->fiber;
     return upvalue;
 }
 
+// printing goes to the VM's output buffer (see output.h)
+static void writeLiteral(const char* chars) {
+    writeOutput(chars, (int)strlen(chars));
+}
+
+static void writeString(ObjString* string) {
+    writeOutput(string->chars, string->length);
+}
+
 // to print function name
 // if user-defined the name is not NULL, else, it is for top-level code
 // An instance prints its name followed by “instance”
 static void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        writeLiteral("<script>");
+        return;
+    }
+    writeLiteral("<fn ");
+    writeString(function->name);
+    writeLiteral(">");
+}
+
+// lists currently being printed, from the outermost in: a list that (directly or not) contains itself prints as [...]
+// instead of recursing forever, and so does anything nested deeper than this
+#define PRINT_NESTING_MAX 64
+static THREAD_LOCAL ObjList* printingLists[PRINT_NESTING_MAX];
+static THREAD_LOCAL int printingCount = 0;
+
+static void printList(ObjList* list) {
+    bool nested = printingCount == PRINT_NESTING_MAX;
+    for (int i = 0; i < printingCount && !nested; i++) {
+        if (printingLists[i] == list) nested = true;
+    }
+    if (nested) {
+        writeLiteral("[...]");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+
+    printingLists[printingCount++] = list;
+    writeLiteral("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) writeLiteral(", ");
+        printValue(list->items.values[i]);
+    }
+    writeLiteral("]");
+    printingCount--;
 }
 
 // for printing obj values
@@ -166,26 +581,61 @@ void printObject(Value value) {
         case OBJ_BOUND_METHOD:
             printFunction(AS_BOUND_METHOD(value)->method->function);
             break;
+        case OBJ_BUFFER:
+            writeLiteral("<buffer ");
+            writeNumber(AS_BUFFER(value)->length);
+            writeLiteral(">");
+            break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            writeString(AS_CLASS(value)->name);
             break;
         case OBJ_CLOSURE:
             printFunction(AS_CLOSURE(value)->function);
             break;
+        case OBJ_FIBER:
+            writeLiteral("<fiber>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+            writeString(AS_INSTANCE(value)->klass->name);
+            writeLiteral(" instance");
+            break;
+        case OBJ_LIST:
+            printList(AS_LIST(value));
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            writeLiteral("<native fn>");
+            break;
+        case OBJ_ROPE: {
+            // printed without flattening it, so printing never allocates anything the GC sees (its logging prints objects too)
+            // the characters get copied straight into the output buffer when they fit
+            ObjRope* rope = AS_ROPE(value);
+            if (rope->flat != NULL) {
+                writeString(rope->flat);
+                break;
+            }
+            char* chars = reserveOutput(rope->length);
+            if (chars != NULL) {
+                copyRopeChars(rope, chars);
+                break;
+            }
+            chars = (char*)malloc(rope->length);
+            if (chars == NULL) exit(1);
+            copyRopeChars(rope, chars);
+            writeOutput(chars, rope->length);
+            free(chars);
+            break;
+        }
+        case OBJ_SHAPE:
+            writeLiteral("shape");
             break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeString(AS_STRING(value));
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            writeLiteral("upvalue");
             break;
     }
 }
\ No newline at end of file
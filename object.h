@@ -14,58 +14,99 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 // to check if a value is an instance
 #define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+// to check if a value is a list
+#define IS_LIST(value)         isObjType(value, OBJ_LIST)
 // to check if a value is a native function
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 // to check if a value is a bound method
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 // testing obj type to be a class
 #define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
+// to check if a value is a numeric buffer
+#define IS_BUFFER(value)       isObjType(value, OBJ_BUFFER)
 // to check if value is a closure
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
+// to check if a value is a fiber
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
 // to ensure that the Obj* pointer you have does point to the obj field of an actual ObjString
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+// a string built by + that hasn't been flattened yet (see ObjRope)
+#define IS_ROPE(value)         isObjType(value, OBJ_ROPE)
+// either kind of string, all Lox can tell apart is their characters
+#define IS_ANY_STRING(value)   isAnyString(value)
 
 // casts value to an ObjBoundMethod pointer
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+// casts value to an ObjBuffer pointer
+#define AS_BUFFER(value)       ((ObjBuffer*)AS_OBJ(value))
 // casts value to an ObjClass pointer
 #define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 // casts the value to ObjClosure pointer
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
 // casts the value to ObjFunction pointer
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 // casts the value to ObjInstance pointer
 #define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+// casts the value to ObjList pointer
+#define AS_LIST(value)         ((ObjList*)AS_OBJ(value))
 
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 // take a Value that is expected to contain a pointer to a valid ObjString on the heap
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)         ((ObjRope*)AS_OBJ(value))
 
 // different type tags for each obj
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_BUFFER,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
     OBJ_NATIVE,
+    OBJ_ROPE,
+    OBJ_SHAPE,
     OBJ_STRING,
     OBJ_UPVALUE
 } ObjType;
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)     // for arrays indexed by an ObjType
 
 struct Obj {
     ObjType type;               // the type of obj it is
-    bool isMarked;              // has it been marked by the garbage collector (GC) or not
+    bool isMarked;              // has it been marked by the garbage collector (GC) or not, only ever set while a collection is running
+    bool isOld;                 // survived a collection, lives on vm->objects and isn't traced by minor collections
+    bool isRemembered;          // already in the remembered set (see writeBarrier() in memory.h)
     struct Obj* next;           // next pointer (intrusive list) for a Linked list to store every obj created/allocated onto heap 
 };
 
+// what's left of a function whose body hasn't been compiled yet, compiled lazily it only gets one on its first call
+// (see compileBody() in compiler.c)
+typedef struct {
+    ObjString* source;          // the whole script it's in, copied by the compiler
+    int start;                  // offset of the '(' opening its parameter list in source
+    int line;                   // line that's on
+    int type;                   // its FunctionType
+    bool inClass;               // declared inside a class body (a method, or a function nested in one)
+    bool hasSuperclass;         // ...whose class has a superclass
+    ObjString** upvalueNames;   // what each of its upvalues is called, for the body to find them by
+} LazyBody;
+
 typedef struct {
     Obj obj;                    // functions are 1st-class, so they need to be an obj
     int arity;                  // stores the # of parameters function is expecting
     int upvalueCount;
+    int maxSlots;               // the most stack slots its frame has in use at once, the callee and arguments included (call() makes room for them)
     Chunk chunk;                // Each function has its own chunk to be processed
     ObjString* name;            // function name
+    struct ObjClosure* closure; // the one closure every OP_CLOSURE shares when the function captures nothing, NULL until made
+    LazyBody* lazy;             // non-NULL while the chunk is still empty, the body gets compiled on the first call
+    int hotness;                // calls and loop iterations so far, the JIT compiles it once these reach JIT_HOTNESS
+    struct JitCode* jit;        // its machine code, NULL until then (see jit.h)
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -83,14 +124,88 @@ struct ObjString {
     uint32_t hash;              // each ObjString stores the hash code for its string
 };
 
+// concatenating strings makes a rope, a node pointing at both halves, in O(1) instead of copying them into a new string
+// (building a string with + in a loop used to be quadratic, and interned every string along the way)
+// a rope is flattened into an interned ObjString the first time its characters are needed as one string: when it's
+// compared with another string of the same length or used as a table key (see flattenRope()), it then forwards to that string
+// printing one just walks it
+// results shorter than ROPE_MIN_LENGTH aren't worth a node and are still copied and interned right away
+#define ROPE_MIN_LENGTH 32
+
+typedef struct {
+    Obj obj;                    // obj header
+    int length;                 // length of the whole string
+    Obj* left;                  // the two halves, each an ObjString or an unflattened ObjRope (NULL once flattened)
+    Obj* right;
+    ObjString* flat;            // NULL until flattened, then the interned string with the same characters
+} ObjRope;
+
+// a list keeps its elements in one contiguous, growable array (the same ValueArray constant tables use),
+// so indexing is a bounds check and a load, and append is amortized O(1)
+typedef struct {
+    Obj obj;                    // obj header
+    ValueArray items;           // the elements, items.count of them
+} ObjList;
+
+// a fixed-length array of raw doubles for numeric work, the elements aren't Values so nothing needs to box them
+// and the buffer natives in vm.c run over them with SIMD (see buffer.h), indexing works just like on a list
+// the elements are allocated together with the buffer itself
+typedef struct {
+    Obj obj;                    // obj header
+    int length;                 // # of elements
+    double values[];            // the elements
+} ObjBuffer;
+
 typedef struct ObjUpvalue {
     Obj obj;                     // Every object starts with an Obj header
     Value* location;             // Points to the variable in the VM's stack
     Value closed;                // If the variable is closed, value is copied here
     struct ObjUpvalue* next;     // Linked list pointer (used by VM to track open upvalues)
+    struct ObjFiber* fiber;      // while open, the fiber whose stack location is in (kept alive with it), NULL once closed
 } ObjUpvalue;
 
-typedef struct {
+// where a fiber is at, see the natives in vm.c
+typedef enum {
+    FIBER_NEW,                  // made by fiber() or spawn(), hasn't run yet
+    FIBER_RUNNING,              // the one running, or one waiting for the fiber it resumed to yield or return
+    FIBER_SUSPENDED,            // yielded to the fiber that resumed it, resume() picks it up again
+    FIBER_READY,                // in the scheduler's queue to run (see loop.h)
+    FIBER_WAITING,              // waiting for a timer or a socket, the event loop queues it once that's done
+    FIBER_DRAINING,             // the main fiber once its script has returned, until every other fiber has finished too
+    FIBER_DONE                  // returned, or was abandoned by a runtime error
+} FiberState;
+
+// a thread of Lox execution with a value stack and call frames of its own, which switches with the others in run()
+// only the running fiber's stack and frames are in vm (vm->stack, vm->frames...), switching moves them out into its
+// ObjFiber and the next one's in, so the interpreter loop and the GC's roots don't need to know about fibers at all
+// the main fiber is the one that runs the script, it starts out running
+typedef struct ObjFiber {
+    Obj obj;                    // obj header
+    FiberState state;
+    bool spawned;               // run by the scheduler (spawn()), not by whoever resumes it
+    struct ObjClosure* closure; // what it runs (takes no arguments or gets the first resume()'s value), NULL for the main fiber
+    struct ObjFiber* caller;    // the fiber that resumed it, what it yields or returns goes to that one
+    Value transfer;             // what it picks up with when it gets switched to: resume()'s value or what its resume() call returns
+    int retryArgs;              // waiting in an I/O native with that many arguments, which gets called again once it can go on
+                                // (-1 when it isn't, what it waits for then only has to wake it up)
+    int ioFd;                   // progress of the I/O native's operation across those calls (ioFd -1 when there is none)
+    size_t ioDone;
+    char* ioChars;
+    size_t ioCapacity;
+
+    // its execution state while it isn't running, the same fields as vm's (empty while it runs)
+    struct CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    Value* stackEnd;
+    Value* stackLimit;
+    struct ObjUpvalue* openUpvalues;
+    struct ObjUpvalue** openUpvalueAt;
+} ObjFiber;
+
+typedef struct ObjClosure {
     Obj obj;                    // closure will contain an object tag
     ObjFunction* function;      // the function being closed over
     ObjUpvalue** upvalues;      // array of pointers to upvalue objects
@@ -98,17 +213,36 @@ typedef struct {
 } ObjClosure;
 
 
-typedef struct {
+// a shape (hidden class) describes the field layout of an instance: which names it has and at which index each one lives
+// shapes are shared by every instance with the same layout and form a tree rooted at vm->emptyShape,
+// adding a field moves an instance to the child shape for that name (created the first time anyone takes that transition)
+// property names only ever come from identifiers in the source, so the tree stays small and is never pruned
+struct ObjShape {
+    Obj obj;                    // obj header
+    ObjShape* parent;           // shape this one was reached from (NULL for the empty root shape)
+    ObjString* name;            // the field added by the transition from parent (NULL for the root)
+    int fieldCount;             // # of fields an instance of this shape has, also the index the next added field gets
+    Table fieldIndex;           // field name -> its index in ObjInstance.fields (stored as a number)
+    Table transitions;          // field name -> the child shape reached by adding that field
+};
+
+struct ObjClass {
     Obj obj;                    // obj header
     ObjString* name;            // to store the class's name (for things like stack traces)
     Value initializer;          // cache the initializer directly in the ObjClass to avoid the hash table lookup (optimization)
     Table methods;              // each class stores a hash-table of methods (keys: method names, values: an ObjClosure for the body of the method)
-} ObjClass;
+    int fieldCapacityHint;      // most fields an instance of this class has needed so far, new instances allocate that many slots up front
+    uint32_t version;           // bumped every time methods changes, inline cache entries remember it to notice they went stale
+};
 
 typedef struct {
     Obj obj;                    // object header
     ObjClass* klass;            // pointer to the class it is an instance of
-    Table fields;               // Each instance stores its fields in a hash-table
+    ObjShape* shape;            // layout of the fields array (shared with every other instance built the same way)
+    Value* fields;              // field values, fields[i] belongs to the name the shape maps to i (points at inlineFields until it outgrows them)
+    int fieldCapacity;          // allocated size of the fields array (shape->fieldCount of them are in use)
+    int inlineCapacity;         // # of slots allocated together with the instance itself
+    Value inlineFields[];       // those inline slots
 } ObjInstance;
 
 // a bound method is a method that is tied to a specific instance of a class
@@ -119,13 +253,28 @@ typedef struct {
 } ObjBoundMethod;
   
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjBuffer* newBuffer(int length);
 ObjClass* newClass(ObjString* name);
 ObjClosure* newClosure(ObjFunction* function);
+ObjFiber* newFiber(ObjClosure* closure);          // with a fresh stack and frames, NULL closure for the main fiber (which has vm's)
+void releaseFiber(ObjFiber* fiber);               // frees its stack and frames (it mustn't be the one running) and cancels its I/O
 ObjFunction* newFunction();
+void freeLazyBody(ObjFunction* function);         // drops function->lazy, if it has one
 ObjInstance* newInstance(ObjClass* klass);
+ObjList* newList();
 ObjNative* newNative(NativeFn function);
+ObjShape* newShape(ObjShape* parent, ObjString* name);
+int shapeFieldIndex(ObjShape* shape, ObjString* name);
+bool instanceGetField(ObjInstance* instance, ObjString* name, Value* value);
+void instanceSetField(ObjInstance* instance, ObjString* name, Value value);
+bool instanceDeleteField(ObjInstance* instance, ObjString* name);
+uint64_t hashBytes(const char* key, size_t length);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+Value concatenateStrings(Value a, Value b);
+ObjString* flattenRope(ObjRope* rope);
+ObjString* flatString(Value value);
+bool stringsEqual(Value a, Value b);
 ObjUpvalue* newUpvalue(Value* slot);
 void printObject(Value value);
 
@@ -134,6 +283,15 @@ void printObject(Value value);
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
+
+static inline bool isAnyString(Value value) {
+    return IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING || AS_OBJ(value)->type == OBJ_ROPE);
+}
+
+// the length of either kind of string
+static inline int stringLength(Value value) {
+    return IS_STRING(value) ? AS_STRING(value)->length : AS_ROPE(value)->length;
+}
   
 // end include guard
 #endif
\ No newline at end of file
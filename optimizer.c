@@ -0,0 +1,356 @@
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+// a jump copied into the new code, patched once every instruction's new offset is known
+typedef struct {
+    int at;                 // offset of its 2 byte operand in the new code
+    int from;               // offset the operand counts from in the new code, the end of its instruction
+    int target;             // offset it must land on, in the old code
+    bool backward;          // OP_LOOP's
+} PendingJump;
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_BUILD_LIST:
+        case OP_ADD_CONSTANT:
+        case OP_SUBTRACT_CONSTANT:
+            return 2;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCALS:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return 3;
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_CONSTANT_LONG:
+            return 4;
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return 5;
+        case OP_SWITCH_INT:
+            return 9 + 2 * ((chunk->code[offset + 5] << 8) | chunk->code[offset + 6]);
+        case OP_SWITCH_STRING:
+            return 5 + 4 * ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+        case OP_CLOSURE: {
+            // followed by an (isLocal, index) byte pair for every upvalue the function captures
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + 2 * function->upvalueCount;
+        }
+        default:
+            return 1;
+    }
+}
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// offset a jump lands on, the 2 byte operand counts from the end of the jump instruction (backwards for OP_LOOP)
+static int jumpTarget(Chunk* chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// the operands of a switch's jumps: jump -1 is the miss jump, 0 and up are the slots' (-1 for an empty string slot)
+static int switchOperand(Chunk* chunk, int offset, int jump) {
+    uint8_t* code = chunk->code + offset;
+    if (code[0] == OP_SWITCH_INT) return offset + 9 + 2 * jump;
+    if (jump == -1) return offset + 3;
+    uint8_t* slot = code + 5 + 4 * jump;
+    return slot[0] == 0xff && slot[1] == 0xff ? -1 : offset + 7 + 4 * jump;
+}
+
+static int switchSize(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    return code[0] == OP_SWITCH_INT ? (code[5] << 8) | code[6] : (code[1] << 8) | code[2];
+}
+
+// how many values the instruction at offset leaves on the stack, less how many it takes off
+static int stackEffect(Chunk* chunk, int offset) {
+    uint8_t* code = chunk->code + offset;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_DUP:
+        case OP_CLOSURE:
+        case OP_CONSTANT_LONG:
+        case OP_CLASS:
+        case OP_ADD_LOCALS:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULUS:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_INDEX_GET:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_TRUE:
+            return -1;
+        case OP_INDEX_SET:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_GREATER:
+            return -2;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -code[1];                        // the callee and its arguments, then the result
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -code[2];
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return -code[2] - 1;                    // the superclass too
+        case OP_BUILD_LIST:
+            return 1 - code[1];
+        default:
+            return 0;
+    }
+}
+
+static bool isForwardJump(uint8_t instruction) {
+    return instruction != OP_LOOP && isJump(instruction);
+}
+
+// the most stack slots a frame running chunk ever has in use, counting from its slot 0 (the callee), slots is how many
+// it starts out with (the callee and the arguments)
+// one pass in code order: a forward jump hands its depth on to its target, an instruction starts out at the deepest of
+// what falls through to it and what jumps there (code right after a jump or a return gets the depth before it, at
+// worst that's a few slots too many), each loop's start has been passed before at the depth its OP_LOOP comes back with
+int maxStackDepth(Chunk* chunk, int slots) {
+    int* depthAt = ALLOCATE(int, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++) depthAt[i] = 0;
+
+    int depth = slots;
+    int max = slots;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t instruction = chunk->code[offset];
+        int next = offset + instructionLength(chunk, offset);
+        if (depthAt[offset] > depth) depth = depthAt[offset];
+
+        // OP_BUILD_LIST has the new list on top of its elements for a moment
+        if (instruction == OP_BUILD_LIST && depth + 1 > max) max = depth + 1;
+        depth += stackEffect(chunk, offset);
+        if (depth > max) max = depth;
+
+        if (isForwardJump(instruction)) {
+            int target = jumpTarget(chunk, offset);
+            if (target >= 0 && target <= chunk->count && depth > depthAt[target]) depthAt[target] = depth;
+        } else if (instruction == OP_SWITCH_INT || instruction == OP_SWITCH_STRING) {
+            for (int i = -1; i < switchSize(chunk, offset); i++) {
+                int at = switchOperand(chunk, offset, i);
+                if (at == -1) continue;
+                int target = next + ((chunk->code[at] << 8) | chunk->code[at + 1]);
+                if (target <= chunk->count && depth > depthAt[target]) depthAt[target] = depth;
+            }
+        }
+        offset = next;
+    }
+
+    FREE_ARRAY(int, depthAt, chunk->count + 1);
+    return max;
+}
+
+// an instruction can only be folded into the one before it if nothing jumps straight to it
+static bool canFuse(Chunk* chunk, bool* isTarget, int offset) {
+    return offset < chunk->count && !isTarget[offset];
+}
+
+// JUMP_IF_FALSE x; POP where x is a POP too, what every if/while/for condition compiles to
+// the jump leaves the condition on the stack for each path to pop on its own, a popping jump can instead pop it
+// up front and land just past the POP at x (which stays put for any other path that reaches it)
+static bool isConditionJump(Chunk* chunk, bool* isTarget, int offset) {
+    if (offset >= chunk->count || chunk->code[offset] != OP_JUMP_IF_FALSE) return false;
+    if (!canFuse(chunk, isTarget, offset + 3) || chunk->code[offset + 3] != OP_POP) return false;
+
+    int target = jumpTarget(chunk, offset);
+    return target < chunk->count && chunk->code[target] == OP_POP;
+}
+
+static bool isNumberConstant(Chunk* chunk, int offset) {
+    return chunk->code[offset] == OP_CONSTANT && IS_NUMBER(chunk->constants.values[chunk->code[offset + 1]]);
+}
+
+// writes a jump with a placeholder operand and remembers where it has to land
+static void emitJump(Chunk* out, uint8_t instruction, int target, int line, PendingJump* jumps, int* jumpCount) {
+    jumps[*jumpCount].at = out->count + 1;
+    jumps[*jumpCount].from = out->count + 3;
+    jumps[*jumpCount].target = target;
+    jumps[*jumpCount].backward = instruction == OP_LOOP;
+    (*jumpCount)++;
+
+    writeChunk(out, instruction, line);
+    writeChunk(out, 0xff, line);
+    writeChunk(out, 0xff, line);
+}
+
+// 1. Finds every jump target, since a sequence can't be fused if something jumps into the middle of it
+// 2. Copies the code into a new chunk, replacing the patterns listed next to the superinstructions in chunk.h
+// 3. Patches each jump (a switch's included) using the old -> new offset of its target (code only ever shrinks, so offsets still fit in 2 bytes)
+// a fused instruction takes the line of the original instruction that could raise its runtime errors (the ADD, the comparison)
+void optimizeChunk(Chunk* chunk) {
+    int count = chunk->count;
+    uint8_t* code = chunk->code;
+
+    bool* isTarget = ALLOCATE(bool, count + 1);
+    memset(isTarget, 0, sizeof(bool) * (count + 1));
+    int jumpCount = 0;
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset)) {
+        if (code[offset] == OP_SWITCH_INT || code[offset] == OP_SWITCH_STRING) {
+            int end = offset + instructionLength(chunk, offset);
+            for (int i = -1; i < switchSize(chunk, offset); i++) {
+                int at = switchOperand(chunk, offset, i);
+                if (at == -1) continue;
+                isTarget[end + ((code[at] << 8) | code[at + 1])] = true;
+                jumpCount++;
+            }
+            continue;
+        }
+        if (!isJump(code[offset])) continue;
+        int target = jumpTarget(chunk, offset);
+        isTarget[target] = true;
+        if (code[offset] == OP_JUMP_IF_FALSE && target < count && code[target] == OP_POP) {
+            isTarget[target + 1] = true;            // where the jump lands if it gets turned into a popping one
+        }
+        jumpCount++;
+    }
+
+    int* newOffsets = ALLOCATE(int, count + 1);
+    int jumpCapacity = jumpCount + 1;
+    PendingJump* jumps = ALLOCATE(PendingJump, jumpCapacity);
+    jumpCount = 0;
+
+    Chunk out;
+    initChunk(&out);
+    for (int offset = 0; offset < count;) {
+        newOffsets[offset] = out.count;
+        uint8_t instruction = code[offset];
+        int next = offset + instructionLength(chunk, offset);
+
+        if ((instruction == OP_LESS || instruction == OP_GREATER || instruction == OP_NOT) &&
+            canFuse(chunk, isTarget, next) && isConditionJump(chunk, isTarget, next)) {
+            uint8_t fused = instruction == OP_LESS ? OP_JUMP_IF_NOT_LESS
+                          : instruction == OP_GREATER ? OP_JUMP_IF_NOT_GREATER
+                          : OP_POP_JUMP_IF_TRUE;
+            emitJump(&out, fused, jumpTarget(chunk, next) + 1, getLine(chunk, offset), jumps, &jumpCount);
+            offset = next + 4;
+        } else if (instruction == OP_JUMP_IF_FALSE && isConditionJump(chunk, isTarget, offset)) {
+            emitJump(&out, OP_POP_JUMP_IF_FALSE, jumpTarget(chunk, offset) + 1, getLine(chunk, offset), jumps, &jumpCount);
+            offset += 4;
+        } else if (instruction == OP_GET_LOCAL && canFuse(chunk, isTarget, next) && code[next] == OP_GET_LOCAL &&
+                   canFuse(chunk, isTarget, next + 2) && code[next + 2] == OP_ADD) {
+            int line = getLine(chunk, next + 2);
+            writeChunk(&out, OP_ADD_LOCALS, line);
+            writeChunk(&out, code[offset + 1], line);
+            writeChunk(&out, code[next + 1], line);
+            offset = next + 3;
+        } else if (isNumberConstant(chunk, offset) && canFuse(chunk, isTarget, next) && code[next] == OP_ADD) {
+            int line = getLine(chunk, next);
+            writeChunk(&out, OP_ADD_CONSTANT, line);
+            writeChunk(&out, code[offset + 1], line);
+            offset = next + 1;
+        } else if (isNumberConstant(chunk, offset) && canFuse(chunk, isTarget, next) && code[next] == OP_NEGATE &&
+                   canFuse(chunk, isTarget, next + 1) && code[next + 1] == OP_ADD) {
+            // the compiler turns a - b into a + -b
+            int line = getLine(chunk, next + 1);
+            writeChunk(&out, OP_SUBTRACT_CONSTANT, line);
+            writeChunk(&out, code[offset + 1], line);
+            offset = next + 2;
+        } else if (isJump(instruction)) {
+            emitJump(&out, instruction, jumpTarget(chunk, offset), getLine(chunk, offset), jumps, &jumpCount);
+            offset = next;
+        } else if (instruction == OP_SWITCH_INT || instruction == OP_SWITCH_STRING) {
+            // copied as it is, then each of its jumps gets patched like any other
+            int start = out.count;
+            for (int i = -1; i < switchSize(chunk, offset); i++) {
+                int at = switchOperand(chunk, offset, i);
+                if (at == -1) continue;
+                jumps[jumpCount].at = start + at - offset;
+                jumps[jumpCount].from = start + next - offset;
+                jumps[jumpCount].target = next + ((code[at] << 8) | code[at + 1]);
+                jumps[jumpCount].backward = false;
+                jumpCount++;
+            }
+            int line = getLine(chunk, offset);
+            for (; offset < next; offset++) {
+                writeChunk(&out, code[offset], line);
+            }
+        } else {
+            int line = getLine(chunk, offset);
+            for (; offset < next; offset++) {
+                writeChunk(&out, code[offset], line);
+            }
+        }
+    }
+    newOffsets[count] = out.count;
+
+    for (int i = 0; i < jumpCount; i++) {
+        int from = jumps[i].from;
+        int to = newOffsets[jumps[i].target];
+        int jump = jumps[i].backward ? from - to : to - from;
+        out.code[jumps[i].at] = (jump >> 8) & 0xff;
+        out.code[jumps[i].at + 1] = jump & 0xff;
+    }
+
+    // swap in the new code and line table, the constants and inline caches are indexed by operands that haven't changed
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    chunk->count = out.count;
+    chunk->capacity = out.capacity;
+    chunk->code = out.code;
+    chunk->lineCount = out.lineCount;
+    chunk->lineCapacity = out.lineCapacity;
+    chunk->lines = out.lines;
+
+    FREE_ARRAY(PendingJump, jumps, jumpCapacity);
+    FREE_ARRAY(int, newOffsets, count + 1);
+    FREE_ARRAY(bool, isTarget, count + 1);
+}
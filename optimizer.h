@@ -0,0 +1,16 @@
+// include guard
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// peephole pass over a finished function's bytecode, rewrites common instruction sequences into fused superinstructions
+// keeps jump offsets and the line table correct, run by endCompiler() when OPTIMIZE_PEEPHOLE is defined
+void optimizeChunk(Chunk* chunk);
+// # of bytes taken up by the instruction at offset (opcode + operands), mirrors what disassembleInstruction() steps over
+int instructionLength(Chunk* chunk, int offset);
+// the deepest the stack gets in a frame running chunk, from its slot 0 on, starting out with slots values (see ObjFunction)
+int maxStackDepth(Chunk* chunk, int slots);
+
+// end include guard
+#endif
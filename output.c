@@ -0,0 +1,160 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "output.h"
+#include "vm.h"
+
+// the powers of ten a double holds exactly
+static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define MAX_EXACT_POWER 22
+
+// %g keeps 6 significant digits
+#define PRECISION 6
+
+// appends to vm->output, writes it out first when there's no room left (and anything bigger than all of it goes straight out)
+void writeOutput(const char* chars, int length) {
+    if (vm->outputLength + length > vm->outputCapacity) {
+        flushOutput();
+        if (length > vm->outputCapacity) {
+            fwrite(chars, sizeof(char), length, stdout);
+            return;
+        }
+    }
+    memcpy(vm->output + vm->outputLength, chars, length);
+    vm->outputLength += length;
+}
+
+char* reserveOutput(int length) {
+    if (length > vm->outputCapacity) return NULL;
+    if (vm->outputLength + length > vm->outputCapacity) flushOutput();
+    char* chars = vm->output + vm->outputLength;
+    vm->outputLength += length;
+    return chars;
+}
+
+void writeNumber(double number) {
+    char chars[NUMBER_FORMAT_MAX];
+    writeOutput(chars, formatNumber(number, chars));
+}
+
+void flushOutput() {
+    if (vm->outputLength > 0) {
+        fwrite(vm->output, sizeof(char), vm->outputLength, stdout);
+        vm->outputLength = 0;
+    }
+    fflush(stdout);
+}
+
+// writes the decimal digits of value (at least one) backwards, ending just before end, returns where they start
+static char* writeDigitsBackwards(char* end, int value) {
+    do {
+        *--end = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    return end;
+}
+
+// the exact fast path: the 6 digit decimal digits * 10^(exponent - 5) nearest to magnitude, if that's exactly what
+// magnitude is as a double (digits / 10^k or digits * 10^k with both exact is a single rounding, so comparing is exact)
+// then it's also what %g rounds magnitude to, a double can't be any closer to another 6 digit decimal
+// returns false when that doesn't hold (or can't be checked that way), digits and exponent are left alone then
+static bool shortDecimal(double magnitude, int* digits, int* exponent) {
+    int e = (int)floor(log10(magnitude));
+
+    // log10() can be a little off right next to a power of ten, so the exponent gets a second chance
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int shift = PRECISION - 1 - e;
+        if (shift > MAX_EXACT_POWER || shift < -MAX_EXACT_POWER) return false;
+
+        double scaled = shift >= 0 ? magnitude * powersOfTen[shift] : magnitude / powersOfTen[-shift];
+        double rounded = floor(scaled + 0.5);
+        if (rounded < powersOfTen[PRECISION - 1]) {
+            e--;
+            continue;
+        }
+        if (rounded >= powersOfTen[PRECISION]) {
+            e++;
+            continue;
+        }
+
+        double back = shift >= 0 ? rounded / powersOfTen[shift] : rounded * powersOfTen[-shift];
+        if (back != magnitude) return false;
+        *digits = (int)rounded;
+        *exponent = e;
+        return true;
+    }
+    return false;
+}
+
+int formatNumber(double number, char* out) {
+    char* start = out;
+
+    // integers, by far the most common thing to print, %g writes every one below a million out in full
+    if (number > -1e6 && number < 1e6 && number == (double)(int)number) {
+        int value = (int)number;
+        if (signbit(number)) *out++ = '-';              // -0 included
+        char digits[12];
+        char* first = writeDigitsBackwards(digits + sizeof(digits), value < 0 ? -value : value);
+        int length = (int)(digits + sizeof(digits) - first);
+        memcpy(out, first, length);
+        out[length] = '\0';
+        return (int)(out - start) + length;
+    }
+
+    int digits;
+    int exponent;
+    if (!isfinite(number) || !shortDecimal(fabs(number), &digits, &exponent)) {
+        return snprintf(out, NUMBER_FORMAT_MAX, "%g", number);
+    }
+
+    // %g drops trailing zeros
+    int count = PRECISION;
+    while (digits % 10 == 0) {
+        digits /= 10;
+        count--;
+    }
+    char chars[PRECISION];
+    writeDigitsBackwards(chars + count, digits);
+
+    if (number < 0) *out++ = '-';
+    if (exponent < -4 || exponent >= PRECISION) {
+        // d.ddddde+XX, the exponent has at least two digits
+        *out++ = chars[0];
+        if (count > 1) {
+            *out++ = '.';
+            memcpy(out, chars + 1, count - 1);
+            out += count - 1;
+        }
+        *out++ = 'e';
+        *out++ = exponent < 0 ? '-' : '+';
+        int magnitude = exponent < 0 ? -exponent : exponent;
+        if (magnitude < 10) *out++ = '0';
+        char exponentDigits[4];
+        char* first = writeDigitsBackwards(exponentDigits + sizeof(exponentDigits), magnitude);
+        int length = (int)(exponentDigits + sizeof(exponentDigits) - first);
+        memcpy(out, first, length);
+        out += length;
+    } else if (exponent >= 0) {
+        // ddd.ddd, the digits before the point are all there (an integer would have taken the path above)
+        int whole = exponent + 1;
+        for (int i = 0; i < whole; i++) *out++ = i < count ? chars[i] : '0';
+        if (count > whole) {
+            *out++ = '.';
+            memcpy(out, chars + whole, count - whole);
+            out += count - whole;
+        }
+    } else {
+        // 0.000ddd
+        *out++ = '0';
+        *out++ = '.';
+        for (int i = -1; i > exponent; i--) *out++ = '0';
+        memcpy(out, chars, count);
+        out += count;
+    }
+    *out = '\0';
+    return (int)(out - start);
+}
@@ -0,0 +1,25 @@
+// include guard
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+
+// what Lox programs print is collected in vm->output and written to stdout in big chunks instead of a printf() per value:
+// when the buffer fills up, when the program ends, before a runtime error gets reported and before the REPL's prompt
+// while a diagnostic that prints to stdout itself is on (--trace, --log-gc, --print-code) nothing is held back, so
+// everything still comes out in order
+#define OUTPUT_BUFFER_SIZE 16384
+
+// longest thing formatNumber() writes, its terminating '\0' included
+#define NUMBER_FORMAT_MAX 32
+
+void writeOutput(const char* chars, int length);
+void writeNumber(double number);
+char* reserveOutput(int length);        // room for length chars in the buffer for the caller to fill in, NULL if it can't hold them
+void flushOutput();
+// same characters printf("%g") makes of number (without the '\0' counted in its return value), mostly without printf():
+// integers below a million and numbers that are exactly some short decimal take a fast path, anything else goes to snprintf()
+int formatNumber(double number, char* out);
+
+// end include guard
+#endif
@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+
+// instructions between two samples of the call stack (and the line on top of it), on average
+// each gap is picked at random between half and one and a half times this, a fixed one could keep
+// landing on the same instruction of a loop whose length divides it
+#define PROFILE_SAMPLE_INTERVAL 1000
+// rows of the function and line tables in the report, the folded stacks file always gets everything
+#define PROFILE_REPORT_ROWS 25
+
+// a line of a function that showed up on top of the stack when sampling
+typedef struct {
+    int line;
+    uint64_t samples;
+} LineProfile;
+
+typedef struct {
+    ObjFunction* function;
+    uint64_t calls;
+    double inclusive;           // seconds from call to return, callees included (an outermost call only, so recursion isn't counted twice)
+    double exclusive;           // seconds in its own code, callees excluded
+    int active;                 // # of its frames on the call stack right now
+    int lineCount;
+    int lineCapacity;
+    LineProfile* lines;         // few enough per function that looking one up is a linear search
+} FunctionProfile;
+
+// timing of a frame on the call stack, the profiler's side of vm->frames
+typedef struct {
+    int function;               // index into functions
+    double start;
+    double callees;             // inclusive time of the calls it has made so far
+} ProfileFrame;
+
+// a sampled call stack, as the functions (indices into functions) from the script down to the top frame
+typedef struct {
+    uint32_t hash;
+    int depth;
+    int* functions;
+    uint64_t samples;
+} StackProfile;
+
+struct Profiler {
+    const char* foldedPath;
+    double startTime;
+    uint64_t opcodes[UINT8_COUNT];      // times each opcode ran
+    int untilSample;                    // instructions left before the next sample
+    uint32_t random;                    // xorshift state for the gaps between samples
+    uint64_t samples;
+
+    // functions in the order they were first called (an index into it stays valid), plus a hash index on top
+    int functionCount;
+    int functionCapacity;
+    FunctionProfile* functions;
+    int functionBucketCount;
+    int* functionBuckets;               // index + 1 of the function hashed there, 0 if empty
+
+    int frameCapacity;
+    ProfileFrame* frames;               // one for every frame on vm->frames, grows along with it
+    int* sampled;                       // as many, where sampleStack() gathers the functions on the stack
+
+    int stackCount;
+    int stackCapacity;
+    StackProfile* stacks;
+    int stackBucketCount;
+    int* stackBuckets;
+};
+
+static int nextSampleGap(Profiler* profiler) {
+    profiler->random ^= profiler->random << 13;
+    profiler->random ^= profiler->random >> 17;
+    profiler->random ^= profiler->random << 5;
+    return PROFILE_SAMPLE_INTERVAL / 2 + (int)(profiler->random % PROFILE_SAMPLE_INTERVAL);
+}
+
+// plain allocations, profiling data is never garbage collected
+static void* growArray(void* array, size_t size, int* capacity) {
+    *capacity = GROW_CAPACITY(*capacity);
+    void* result = realloc(array, size * (size_t)*capacity);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static uint32_t hashPointer(void* pointer) {
+    return (uint32_t)((uintptr_t)pointer >> 4) * 2654435761u;
+}
+
+// hex digits of the pointer make no sense to anybody, the name does
+static const char* functionName(ObjFunction* function) {
+    return function->name == NULL ? "<script>" : function->name->chars;
+}
+
+// an empty open-addressing index with room for capacity entries at a load factor of a half
+static int* newBuckets(int* bucketCount, int capacity) {
+    *bucketCount = 8;
+    while (*bucketCount < capacity * 2) *bucketCount *= 2;
+    int* buckets = (int*)calloc((size_t)*bucketCount, sizeof(int));
+    if (buckets == NULL) exit(1);
+    return buckets;
+}
+
+static void insertBucket(int* buckets, int bucketCount, uint32_t hash, int index) {
+    uint32_t bucket = hash & (bucketCount - 1);
+    while (buckets[bucket] != 0) bucket = (bucket + 1) & (bucketCount - 1);
+    buckets[bucket] = index + 1;
+}
+
+// index of the function's profile, added the first time the function comes up
+static int functionIndex(ObjFunction* function) {
+    Profiler* profiler = vm->profiler;
+    uint32_t hash = hashPointer(function);
+    uint32_t bucket = hash & (profiler->functionBucketCount - 1);
+    for (;;) {
+        int index = profiler->functionBuckets[bucket] - 1;
+        if (index == -1) break;
+        if (profiler->functions[index].function == function) return index;
+        bucket = (bucket + 1) & (profiler->functionBucketCount - 1);
+    }
+
+    if (profiler->functionCount == profiler->functionCapacity) {
+        profiler->functions = growArray(profiler->functions, sizeof(FunctionProfile), &profiler->functionCapacity);
+        free(profiler->functionBuckets);
+        profiler->functionBuckets = newBuckets(&profiler->functionBucketCount, profiler->functionCapacity);
+        for (int i = 0; i < profiler->functionCount; i++) {
+            insertBucket(profiler->functionBuckets, profiler->functionBucketCount, hashPointer(profiler->functions[i].function), i);
+        }
+    }
+
+    int index = profiler->functionCount++;
+    FunctionProfile* profile = &profiler->functions[index];
+    memset(profile, 0, sizeof(FunctionProfile));
+    profile->function = function;
+    insertBucket(profiler->functionBuckets, profiler->functionBucketCount, hash, index);
+    return index;
+}
+
+static void sampleLine(FunctionProfile* profile, int line) {
+    for (int i = 0; i < profile->lineCount; i++) {
+        if (profile->lines[i].line == line) {
+            profile->lines[i].samples++;
+            return;
+        }
+    }
+
+    if (profile->lineCount == profile->lineCapacity) {
+        profile->lines = growArray(profile->lines, sizeof(LineProfile), &profile->lineCapacity);
+    }
+    profile->lines[profile->lineCount].line = line;
+    profile->lines[profile->lineCount].samples = 1;
+    profile->lineCount++;
+}
+
+static void sampleStack() {
+    Profiler* profiler = vm->profiler;
+    int* functions = profiler->sampled;
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < vm->frameCount; i++) {
+        functions[i] = functionIndex(vm->frames[i].closure->function);
+        hash = (hash ^ (uint32_t)functions[i]) * 16777619u;
+    }
+
+    uint32_t bucket = hash & (profiler->stackBucketCount - 1);
+    for (;;) {
+        int index = profiler->stackBuckets[bucket] - 1;
+        if (index == -1) break;
+        StackProfile* stack = &profiler->stacks[index];
+        if (stack->hash == hash && stack->depth == vm->frameCount &&
+            memcmp(stack->functions, functions, sizeof(int) * vm->frameCount) == 0) {
+            stack->samples++;
+            return;
+        }
+        bucket = (bucket + 1) & (profiler->stackBucketCount - 1);
+    }
+
+    if (profiler->stackCount == profiler->stackCapacity) {
+        profiler->stacks = growArray(profiler->stacks, sizeof(StackProfile), &profiler->stackCapacity);
+        free(profiler->stackBuckets);
+        profiler->stackBuckets = newBuckets(&profiler->stackBucketCount, profiler->stackCapacity);
+        for (int i = 0; i < profiler->stackCount; i++) {
+            insertBucket(profiler->stackBuckets, profiler->stackBucketCount, profiler->stacks[i].hash, i);
+        }
+    }
+
+    int index = profiler->stackCount++;
+    StackProfile* stack = &profiler->stacks[index];
+    stack->hash = hash;
+    stack->depth = vm->frameCount;
+    stack->functions = (int*)malloc(sizeof(int) * (vm->frameCount + 1));
+    if (stack->functions == NULL) exit(1);
+    memcpy(stack->functions, functions, sizeof(int) * vm->frameCount);
+    stack->samples = 1;
+    insertBucket(profiler->stackBuckets, profiler->stackBucketCount, hash, index);
+}
+
+void startProfiler(const char* foldedPath) {
+    Profiler* profiler = (Profiler*)calloc(1, sizeof(Profiler));
+    if (profiler == NULL) exit(1);
+    profiler->foldedPath = foldedPath;
+    profiler->startTime = monotonicSeconds();
+    profiler->random = 2463534242u;
+    profiler->untilSample = nextSampleGap(profiler);
+    profiler->functionBuckets = newBuckets(&profiler->functionBucketCount, 0);
+    profiler->stackBuckets = newBuckets(&profiler->stackBucketCount, 0);
+    vm->profiler = profiler;
+}
+
+void profileInstruction(CallFrame* frame, uint8_t* ip) {
+    Profiler* profiler = vm->profiler;
+    profiler->opcodes[*ip]++;
+    if (--profiler->untilSample > 0) return;
+
+    profiler->untilSample = nextSampleGap(profiler);
+    profiler->samples++;
+    Chunk* chunk = &frame->closure->function->chunk;
+    int index = functionIndex(frame->closure->function);      // before taking a pointer, it can grow the array
+    sampleLine(&profiler->functions[index], getLine(chunk, (int)(ip - chunk->code)));
+    sampleStack();
+}
+
+void profileCall(ObjFunction* function) {
+    int index = functionIndex(function);
+    Profiler* profiler = vm->profiler;
+    profiler->functions[index].calls++;
+    profiler->functions[index].active++;
+
+    if (vm->frameCount > profiler->frameCapacity) {
+        int capacity = profiler->frameCapacity;
+        profiler->frames = growArray(profiler->frames, sizeof(ProfileFrame), &profiler->frameCapacity);
+        profiler->sampled = growArray(profiler->sampled, sizeof(int), &capacity);
+    }
+    ProfileFrame* frame = &profiler->frames[vm->frameCount - 1];
+    frame->function = index;
+    frame->start = monotonicSeconds();
+    frame->callees = 0;
+}
+
+// charges the frame at depth's time to its function, and to its caller as time spent in callees
+static void finishFrame(int depth) {
+    Profiler* profiler = vm->profiler;
+    ProfileFrame* frame = &profiler->frames[depth];
+    FunctionProfile* profile = &profiler->functions[frame->function];
+    double elapsed = monotonicSeconds() - frame->start;
+
+    profile->exclusive += elapsed - frame->callees;
+    if (--profile->active == 0) profile->inclusive += elapsed;
+    if (depth > 0) profiler->frames[depth - 1].callees += elapsed;
+}
+
+void profileReturn() {
+    finishFrame(vm->frameCount - 1);
+}
+
+void profileUnwind() {
+    for (int depth = vm->frameCount - 1; depth >= 0; depth--) {
+        finishFrame(depth);
+    }
+}
+
+// a fiber switch unwinds the frames of the one leaving (see saveFiber() in vm.c), its time waiting isn't charged to
+// anything, and the frames of the one coming in start being timed again from here
+void profileResume() {
+    Profiler* profiler = vm->profiler;
+    while (vm->frameCount > profiler->frameCapacity) {
+        int capacity = profiler->frameCapacity;
+        profiler->frames = growArray(profiler->frames, sizeof(ProfileFrame), &profiler->frameCapacity);
+        profiler->sampled = growArray(profiler->sampled, sizeof(int), &capacity);
+    }
+    double start = monotonicSeconds();
+    for (int depth = 0; depth < vm->frameCount; depth++) {
+        ProfileFrame* frame = &profiler->frames[depth];
+        frame->function = functionIndex(vm->frames[depth].closure->function);
+        frame->start = start;
+        frame->callees = 0;
+        profiler->functions[frame->function].active++;
+    }
+}
+
+void markProfilerRoots() {
+    for (int i = 0; i < vm->profiler->functionCount; i++) {
+        markObject((Obj*)vm->profiler->functions[i].function);
+    }
+}
+
+// ----- the report -----
+
+static int compareExclusive(const void* a, const void* b) {
+    const FunctionProfile* left = *(const FunctionProfile* const*)a;
+    const FunctionProfile* right = *(const FunctionProfile* const*)b;
+    return left->exclusive < right->exclusive ? 1 : left->exclusive > right->exclusive ? -1 : 0;
+}
+
+static uint64_t* sortedOpcodes;     // what compareOpcodes() sorts by, qsort() takes no context
+
+static int compareOpcodes(const void* a, const void* b) {
+    uint64_t left = sortedOpcodes[*(const int*)a];
+    uint64_t right = sortedOpcodes[*(const int*)b];
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// a sampled line, with the function it's in, for sorting all of them together
+typedef struct {
+    FunctionProfile* function;
+    LineProfile* line;
+} LineSample;
+
+static int compareLines(const void* a, const void* b) {
+    uint64_t left = ((const LineSample*)a)->line->samples;
+    uint64_t right = ((const LineSample*)b)->line->samples;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static double percent(uint64_t part, uint64_t total) {
+    return total == 0 ? 0 : 100.0 * (double)part / (double)total;
+}
+
+static void printFunctions(Profiler* profiler) {
+    FunctionProfile** sorted = (FunctionProfile**)malloc(sizeof(FunctionProfile*) * (profiler->functionCount + 1));
+    if (sorted == NULL) exit(1);
+    for (int i = 0; i < profiler->functionCount; i++) sorted[i] = &profiler->functions[i];
+    qsort(sorted, profiler->functionCount, sizeof(FunctionProfile*), compareExclusive);
+
+    fprintf(stderr, "\n-- functions, by exclusive time --\n");
+    fprintf(stderr, "%12s %12s %12s  %s\n", "calls", "inclusive", "exclusive", "function");
+    for (int i = 0; i < profiler->functionCount && i < PROFILE_REPORT_ROWS; i++) {
+        fprintf(stderr, "%12llu %11.3fs %11.3fs  %s\n", (unsigned long long)sorted[i]->calls,
+                sorted[i]->inclusive, sorted[i]->exclusive, functionName(sorted[i]->function));
+    }
+    if (profiler->functionCount > PROFILE_REPORT_ROWS) {
+        fprintf(stderr, "%12s (%d more)\n", "...", profiler->functionCount - PROFILE_REPORT_ROWS);
+    }
+    free(sorted);
+}
+
+static void printOpcodes(Profiler* profiler, uint64_t instructions) {
+    int order[UINT8_COUNT];
+    for (int i = 0; i < UINT8_COUNT; i++) order[i] = i;
+    sortedOpcodes = profiler->opcodes;
+    qsort(order, UINT8_COUNT, sizeof(int), compareOpcodes);
+
+    fprintf(stderr, "\n-- opcodes, by count --\n");
+    fprintf(stderr, "%12s %7s  %s\n", "count", "%", "opcode");
+    for (int i = 0; i < UINT8_COUNT && profiler->opcodes[order[i]] > 0; i++) {
+        uint64_t count = profiler->opcodes[order[i]];
+        fprintf(stderr, "%12llu %6.2f%%  %s\n", (unsigned long long)count, percent(count, instructions),
+                opcodeName((uint8_t)order[i]));
+    }
+}
+
+static void printLines(Profiler* profiler) {
+    int count = 0;
+    for (int i = 0; i < profiler->functionCount; i++) count += profiler->functions[i].lineCount;
+
+    LineSample* sorted = (LineSample*)malloc(sizeof(LineSample) * (count + 1));
+    if (sorted == NULL) exit(1);
+    count = 0;
+    for (int i = 0; i < profiler->functionCount; i++) {
+        for (int j = 0; j < profiler->functions[i].lineCount; j++) {
+            sorted[count].function = &profiler->functions[i];
+            sorted[count].line = &profiler->functions[i].lines[j];
+            count++;
+        }
+    }
+    qsort(sorted, count, sizeof(LineSample), compareLines);
+
+    fprintf(stderr, "\n-- lines, by samples (one every %d instructions or so) --\n", PROFILE_SAMPLE_INTERVAL);
+    fprintf(stderr, "%12s %7s %7s  %s\n", "samples", "%", "line", "function");
+    for (int i = 0; i < count && i < PROFILE_REPORT_ROWS; i++) {
+        fprintf(stderr, "%12llu %6.2f%% %7d  %s\n", (unsigned long long)sorted[i].line->samples,
+                percent(sorted[i].line->samples, profiler->samples), sorted[i].line->line,
+                functionName(sorted[i].function->function));
+    }
+    free(sorted);
+}
+
+// one line per sampled stack, "<script>;outer;inner 42", what flamegraph.pl and similar tools read
+static void writeFoldedStacks(Profiler* profiler) {
+    FILE* file = fopen(profiler->foldedPath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile to \"%s\".\n", profiler->foldedPath);
+        return;
+    }
+
+    for (int i = 0; i < profiler->stackCount; i++) {
+        StackProfile* stack = &profiler->stacks[i];
+        for (int j = 0; j < stack->depth; j++) {
+            fprintf(file, "%s%s", j == 0 ? "" : ";", functionName(profiler->functions[stack->functions[j]].function));
+        }
+        fprintf(file, " %llu\n", (unsigned long long)stack->samples);
+    }
+    fclose(file);
+    fprintf(stderr, "\nfolded stacks written to %s\n", profiler->foldedPath);
+}
+
+void stopProfiler() {
+    Profiler* profiler = vm->profiler;
+    if (profiler == NULL) return;
+
+    uint64_t instructions = 0;
+    for (int i = 0; i < UINT8_COUNT; i++) instructions += profiler->opcodes[i];
+
+    fprintf(stderr, "\n== profile ==\n");
+    fprintf(stderr, "%.3f seconds, %llu instructions, %llu samples\n", monotonicSeconds() - profiler->startTime,
+            (unsigned long long)instructions, (unsigned long long)profiler->samples);
+    printFunctions(profiler);
+    printOpcodes(profiler, instructions);
+    printLines(profiler);
+    writeFoldedStacks(profiler);
+
+    for (int i = 0; i < profiler->functionCount; i++) free(profiler->functions[i].lines);
+    for (int i = 0; i < profiler->stackCount; i++) free(profiler->stacks[i].functions);
+    free(profiler->functions);
+    free(profiler->functionBuckets);
+    free(profiler->stacks);
+    free(profiler->stackBuckets);
+    free(profiler->frames);
+    free(profiler->sampled);
+    free(profiler);
+    vm->profiler = NULL;
+}
@@ -0,0 +1,22 @@
+// include guard
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "vm.h"
+
+// opt-in runtime profiler (clox --profile), while vm->profiler is NULL none of these get called
+// counts every instruction by opcode, times every call of a Lox function (inclusive and exclusive of its callees)
+// and every PROFILE_SAMPLE_INTERVAL instructions samples the call stack and the line running on top of it
+typedef struct Profiler Profiler;
+
+void startProfiler(const char* foldedPath);     // folded stacks (for flame graph tools) get written to foldedPath at the end
+void profileInstruction(CallFrame* frame, uint8_t* ip);     // right before the instruction at ip runs
+void profileCall(ObjFunction* function);        // once call() has pushed the function's frame
+void profileReturn();                           // before OP_RETURN pops the top frame
+void profileUnwind();                           // a runtime error is about to throw every frame away (or a fiber switch to put them aside)
+void profileResume();                           // a fiber switched to has its frames back
+void markProfilerRoots();                       // the report still needs the names of functions that have died since
+void stopProfiler();                            // prints the report to stderr, writes the folded stacks and frees it all
+
+// end include guard
+#endif
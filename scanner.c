@@ -10,13 +10,14 @@ typedef struct {
     int line;                   // track current line #
 } Scanner;
 
-Scanner scanner;                
+THREAD_LOCAL Scanner scanner;           // one per thread, like the compiler's state
 
-// Initializes scanner, feed a reference to source code into it
-void initScanner(const char* source) {
+// Initializes scanner, feed a reference to source code into it (and the line that starts on, 1 unless it's a function body
+// compiled on its own)
+void initScanner(const char* source, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 //  Returns true if c is a letter (a-z, A-Z, or _)
@@ -156,7 +157,7 @@ static TokenType identifierType() {
             if (scanner.current - scanner.start > 1) {
                 switch (scanner.start[1]) {
                     case 'u':
-                        return checkKeyword(2, 2, "per", TOKEN_SUPER);
+                        return checkKeyword(2, 3, "per", TOKEN_SUPER);
                     case 'w':
                         return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
                 }
@@ -228,6 +229,8 @@ Token scanToken() {
         case ')': return makeToken(TOKEN_RIGHT_PAREN);
         case '{': return makeToken(TOKEN_LEFT_BRACE);
         case '}': return makeToken(TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(TOKEN_RIGHT_BRACKET);
         case ';': return makeToken(TOKEN_SEMICOLON);
         case ':': return makeToken(TOKEN_COLON);
         case '?': return makeToken(TOKEN_QUESTION);
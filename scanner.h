@@ -6,6 +6,7 @@ typedef enum {
     // Single-character tokens.
     TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN, TOKEN_QUESTION,
     TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE, TOKEN_COLON,
+    TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
     TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR, TOKEN_PERCENT,
     // One or two character tokens.
@@ -32,7 +33,7 @@ typedef struct {
 } Token;
 
 // Scanner functions
-void initScanner(const char* source);   
+void initScanner(const char* source, int line);   
 Token scanToken();                      
 
 // End include guard
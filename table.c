@@ -6,159 +6,275 @@
 #include "table.h"
 #include "value.h"
 
-// hash-table's load factor
-#define TABLE_MAX_LOAD 0.75
+// control bytes get compared a whole group at a time with SSE2 (every x86-64) or NEON (every AArch64)
+// anything else, or a build with -DTABLE_NO_SIMD, goes through the scalar loops below (which compilers often vectorize anyway)
+#if !defined(TABLE_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define TABLE_SSE2
+#elif !defined(TABLE_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define TABLE_NEON
+#endif
+
+// hash-table's load factor (tombstones included), a group scan makes long probe sequences cheap enough to fill 7/8 of it
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// control bytes: a full slot holds the low 7 bits of its key's hash (so the high bit is clear), these two have it set
+#define CONTROL_EMPTY   0x80
+#define CONTROL_DELETED 0xFE
+
+#define H2(hash) ((uint8_t)((hash) & 0x7F))             // the hash bits stored in a full slot's control byte
+#define H1(hash) ((hash) >> 7)                          // the rest picks the group the probe sequence starts at
+#define IS_FULL(control) ((control) < 0x80)
+
+// bit i is set when slot i of the group matches
+typedef uint32_t GroupMatch;
+
+#if defined(TABLE_SSE2)
+
+static inline GroupMatch matchByte(const uint8_t* group, uint8_t byte) {
+    __m128i controls = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMatch)_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte)));
+}
+
+// empty or deleted slots are exactly the ones with the high bit set, which is what movemask collects
+static inline GroupMatch matchFree(const uint8_t* group) {
+    return (GroupMatch)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+
+#elif defined(TABLE_NEON)
+
+// NEON has no movemask: keep one distinct bit per lane of the comparison and add up each half
+static inline GroupMatch neonMask(uint8x16_t lanes) {
+    static const uint8_t bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t masked = vandq_u8(lanes, vld1q_u8(bits));
+    return (GroupMatch)vaddv_u8(vget_low_u8(masked)) | ((GroupMatch)vaddv_u8(vget_high_u8(masked)) << 8);
+}
+
+static inline GroupMatch matchByte(const uint8_t* group, uint8_t byte) {
+    return neonMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMatch matchFree(const uint8_t* group) {
+    return neonMask(vcltq_s8(vreinterpretq_s8_u8(vld1q_u8(group)), vdupq_n_s8(0)));
+}
+
+#else
+
+static inline GroupMatch matchByte(const uint8_t* group, uint8_t byte) {
+    GroupMatch match = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        match |= (GroupMatch)(group[i] == byte) << i;
+    }
+    return match;
+}
+
+static inline GroupMatch matchFree(const uint8_t* group) {
+    GroupMatch match = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        match |= (GroupMatch)(group[i] >> 7) << i;
+    }
+    return match;
+}
+
+#endif
+
+static inline GroupMatch matchEmpty(const uint8_t* group) {
+    return matchByte(group, CONTROL_EMPTY);
+}
+
+// index of the lowest set bit (match is never 0)
+static inline int lowestMatch(GroupMatch match) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(match);
+#else
+    int i = 0;
+    while (!(match & 1)) {
+        match >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+
+// entries and control bytes share one allocation of this many bytes
+static size_t tableBytes(int capacity) {
+    return (size_t)capacity * (sizeof(Entry) + 1);
+}
 
 // a hash table initially starts with no entries (0 capacity and a NULL array)
 void initTable(Table* table) {
-  table->count = 0;
-  table->capacity = 0;
-  table->entries = NULL;
+    table->count = 0;
+    table->deleted = 0;
+    table->capacity = 0;
+    table->control = NULL;
+    table->entries = NULL;
 }
 
 // for freeing hash table (remember we are implementing it as a dynamic array)
 void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(char, (char*)table->entries, tableBytes(table->capacity));
     initTable(table);
 }
 
-// takes key and the array of buckets, and figures out which bucket entry is in
-// will be used to look up existing entries in the hash table and to decide where to insert new ones 
+// probe sequence: groups are visited in triangular steps from the one the hash picks (g, g+1, g+3, g+6, ...),
+// which reaches every group since their number is a power of two
+// a key always lives in the first group along its sequence that had a free slot when it went in, so a lookup can stop
+// at the first group with an empty slot (a deleted one doesn't stop it, something may have gone in past it before the delete)
 // optimization: bitmasking calculation for index instead of using modulus operator (% is really slow executing)
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
-
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                // We found a tombstone.
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            // We found the key.
-            return entry;
+
+// the slot holding key, or -1 if it isn't in the table
+static int findSlot(Table* table, ObjString* key) {
+    uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = H1(key->hash) & groupMask;
+    uint8_t h2 = H2(key->hash);
+
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* controls = table->control + group * TABLE_GROUP_WIDTH;
+        for (GroupMatch match = matchByte(controls, h2); match != 0; match &= match - 1) {
+            int slot = (int)(group * TABLE_GROUP_WIDTH) + lowestMatch(match);
+            if (table->entries[slot].key == key) return slot;
         }
+        if (matchEmpty(controls) != 0) return -1;
+        group = (group + step) & groupMask;
+    }
+}
 
-        index = (index + 1) & (capacity - 1);
+// the first empty or deleted slot along the probe sequence of hash, where a key that isn't in the table yet goes
+// (there always is one, the load factor keeps at least capacity / 8 slots empty)
+static int findFreeSlot(uint8_t* control, int capacity, uint32_t hash) {
+    uint32_t groupMask = (uint32_t)(capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = H1(hash) & groupMask;
+
+    for (uint32_t step = 1;; step++) {
+        GroupMatch match = matchFree(control + group * TABLE_GROUP_WIDTH);
+        if (match != 0) return (int)(group * TABLE_GROUP_WIDTH) + lowestMatch(match);
+        group = (group + step) & groupMask;
     }
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
     if (table->count == 0) return false;                                    // If the table is empty, return false.
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);         // Locate the entry for the key.
-    if (entry->key == NULL) return false;                                   // If the key is not found, return false.
+    int slot = findSlot(table, key);                                        // Locate the entry for the key.
+    if (slot < 0) return false;                                             // If the key is not found, return false.
 
-    *value = entry->value;                                                  // If the key is found, store the value in the provided pointer.
+    *value = table->entries[slot].value;                                    // If the key is found, store the value in the provided pointer.
     return true;                                                            // Indicate success.
 }
 
-// creates a bucket array with "capacity" entries
-// initializes every bucket to be empty and stores array in hash-table main struct
-// to resize bucket array, allocate new array and re-insert all non-empty buckets into it
+// allocates "capacity" slots (all empty) and re-inserts every full slot of the old ones, which also drops the tombstones
+// (so the capacity may stay the same when it's mostly tombstones that filled the table)
 static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    Entry* entries = (Entry*)ALLOCATE(char, tableBytes(capacity));
+    uint8_t* control = (uint8_t*)(entries + capacity);
+    memset(control, CONTROL_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (!IS_FULL(table->control[i])) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry* entry = &table->entries[i];
+        int slot = findFreeSlot(control, capacity, entry->key->hash);
+        control[slot] = table->control[i];
+        entries[slot] = *entry;
     }
-  
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+
+    FREE_ARRAY(char, (char*)table->entries, tableBytes(table->capacity));
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
+    table->deleted = 0;
 }
 
 // adds the given key/value pair to the given hash table, allocate entry array if haven't already
-// we grow array when its 75% full (0.75 load factor)
+// grows once live entries and tombstones would fill more than TABLE_MAX_LOAD, returns whether the key is new
 bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if (table->count > 0) {
+        int slot = findSlot(table, key);
+        if (slot >= 0) {
+            table->entries[slot].value = value;
+            return false;
+        }
+    }
+
+    if (table->count + table->deleted + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        // only grow if live entries alone would take more than half of it, otherwise clearing the tombstones is enough
+        int capacity = table->capacity;
+        if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2) capacity = capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : capacity * 2;
         adjustCapacity(table, capacity);
     }
-    
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
-  
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+
+    int slot = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[slot] == CONTROL_DELETED) table->deleted--;
+    table->control[slot] = H2(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    table->count++;
+    return true;
+}
+
+// a slot can go straight back to empty when its group still has an empty slot: no probe sequence has gone past that group
+static void deleteSlot(Table* table, int slot) {
+    const uint8_t* group = table->control + (slot & ~(TABLE_GROUP_WIDTH - 1));
+    if (matchEmpty(group) != 0) {
+        table->control[slot] = CONTROL_EMPTY;
+    } else {
+        table->control[slot] = CONTROL_DELETED;             // Place a tombstone in the entry.
+        table->deleted++;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    table->count--;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
     if (table->count == 0) return false;
-  
+
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-  
-    // Place a tombstone in the entry.
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    int slot = findSlot(table, key);
+    if (slot < 0) return false;
+
+    deleteSlot(table, slot);
     return true;
 }
 
 // walks through bucket array, adds entry to destination hash-table whenever finding non-empty bucket
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (IS_FULL(from->control[i])) {
+            tableSet(to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
 
 // Instead of creating a new ObjString for every string, we check if an identical string already exists in the hash table
 // If it does, we reuse the existing ObjString to save memory and avoid duplicate strings
-// optimization: bitmasking calculation for index instead of using modulus operator (% is really slow executing)
+// same probe sequence as findSlot(), the control bytes weed out almost every other string before their hash, length
+// and characters get compared
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash & (table->capacity - 1);
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if an empty non-tombstone entry is found
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && entry->key->hash == hash && memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
-        }
-
-        index = (index + 1) & (table->capacity - 1);
-    }
-}
+    uint32_t groupMask = (uint32_t)(table->capacity / TABLE_GROUP_WIDTH) - 1;
+    uint32_t group = H1(hash) & groupMask;
+    uint8_t h2 = H2(hash);
 
-// during sweep phase of GC, this deletes any table entries whose keys are no longer marked (unreachable)
-void tableRemoveWhite(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
-            tableDelete(table, entry->key);
+    for (uint32_t step = 1;; step++) {
+        const uint8_t* controls = table->control + group * TABLE_GROUP_WIDTH;
+        for (GroupMatch match = matchByte(controls, h2); match != 0; match &= match - 1) {
+            ObjString* key = table->entries[group * TABLE_GROUP_WIDTH + lowestMatch(match)].key;
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0) return key;
         }
+        if (matchEmpty(controls) != 0) return NULL;         // Stop at a group with an empty slot
+        group = (group + step) & groupMask;
     }
 }
 
-// walks the table array and ensures that all string keys and associated values are marked 
+// walks the table array and ensures that all string keys and associated values are marked
 void markTable(Table* table) {
     for (int i = 0; i < table->capacity; i++) {
+        if (!IS_FULL(table->control[i])) continue;
         Entry* entry = &table->entries[i];
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
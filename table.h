@@ -11,13 +11,21 @@ typedef struct {
     Value value;
 } Entry;
 
-// hash table struct (one big array with buckets to store key/value pairs, kind of like bucket sort in a way)
+// hash table struct, laid out like a "Swiss table": next to the entries there's one control byte per slot saying whether
+// it's empty, deleted or full, and for a full one, 7 bits of its key's hash
+// a lookup checks the control bytes of TABLE_GROUP_WIDTH slots at once (with SSE2 or NEON where available) and only
+// looks at the entries whose byte matches, so it rarely touches a key that isn't the one it's after
 typedef struct {
-  int count;                        // keeps track of # of key/value pairs currently stored in array
-  int capacity;                     // keeps track of the allocated size of the array 
+  int count;                        // # of key/value pairs currently stored
+  int deleted;                      // # of slots holding a tombstone (they count against the load factor until the next resize)
+  int capacity;                     // # of slots, 0 or a power of two that's at least TABLE_GROUP_WIDTH
+  uint8_t* control;                 // control byte of each slot (stored in the same allocation, right after the entries)
   Entry* entries;
 } Table;
 
+// slots probed together (the control bytes of a group fit one 128-bit vector)
+#define TABLE_GROUP_WIDTH 16
+
 // hashtable-specific func declarations
 void initTable(Table* table);
 void freeTable(Table* table);
@@ -26,7 +34,6 @@ bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
-void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
 
@@ -3,6 +3,7 @@
 
 #include "object.h"
 #include "memory.h"
+#include "output.h"
 #include "value.h"
 
 // initially array is empty
@@ -38,41 +39,45 @@ void freeValueArray(ValueArray* array) {
 void printValue(Value value) {
   #ifdef NAN_BOXING
   	if (IS_BOOL(value)) {
-    	printf(AS_BOOL(value) ? "true" : "false");
+    	if (AS_BOOL(value)) writeOutput("true", 4);
+    	else writeOutput("false", 5);
   	} else if (IS_NIL(value)) {
-    	printf("nil");
+    	writeOutput("nil", 3);
   	} else if (IS_NUMBER(value)) {
-    	printf("%g", AS_NUMBER(value));
+    	writeNumber(AS_NUMBER(value));
   	} else if (IS_OBJ(value)) {
     	printObject(value);
   	}
   #else
 	switch (value.type) {
 		case VAL_BOOL:
-		  	printf(AS_BOOL(value) ? "true" : "false");
+		  	if (AS_BOOL(value)) writeOutput("true", 4);
+		  	else writeOutput("false", 5);
 		  	break;
-		case VAL_NIL: printf("nil"); break;
-		case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+		case VAL_NIL: writeOutput("nil", 3); break;
+		case VAL_NUMBER: writeNumber(AS_NUMBER(value)); break;
 		case VAL_OBJ: printObject(value); break;
+		case VAL_UNDEFINED: break;
 	}
   #endif
 }
 
 // to make sure two values (according to type with switch) are equal
 // NaN Boxing/Tagging optimization added
+// a rope has to be compared by its characters, which can flatten it (and allocate), so both values must be reachable
 bool valuesEqual(Value a, Value b) {
   #ifdef NAN_BOXING
   	if (IS_NUMBER(a) && IS_NUMBER(b)) {
     	return AS_NUMBER(a) == AS_NUMBER(b);
   	}
-  	return a == b;
+  	return a == b || (IS_OBJ(a) && IS_OBJ(b) && stringsEqual(a, b));
   #else
 	if (a.type != b.type) return false;
 	switch (a.type) {
 	  	case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
 	  	case VAL_NIL:    return true;
 	  	case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-		case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+		case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
 	  	default:         return false; // Unreachable.
 	}
 	#endif
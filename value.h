@@ -11,6 +11,9 @@
 typedef struct Obj Obj;
 // separate struct for string obj
 typedef struct ObjString ObjString;
+// classes and shapes are referenced by the inline caches in chunks, which object.h (where they are defined) depends on
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
 
 // to maintain support for both the old tagged union implementation of Value and the new NaN-boxed form
 // If NaN_BOXING is defined, the VM uses the new form. Otherwise, it reverts to the old style
@@ -23,17 +26,30 @@ typedef struct ObjString ObjString;
 #define TAG_NIL   1 // 01.
 #define TAG_FALSE 2 // 10.
 #define TAG_TRUE  3 // 11.
+// not a real Lox value: marks a global slot the compiler handed out whose variable has not been defined yet
+#define TAG_UNDEFINED 4 // 100.
+// a whole number that fits in 32 bits can be boxed as an int instead: this bit (just below the QNAN bits, none of the
+// tags above use it) with the int in the low 32 bits, so integer arithmetic, comparisons and indexing skip floating point
+// it's the same Lox number either way, IS_NUMBER()/AS_NUMBER() take both and nothing a program does can tell them apart
+// (-0 is never an int)
+#define INT_BIT ((uint64_t)0x0002000000000000)
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value)      (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value)       ((value) == NIL_VAL)
-#define IS_NUMBER(value)    (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value)    (((value) & QNAN) != QNAN)
+#define IS_INT(value)       (((value) & (SIGN_BIT | QNAN | INT_BIT)) == (QNAN | INT_BIT))
+#define IS_NUMBER(value)    (IS_DOUBLE(value) || IS_INT(value))
+// both ints, in one test: only values that are ints have all of QNAN | INT_BIT set (a pointer never reaches bit 49)
+#define ARE_INTS(a, b)      IS_INT((a) & (b))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value)      ((value) == TRUE_VAL)
 #define AS_NUMBER(value)    valueToNum(value)
+#define AS_INT(value)       ((int32_t)(uint32_t)(value))
 // the tilda (~) is bitwise NOT operation
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -42,11 +58,14 @@ typedef uint64_t Value;
 #define FALSE_VAL       ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL        ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL         ((Value)(uint64_t)(QNAN | TAG_NIL))
-#define NUMBER_VAL(num) numToValue(num)
+#define UNDEFINED_VAL   ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)                         // always a double, see numberValue()
+#define INT_VAL(i)      ((Value)(QNAN | INT_BIT | (uint64_t)(uint32_t)(int32_t)(i)))
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline double valueToNum(Value value) {
+    if (IS_INT(value)) return (double)AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
@@ -64,7 +83,8 @@ typedef enum {
     VAL_BOOL,               // boolean datatype
     VAL_NIL,                // Clox's NULL datatype
     VAL_NUMBER,             // Could either be an int or decimal(double in C), maybe separating the 2 in future 
-    VAL_OBJ                 // Refers to all heap-allocated types (strings, instances, functions, etc.)
+    VAL_OBJ,                // Refers to all heap-allocated types (strings, instances, functions, etc.)
+    VAL_UNDEFINED           // internal marker for a global slot whose variable has not been defined yet (never seen by Lox code)
 } ValueType;
 
 // Struct wastes memory since a value can’t simultaneously be both a number and a boolean, so optimize by using union instead
@@ -88,20 +108,46 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 // given a Value of the right type, these macros unwrap it and return the corresponding raw C value
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
 
+// there are no ints without NaN boxing, INT_VAL() makes a double and the integer fast paths compile away
+#define IS_INT(value)     false
+#define ARE_INTS(a, b)    false
+#define AS_INT(value)     ((int32_t)AS_NUMBER(value))
+#define INT_VAL(i)        NUMBER_VAL((double)(i))
+
 // return true if the Value has that type
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
 
 #endif
 
+// the result of integer arithmetic on two ints (which can't overflow an int64_t), an int again if it still fits
+static inline Value intValue(int64_t number) {
+    if (LIKELY(number >= INT32_MIN && number <= INT32_MAX)) return INT_VAL(number);
+    return NUMBER_VAL((double)number);
+}
+
+// a number as an int if it's a whole one that fits (and not -0), as a double otherwise
+// for numbers that are likely to be counted, indexed or compared with: literals and what the compiler folds
+static inline Value numberValue(double number) {
+  #ifdef NAN_BOXING
+    if (number >= INT32_MIN && number <= INT32_MAX) {
+        int32_t integer = (int32_t)number;
+        if (integer == number && (integer != 0 || NUMBER_VAL(number) == 0)) return INT_VAL(integer);
+    }
+  #endif
+    return NUMBER_VAL(number);
+}
+
 typedef struct {
     int capacity;  // Max number of values the array can hold
     int count;     // Current number of values stored
@@ -1,19 +1,27 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <stdlib.h>
+#include <math.h>
 
+#include "buffer.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
+#include "loop.h"
+#include "loxc.h"
+#include "profiler.h"
 #include "object.h"
 #include "memory.h"
+#include "output.h"
 #include "vm.h"
 #include "memory.h"
 
-// global instance makes it easier to manage, not necessarily the best implementation when compared to a VM pointer
-VM vm; 
+// the calling thread's VM, a pointer the entry points set instead of one global instance, so each thread can run its own
+THREAD_LOCAL VM* vm = NULL;
 
 // native clock function using time header returning time started since program started (in seconds)
 static Value clockNative(int argCount, Value* args) {
@@ -24,37 +32,52 @@ static Value clockNative(int argCount, Value* args) {
 static Value deleteFieldNative(int argCount, Value* args) {
     if (argCount != 2) return NIL_VAL;
     if (!IS_INSTANCE(args[0])) return NIL_VAL;
-    if (!IS_STRING(args[1])) return NIL_VAL;
+    if (!IS_ANY_STRING(args[1])) return NIL_VAL;
   
     ObjInstance* instance = AS_INSTANCE(args[0]);
-    tableDelete(&instance->fields, AS_STRING(args[1]));
+    instanceDeleteField(instance, flatString(args[1]));
     return NIL_VAL;
 }
 
-// to reset/initialize vm's value stack
+static void abandonFibers();
+static void defineFiberNatives();
+static void closeUpvalues(Value* last);
+
+// to reset/initialize vm's value stack (the main fiber's, every other one that was running or waiting is abandoned)
 static void resetStack() {
-    vm.stackCount = 0;
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
-    if (vm.stack == NULL) { 
-        vm.stackCapacity = 8; // Initial capacity of VM Stack
-        vm.stack = (Value*)malloc(vm.stackCapacity * sizeof(Value));
+    if (vm->rootFiber != NULL) abandonFibers();
+    if (vm->profiler != NULL) profileUnwind();
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        vm->openUpvalueAt[upvalue->location - vm->stack] = NULL;
     }
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
+// frames of a stack trace shown from the top of the call stack, and from the bottom
+#define TRACE_INNER 32
+#define TRACE_OUTER 8
+
 // prints out stack trace and where error occured if any, useful in debugging
 static void runtimeError(const char* format, ...) {
+    flushOutput();                  // what the program printed before the error comes first
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
   
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
+    // a deep recursion would print a line for every frame, past TRACE_INNER + TRACE_OUTER the middle is left out
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        if (vm->frameCount > TRACE_INNER + TRACE_OUTER && i == vm->frameCount - 1 - TRACE_INNER) {
+            fprintf(stderr, "[... %d more calls]\n", i - TRACE_OUTER + 1);
+            i = TRACE_OUTER - 1;
+        }
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         } else {
@@ -64,87 +87,468 @@ static void runtimeError(const char* format, ...) {
     resetStack();
 }
 
+// methods of the built-in list type, args[0] is the list itself (the receiver) and its arguments follow it
+// each one writes what the call returns into result, or reports a runtime error and returns false
+typedef bool (*ListMethodFn)(ObjList* list, Value* args, Value* result);
+
+typedef struct {
+    const char* name;
+    int arity;
+    ListMethodFn function;
+} ListMethod;
+
+// adds its argument at the end, the list may be old while the value is young
+static bool listAppend(ObjList* list, Value* args, Value* result) {
+    writeValueArray(&list->items, args[1]);
+    writeBarrierValue((Obj*)list, args[1]);
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool listLength(ObjList* list, Value* args, Value* result) {
+    *result = INT_VAL(list->items.count);
+    return true;
+}
+
+// removes the last element and returns it
+static bool listPop(ObjList* list, Value* args, Value* result) {
+    if (list->items.count == 0) {
+        runtimeError("Can't pop from an empty list.");
+        return false;
+    }
+    *result = list->items.values[--list->items.count];
+    return true;
+}
+
+static const ListMethod listMethods[] = {
+    {"append", 1, listAppend},
+    {"len",    0, listLength},
+    {"pop",    0, listPop},
+};
+
+// numeric buffers (see ObjBuffer), with the heavy lifting in buffer.c
+// a native that fails reports it with runtimeError() and returns UNDEFINED_VAL, which callValue() passes on as a runtime error
+
+// checks a buffer native's arguments, signature has a letter for each one: 'b' for a buffer, 'n' for a number
+// buffers passed together have to be the same length
+static bool checkBufferArgs(const char* name, int argCount, Value* args, const char* signature) {
+    int arity = (int)strlen(signature);
+    if (argCount != arity) {
+        runtimeError("Expected %d arguments but got %d.", arity, argCount);
+        return false;
+    }
+
+    ObjBuffer* first = NULL;
+    for (int i = 0; i < arity; i++) {
+        if (signature[i] == 'n') {
+            if (!IS_NUMBER(args[i])) {
+                runtimeError("Argument %d of %s() must be a number.", i + 1, name);
+                return false;
+            }
+            continue;
+        }
+
+        if (!IS_BUFFER(args[i])) {
+            runtimeError("Argument %d of %s() must be a buffer.", i + 1, name);
+            return false;
+        }
+        if (first == NULL) {
+            first = AS_BUFFER(args[i]);
+        } else if (AS_BUFFER(args[i])->length != first->length) {
+            runtimeError("Buffers passed to %s() must have the same length.", name);
+            return false;
+        }
+    }
+    return true;
+}
+
+// buffer(length) makes a buffer of that many zeros, buffer(list) one holding the numbers in the list
+static Value bufferNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 arguments but got %d.", argCount);
+        return UNDEFINED_VAL;
+    }
+
+    if (IS_NUMBER(args[0])) {
+        double length = AS_NUMBER(args[0]);
+        if (!(length >= 0 && length <= INT_MAX) || length != (int)length) {
+            runtimeError("Buffer length must be a non-negative integer.");
+            return UNDEFINED_VAL;
+        }
+        return OBJ_VAL(newBuffer((int)length));
+    }
+
+    if (!IS_LIST(args[0])) {
+        runtimeError("Argument 1 of buffer() must be a length or a list of numbers.");
+        return UNDEFINED_VAL;
+    }
+    ValueArray* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->count; i++) {
+        if (!IS_NUMBER(items->values[i])) {
+            runtimeError("Buffer elements must be numbers.");
+            return UNDEFINED_VAL;
+        }
+    }
+    ObjBuffer* buffer = newBuffer(items->count);       // the list is still an argument on the stack if this collects
+    for (int i = 0; i < items->count; i++) {
+        buffer->values[i] = AS_NUMBER(items->values[i]);
+    }
+    return OBJ_VAL(buffer);
+}
+
+static Value bufferLengthNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferLength", argCount, args, "b")) return UNDEFINED_VAL;
+    return INT_VAL(AS_BUFFER(args[0])->length);
+}
+
+static Value bufferSumNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferSum", argCount, args, "b")) return UNDEFINED_VAL;
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    return NUMBER_VAL(bufferSum(buffer->values, buffer->length));
+}
+
+static Value bufferDotNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferDot", argCount, args, "bb")) return UNDEFINED_VAL;
+    ObjBuffer* a = AS_BUFFER(args[0]);
+    return NUMBER_VAL(bufferDot(a->values, AS_BUFFER(args[1])->values, a->length));
+}
+
+static Value bufferMinNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferMin", argCount, args, "b")) return UNDEFINED_VAL;
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    if (buffer->length == 0) {
+        runtimeError("Can't take the minimum of an empty buffer.");
+        return UNDEFINED_VAL;
+    }
+    return NUMBER_VAL(bufferMin(buffer->values, buffer->length));
+}
+
+static Value bufferMaxNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferMax", argCount, args, "b")) return UNDEFINED_VAL;
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    if (buffer->length == 0) {
+        runtimeError("Can't take the maximum of an empty buffer.");
+        return UNDEFINED_VAL;
+    }
+    return NUMBER_VAL(bufferMax(buffer->values, buffer->length));
+}
+
+// the elementwise ones work in place on their first argument and return it
+static Value bufferScaleNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferScale", argCount, args, "bn")) return UNDEFINED_VAL;
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    bufferScale(buffer->values, buffer->length, AS_NUMBER(args[1]));
+    return args[0];
+}
+
+static Value bufferAddNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferAdd", argCount, args, "bb")) return UNDEFINED_VAL;
+    ObjBuffer* to = AS_BUFFER(args[0]);
+    bufferAdd(to->values, AS_BUFFER(args[1])->values, to->length);
+    return args[0];
+}
+
+static Value bufferMulNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferMul", argCount, args, "bb")) return UNDEFINED_VAL;
+    ObjBuffer* to = AS_BUFFER(args[0]);
+    bufferMul(to->values, AS_BUFFER(args[1])->values, to->length);
+    return args[0];
+}
+
+static Value bufferFillNative(int argCount, Value* args) {
+    if (!checkBufferArgs("bufferFill", argCount, args, "bn")) return UNDEFINED_VAL;
+    ObjBuffer* buffer = AS_BUFFER(args[0]);
+    bufferFill(buffer->values, buffer->length, AS_NUMBER(args[1]));
+    return args[0];
+}
+
+// sets a field of the instance just below value on the stack, value is kept there too while the name gets allocated
+static void setStatsField(const char* name, Value value) {
+    push(value);
+    ObjString* key = copyString(name, (int)strlen(name));
+    push(OBJ_VAL(key));
+    instanceSetField(AS_INSTANCE(vm->stackTop[-3]), key, vm->stackTop[-2]);
+    pop();
+    pop();
+}
+
+static void setCountField(const char* name, double count) {
+    setStatsField(name, numberValue(count));
+}
+
+// a list of count numbers, pushed on the stack
+static void pushNumberList(const double* numbers, int count) {
+    ObjList* list = newList();
+    push(OBJ_VAL(list));
+    for (int i = 0; i < count; i++) writeValueArray(&list->items, numberValue(numbers[i]));
+}
+
+// an instance of class name to fill in with setStatsField(), pushed on the stack
+static void pushStatsInstance(const char* name) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    ObjClass* klass = newClass(AS_STRING(vm->stackTop[-1]));
+    vm->stackTop[-1] = OBJ_VAL(klass);
+    ObjInstance* instance = newInstance(klass);
+    vm->stackTop[-1] = OBJ_VAL(instance);
+}
+
+// gcStats(): what readGCStats() tells an embedder, as a GCStats instance (taken before any of it is allocated)
+// pauseBuckets is a list of GC_PAUSE_BUCKETS counts, nextGCHistory the last GC_HISTORY thresholds oldest first,
+// and objects has a field per ObjType with its live objects and bytes and how many were ever allocated
+static Value gcStatsNative(int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError("Expected 0 arguments but got %d.", argCount);
+        return UNDEFINED_VAL;
+    }
+    GCStats stats;
+    readGCStats(vm, &stats);
+
+    pushStatsInstance("GCStats");
+    setCountField("bytesAllocated", (double)stats.bytesAllocated);
+    setCountField("bytesFreed", (double)stats.bytesFreed);
+    setCountField("heapBytes", (double)stats.heapBytes);
+    setCountField("nextGC", (double)stats.nextGC);
+    setCountField("heapGrowFactor", stats.heapGrowFactor);
+    setCountField("minorCollections", stats.minorCollections);
+    setCountField("fullCollections", stats.fullCollections);
+    setCountField("pauses", stats.pauses);
+    setCountField("pauseTotalMs", stats.pauseTotal * 1000);
+    setCountField("pauseMaxMs", stats.pauseMax * 1000);
+    setCountField("strings", stats.strings);
+    setCountField("stringCapacity", stats.stringCapacity);
+
+    double numbers[GC_PAUSE_BUCKETS > GC_HISTORY ? GC_PAUSE_BUCKETS : GC_HISTORY];
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) numbers[i] = stats.pauseBuckets[i];
+    pushNumberList(numbers, GC_PAUSE_BUCKETS);
+    setStatsField("pauseBuckets", pop());
+    int first = stats.fullCollections > GC_HISTORY ? stats.fullCollections - GC_HISTORY : 0;
+    for (int i = first; i < stats.fullCollections; i++) numbers[i - first] = (double)stats.nextGCHistory[i % GC_HISTORY];
+    pushNumberList(numbers, stats.fullCollections - first);
+    setStatsField("nextGCHistory", pop());
+
+    pushStatsInstance("GCObjects");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++) {
+        GCTypeStats* counts = &stats.types[type];
+        pushStatsInstance("GCTypeStats");
+        setCountField("live", (double)(counts->allocated - counts->freed));
+        setCountField("liveBytes", (double)(counts->bytesAllocated - counts->bytesFreed));
+        setCountField("allocated", (double)counts->allocated);
+        setCountField("bytesAllocated", (double)counts->bytesAllocated);
+        setStatsField(objTypeNames[type], pop());
+    }
+    setStatsField("objects", pop());
+    return pop();
+}
+
+// globals live in a dense array instead of a hash table, the compiler turns every global name into an index into it
+// slots are never given back, so a name keeps its slot for the life of the VM (which is what lets REPL lines see each other's globals)
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm->globalSlots, name, &slot)) return AS_INT(slot);
+
+    push(OBJ_VAL(name));                        // the name may not be reachable from anywhere else yet, and growing the arrays can trigger the GC
+    writeValueArray(&vm->globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm->globalNames, OBJ_VAL(name));
+    tableSet(&vm->globalSlots, name, INT_VAL(vm->globalNames.count - 1));
+    pop();
+    return vm->globalNames.count - 1;
+}
+
 // gives a native function a name, so it can be used in CLOX language with other user-defined functions
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    int slot = globalSlot(AS_STRING(vm->stack[0]));
+    vm->globalValues.values[slot] = vm->stack[1];
     pop();
     pop();
 }
 
-// initialized VM
-void initVM() {
-    vm.stack = NULL;                // Nothing in VM stack since VM has just been created
-    vm.stackCapacity = 0;           
+// creates and initializes a VM, and binds it to the calling thread
+VM* newVM(int debugFlags) {
+    VM* isolate = (VM*)calloc(1, sizeof(VM));       // anything not set up below starts out zero (or NULL)
+    if (isolate == NULL) exit(1);
+    useVM(isolate);
+
+    vm->debug = debugFlags;
+    vm->stack = newStack(STACK_MAX);
+    commitStack(vm->stack, STACK_MAX, STACK_INITIAL);
+    vm->openUpvalueAt = stackUpvalues(vm->stack, STACK_MAX);
+    vm->frames = (CallFrame*)malloc(FRAMES_INITIAL * sizeof(CallFrame));
+    if (vm->frames == NULL) exit(1);
+    vm->stackEnd = vm->stack + STACK_INITIAL;
+    vm->stackLimit = vm->stack + STACK_MAX;
+    vm->frameCapacity = FRAMES_INITIAL;
+    vm->profiler = NULL;             // main() starts one for --profile
+    vm->jitEnabled = true;           // main() switches it off for --no-jit
+    vm->outputLength = 0;
+    vm->outputCapacity = (debugFlags & (DEBUG_PRINT_CODE | DEBUG_TRACE_EXECUTION | DEBUG_LOG_GC)) ? 0 : OUTPUT_BUFFER_SIZE;
     resetStack();                   // stack initially empty
-    vm.objects = NULL;              // Nothing in LL since VM has just been created
-    vm.bytesAllocated = 0;          // when VM starts up, no memory has been allocated
-    vm.nextGC = 1024 * 1024;        // initial threshold is arbitrary, goal is to not trigger the first few GCs too quickly but also to not wait too long
+    vm->objects = NULL;              // Nothing in LL since VM has just been created
+    vm->youngObjects = NULL;
+    vm->youngBytes = 0;
+    vm->rememberedCount = 0;         // remembered set is initially empty
+    vm->rememberedCapacity = 0;
+    vm->remembered = NULL;
+    vm->gcPhase = GC_IDLE;
+    vm->sweepObjects = NULL;
+    vm->sliceBytes = 0;
+    vm->bytesAllocated = 0;          // when VM starts up, no memory has been allocated
+    initGC();                       // thresholds, nextGC among them
     
-    vm.grayCount = 0;               // gray stack is initially empty
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->grayCount = 0;               // gray stack is initially empty
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->gcStats = (GCStats){0};
 
-    initTable(&vm.globals);                     // global var table initially empty
-    initTable(&vm.strings);                     // string table initially empty
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);      // create and intern string when VM boots up
+    initValueArray(&vm->globalValues);           // no globals yet
+    initValueArray(&vm->globalNames);
+    initTable(&vm->globalSlots);
+    initTable(&vm->strings);                     // string table initially empty
+    vm->rootFiber = vm->fiber = newFiber(NULL);  // before anything can capture an upvalue (which points at its fiber)
+    vm->initString = NULL;
+    vm->emptyShape = NULL;
+    vm->initString = copyString("init", 4);      // create and intern string when VM boots up
+    vm->emptyShape = newShape(NULL, NULL);
 
     defineNative("clock", clockNative);                                         // our native functions
     defineNative("deleteField", deleteFieldNative);
+    defineNative("buffer", bufferNative);
+    defineNative("bufferLength", bufferLengthNative);
+    defineNative("bufferSum", bufferSumNative);
+    defineNative("bufferDot", bufferDotNative);
+    defineNative("bufferMin", bufferMinNative);
+    defineNative("bufferMax", bufferMaxNative);
+    defineNative("bufferScale", bufferScaleNative);
+    defineNative("bufferAdd", bufferAddNative);
+    defineNative("bufferMul", bufferMulNative);
+    defineNative("bufferFill", bufferFillNative);
+    defineNative("gcStats", gcStatsNative);
+    defineFiberNatives();
 
+    initTable(&vm->listMethods);
+    for (int i = 0; i < (int)(sizeof(listMethods) / sizeof(listMethods[0])); i++) {
+        push(OBJ_VAL(copyString(listMethods[i].name, (int)strlen(listMethods[i].name))));
+        tableSet(&vm->listMethods, AS_STRING(vm->stack[0]), INT_VAL(i));
+        pop();
+    }
+    return isolate;
 }
 
-// frees memory from VM processes
-void freeVM() {
-    freeTable(&vm.globals);         // free global var hashtable from heap
-    freeTable(&vm.strings);         // free string hashtable from heap
-    vm.initString = NULL;           // prevent dangling pointers 
+// frees memory from VM processes, and the VM itself (the calling thread is left without one)
+void freeVM(VM* isolate) {
+    useVM(isolate);
+    flushOutput();
+    freeValueArray(&vm->globalValues);   // free the global variable slots
+    freeValueArray(&vm->globalNames);
+    freeTable(&vm->globalSlots);
+    freeTable(&vm->listMethods);
+    freeTable(&vm->strings);         // free string hashtable from heap
+    freeLoop();
+    vm->initString = NULL;           // prevent dangling pointers 
+    vm->emptyShape = NULL;
     freeObjects();                  // to free every object from user program
-    free(vm.stack);                 // free the value stack
-    vm.stack = NULL;                // Prevents dangling pointers
-    vm.stackCapacity = 0;           // set to 0
-    resetStack();
+    freeCompiled();                 // unmap the cache files the freed functions took their code from
+    freeStack(vm->stack, (int)(vm->stackLimit - vm->stack));       // free the value stack (and openUpvalueAt)
+    free(vm->frames);
+    vm->stack = NULL;                // Prevents dangling pointers
+    vm->stackTop = NULL;
+    vm->stackEnd = NULL;
+    vm->stackLimit = NULL;
+    vm->openUpvalueAt = NULL;
+    vm->frames = NULL;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
+    vm->fiber = vm->rootFiber = NULL;
+    free(isolate);
+    vm = NULL;
 }
 
-// adds value to where count is, then moves count to where the next value to be pushed will go
+void useVM(VM* isolate) {
+    vm = isolate;
+}
+
+// stores value where stackTop points, then moves stackTop to where the next value to be pushed will go
+// no capacity check, call() makes room for as deep as the frame's code gets (see reserveStack())
 void push(Value value) {
-    if (vm.stackCapacity < vm.stackCount + 1) {
-      int oldCapacity = vm.stackCapacity;
-      vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-      vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
-    }
-  
-    vm.stack[vm.stackCount] = value;
-    vm.stackCount++;
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
-// move count to last used slot in stack, then return the value
+// move stackTop back to last used slot in stack, then return the value
 Value pop() {
-    vm.stackCount--;
-    return vm.stack[vm.stackCount];
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
 static Value peek(int distance) {
-    return vm.stack[vm.stackCount - 1 - distance];
+    return vm->stackTop[-1 - distance];
+}
+
+// room past the deepest a frame's code gets for what the VM and the natives push for a moment while running one of its
+// instructions (a string being interned, the fields of the instance gcStats() makes)
+#define STACK_SLACK 16
+
+// makes sure a frame whose slot 0 is slots below stackTop has room for everything function pushes, committing at least
+// twice as much of the stack's reservation when it doesn't, false (a runtime error) once that would go past its end
+// the stack stays where it is, frame->slots and the open upvalues keep pointing at the same slots
+static bool reserveStack(int slots, ObjFunction* function) {
+    int needed = (int)(vm->stackTop - vm->stack) - slots + function->maxSlots + STACK_SLACK;
+    int capacity = (int)(vm->stackEnd - vm->stack);
+    if (needed <= capacity) return true;
+
+    int limit = (int)(vm->stackLimit - vm->stack);
+    if (needed > limit) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+    while (capacity < needed) capacity = capacity * 2 < limit ? capacity * 2 : limit;
+    commitStack(vm->stack, limit, capacity);
+    vm->stackEnd = vm->stack + capacity;
+    return true;
+}
+
+// the first call of a function compiled lazily compiles its body, a compile error in it is a runtime error of the call
+static bool compileOnCall(ObjFunction* function) {
+    if (compileBody(function)) return true;
+    runtimeError("Can't compile %s().", function->name->chars);
+    return false;
 }
 
 // sets up new CallFrame and stack slots for a function
+#ifdef JIT
+// machine code neither traces nor profiles, everything gets interpreted while either is on
+static inline bool jitActive() {
+    return vm->jitEnabled && vm->profiler == NULL && !(vm->debug & DEBUG_TRACE_EXECUTION);
+}
+#endif
+
 static bool call(ObjClosure* closure, int argCount) {
     if (argCount != closure->function->arity) {
         runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
+    if (closure->function->lazy != NULL && !compileOnCall(closure->function)) return false;
+#ifdef JIT
+    // run() (or the caller's machine code) picks the new frame's code up
+    if (++closure->function->hotness == JIT_HOTNESS && jitActive()) jitCompile(closure->function);
+#endif
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
-        return false;
+    if (vm->frameCount == vm->frameCapacity) {
+        if (vm->frameCount == FRAMES_MAX) {
+            runtimeError("Stack overflow.");
+            return false;
+        }
+        vm->frameCapacity = vm->frameCapacity * 2 < FRAMES_MAX ? vm->frameCapacity * 2 : FRAMES_MAX;
+        vm->frames = (CallFrame*)realloc(vm->frames, vm->frameCapacity * sizeof(CallFrame));
+        if (vm->frames == NULL) exit(1);
     }
+    if (!reserveStack(argCount + 1, closure->function)) return false;
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
-    frame->slots = vm.stack + vm.stackCount - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
+    if (vm->profiler != NULL) profileCall(closure->function);
     return true;
 }
 
@@ -156,12 +560,12 @@ static bool callValue(Value callee, int argCount) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-                vm.stack[vm.stackCount - argCount - 1] = bound->receiver;
+                vm->stackTop[-argCount - 1] = bound->receiver;
                 return call(bound->method, argCount);
             }
             case OBJ_CLASS: {
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stack[vm.stackCount - argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
                 if (!IS_NIL(klass->initializer)) {                      
                     return call(AS_CLOSURE(klass->initializer), argCount);
                 } else if (argCount != 0) {
@@ -174,8 +578,14 @@ static bool callValue(Value callee, int argCount) {
                 return call(AS_CLOSURE(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stack + vm.stackCount - argCount);
-                vm.stackCount -= argCount + 1;
+                Value result = native(argCount, vm->stackTop - argCount);
+                if (vm->fiberSwitched) {
+                    // another fiber runs now (resume(), yield() or a native that has to wait), with its own stack
+                    vm->fiberSwitched = false;
+                    return !IS_UNDEFINED(result);
+                }
+                if (IS_UNDEFINED(result)) return false;                 // it reported a runtime error
+                vm->stackTop -= argCount + 1;
                 push(result);
                 return true;
             }
@@ -187,22 +597,145 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-// look up the method by name in the class’s method table, if not found, report runtime error and exit
-// Otherwise, take the method’s closure and push a call to it onto the CallFrame stack
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
-    Value method;
-    if (!tableGet(&klass->methods, name, &method)) {
+// finds the entry remembered for receivers of this class and shape, NULL on a miss
+// entries filled before the class's methods last changed don't count
+static inline InlineCacheEntry* findCacheEntry(InlineCache* cache, ObjClass* klass, ObjShape* shape) {
+    for (int i = 0; i < cache->count; i++) {
+        InlineCacheEntry* entry = &cache->entries[i];
+        if (entry->klass == klass && entry->shape == shape) {
+            return entry->version == klass->version ? entry : NULL;
+        }
+    }
+    return NULL;
+}
+
+// claims the entry for this class and shape, reusing a stale one for the same pair if there is one
+// appends while there is room (monomorphic -> polymorphic), a full cache keeps overwriting its last entry
+static InlineCacheEntry* addCacheEntry(InlineCache* cache, ObjClass* klass, ObjShape* shape) {
+    InlineCacheEntry* entry = NULL;
+    for (int i = 0; i < cache->count; i++) {
+        if (cache->entries[i].klass == klass && cache->entries[i].shape == shape) {
+            entry = &cache->entries[i];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        if (cache->count < INLINE_CACHE_SIZE) cache->count++;
+        entry = &cache->entries[cache->count - 1];
+    }
+
+    // the cache belongs to the running function, which is likely old while what gets cached is young
+    writeBarrier((Obj*)vm->frames[vm->frameCount - 1].closure->function);
+    entry->klass = klass;
+    entry->shape = shape;
+    entry->version = klass->version;
+    entry->index = -1;
+    entry->transition = NULL;
+    entry->method = NIL_VAL;
+    return entry;
+}
+
+// the slow path of property access and OP_INVOKE: resolve name on the instance the long way
+// (a field wins over a method with the same name) and remember the answer for instances laid out the same way
+// reports a runtime error and returns NULL if neither exists
+static InlineCacheEntry* cacheProperty(InlineCache* cache, ObjInstance* instance, ObjString* name) {
+    int index = shapeFieldIndex(instance->shape, name);
+    Value method = NIL_VAL;
+    if (index == -1 && !tableGet(&instance->klass->methods, name, &method)) {
         runtimeError("Undefined property '%s'.", name->chars);
+        return NULL;
+    }
+
+    InlineCacheEntry* entry = addCacheEntry(cache, instance->klass, instance->shape);
+    entry->index = index;
+    entry->method = method;
+    return entry;
+}
+
+// call() for a call in tail position (OP_TAIL_CALL, OP_TAIL_INVOKE...): the closure's frame takes over the top one,
+// whose locals aren't needed anymore, so a chain of them runs in constant stack
+static bool tailCall(ObjClosure* closure, int argCount) {
+    if (argCount != closure->function->arity) {
+        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
         return false;
     }
-    return call(AS_CLOSURE(method), argCount);
+    if (closure->function->lazy != NULL && !compileOnCall(closure->function)) return false;
+
+    // the frame has room for the caller's code, the callee's may go deeper
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    if (!reserveStack((int)(vm->stackTop - frame->slots), closure->function)) return false;
+    closeUpvalues(frame->slots);                // the locals are about to be overwritten
+    if (vm->profiler != NULL) profileReturn();
+    memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    if (vm->profiler != NULL) profileCall(closure->function);
+#ifdef JIT
+    if (++closure->function->hotness == JIT_HOTNESS && jitActive()) jitCompile(closure->function);
+#endif
+    return true;
+}
+
+// callValue() in tail position, anything but a closure or a bound method gets called the usual way (a native's
+// result is then returned by the OP_RETURN after the call)
+static bool tailCallValue(Value callee, int argCount) {
+    if (IS_CLOSURE(callee)) return tailCall(AS_CLOSURE(callee), argCount);
+    if (IS_BOUND_METHOD(callee)) {
+        vm->stackTop[-argCount - 1] = AS_BOUND_METHOD(callee)->receiver;
+        return tailCall(AS_BOUND_METHOD(callee)->method, argCount);
+    }
+    return callValue(callee, argCount);
+}
+
+// look up the method by name in the class’s method table (unless the call site's cache already knows it),
+// if not found, report runtime error and exit
+// Otherwise, take the method’s closure and push a call to it onto the CallFrame stack (or have it take over the top
+// frame, tail)
+static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount, InlineCache* cache, bool tail) {
+    InlineCacheEntry* entry = findCacheEntry(cache, klass, NULL);
+    if (entry == NULL) {
+        Value method;
+        if (!tableGet(&klass->methods, name, &method)) {
+            runtimeError("Undefined property '%s'.", name->chars);
+            return false;
+        }
+        entry = addCacheEntry(cache, klass, NULL);
+        entry->method = method;
+    }
+    return tail ? tailCall(AS_CLOSURE(entry->method), argCount) : call(AS_CLOSURE(entry->method), argCount);
+}
+
+// calls one of the built-in list methods on the list below the arguments, natives don't get a frame of their own
+static bool invokeListMethod(ObjString* name, int argCount) {
+    Value index;
+    if (!tableGet(&vm->listMethods, name, &index)) {
+        runtimeError("Undefined property '%s'.", name->chars);
+        return false;
+    }
+
+    const ListMethod* method = &listMethods[AS_INT(index)];
+    if (argCount != method->arity) {
+        runtimeError("Expected %d arguments but got %d.", method->arity, argCount);
+        return false;
+    }
+
+    Value* args = vm->stackTop - argCount - 1;
+    Value result;
+    if (!method->function(AS_LIST(args[0]), args, &result)) return false;
+    vm->stackTop = args;
+    push(result);
+    return true;
 }
 
 // grabs the reciever (method) off the stack
 // arguments passed to the method are above it on the stack, so we peek that many slots down
-// cast the object to an instance and invoke the method on it
-static bool invoke(ObjString* name, int argCount) {
+// cast the object to an instance and invoke the method on it, a field holding something callable shadows a method
+// on a cache hit neither the fields nor the class's method table get looked at
+static bool invoke(ObjString* name, int argCount, InlineCache* cache, bool tail) {
     Value receiver = peek(argCount);
+    if (IS_LIST(receiver)) return invokeListMethod(name, argCount);
     
     if (!IS_INSTANCE(receiver)) {
         runtimeError("Only instances have methods.");
@@ -211,13 +744,19 @@ static bool invoke(ObjString* name, int argCount) {
 
     ObjInstance* instance = AS_INSTANCE(receiver);
 
-    Value value;
-    if (tableGet(&instance->fields, name, &value)) {
-        vm.stack[vm.stackCount - argCount - 1] = value;
-        return callValue(value, argCount);
+    InlineCacheEntry* entry = findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry == NULL) {
+        entry = cacheProperty(cache, instance, name);
+        if (entry == NULL) return false;
     }
 
-    return invokeFromClass(instance->klass, name, argCount);
+    if (entry->index != -1) {
+        Value value = instance->fields[entry->index];
+        vm->stackTop[-argCount - 1] = value;
+        return tail ? tailCallValue(value, argCount) : callValue(value, argCount);
+    }
+
+    return tail ? tailCall(AS_CLOSURE(entry->method), argCount) : call(AS_CLOSURE(entry->method), argCount);
 }
 
 // look for a method with the given name in the class’s method table
@@ -239,22 +778,23 @@ static bool bindMethod(ObjClass* klass, ObjString* name) {
 // Captures a local variable from the stack and wraps it in an ObjUpvalue
 // allows a nested function to reference a variable from its enclosing function
 static ObjUpvalue* captureUpvalue(Value* local) {
+    // closures made in a loop keep capturing the same variables, vm->openUpvalueAt finds those without a search
+    ObjUpvalue* existing = vm->openUpvalueAt[local - vm->stack];
+    if (existing != NULL) return existing;
+
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
         upvalue = upvalue->next;
     }
   
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
-  
     ObjUpvalue* createdUpvalue = newUpvalue(local);
     createdUpvalue->next = upvalue;
+    vm->openUpvalueAt[local - vm->stack] = createdUpvalue;
 
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
         prevUpvalue->next = createdUpvalue;
     }
@@ -265,12 +805,483 @@ static ObjUpvalue* captureUpvalue(Value* local) {
 // If function ends and its local variables are about to be popped off the stack,
 // any open upvalues pointing to those locals must be closed (saved on heap)
 static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        vm->openUpvalueAt[upvalue->location - vm->stack] = NULL;
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        upvalue->fiber = NULL;
+        writeBarrierValue((Obj*)upvalue, upvalue->closed);
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+// fibers (see ObjFiber): switching moves the running one's stack, frames and open upvalues out of vm into its
+// ObjFiber and the next one's in, nothing can allocate in between (a collection would see half of each)
+// a native that switches sets vm->fiberSwitched, callValue() then leaves the stack to the fiber now running
+
+// puts the running fiber's stack and frames away in its ObjFiber
+static void saveFiber() {
+    ObjFiber* fiber = vm->fiber;
+    if (vm->profiler != NULL) profileUnwind();
+    fiber->frames = vm->frames;
+    fiber->frameCount = vm->frameCount;
+    fiber->frameCapacity = vm->frameCapacity;
+    fiber->stack = vm->stack;
+    fiber->stackTop = vm->stackTop;
+    fiber->stackEnd = vm->stackEnd;
+    fiber->stackLimit = vm->stackLimit;
+    fiber->openUpvalues = vm->openUpvalues;
+    fiber->openUpvalueAt = vm->openUpvalueAt;
+    writeBarrier((Obj*)fiber);                  // what's on its stack isn't a root anymore but its fields
+}
+
+// makes fiber the running one, its ObjFiber holds nothing while it runs (vm does)
+static void loadFiber(ObjFiber* fiber) {
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->stackEnd = fiber->stackEnd;
+    vm->stackLimit = fiber->stackLimit;
+    vm->openUpvalues = fiber->openUpvalues;
+    vm->openUpvalueAt = fiber->openUpvalueAt;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackEnd = NULL;
+    fiber->stackLimit = NULL;
+    fiber->openUpvalues = NULL;
+    fiber->openUpvalueAt = NULL;
+    vm->fiber = fiber;
+    if (vm->profiler != NULL) profileResume();
+}
+
+// picks fiber up where it left off: the first time it calls its closure, after that whatever it was waiting in
+// (resume(), yield() or a native that had to wait) returns the value it was handed
+static bool enterFiber(ObjFiber* fiber) {
+    loadFiber(fiber);
+    Value transfer = fiber->transfer;
+    fiber->transfer = NIL_VAL;
+    fiber->state = FIBER_RUNNING;
+    if (fiber->closure != NULL && vm->frameCount == 0) {
+        push(OBJ_VAL(fiber->closure));
+        if (fiber->closure->function->arity == 1) push(transfer);
+        return call(fiber->closure, fiber->closure->function->arity);
+    }
+    push(transfer);
+    return true;
+}
+
+// switches to the next fiber that's ready, waiting for one if none is yet
+// a fiber woken up in an I/O native gets the native called again with the arguments it left on its stack, if it
+// has to wait once more the next one is up
+// false after a runtime error (which went back to the main fiber)
+static bool runNextFiber() {
+    for (;;) {
+        ObjFiber* fiber = loopNext();
+        if (fiber == NULL) {
+            ObjFiber* root = vm->rootFiber;
+            loadFiber(root);
+            if (root->state == FIBER_DRAINING) {
+                root->state = FIBER_RUNNING;            // its script runs the OP_RETURN it waited at again
+                return true;
+            }
+            runtimeError("Every fiber is waiting for another one.");
+            return false;
+        }
+        if (fiber->retryArgs < 0) return enterFiber(fiber);
+
+        int argCount = fiber->retryArgs;
+        fiber->retryArgs = -1;
+        loadFiber(fiber);
+        fiber->state = FIBER_RUNNING;
+        vm->fiberRetrying = true;
+        Value result = AS_NATIVE(vm->stackTop[-argCount - 1])(argCount, vm->stackTop - argCount);
+        vm->fiberRetrying = false;
+        if (vm->fiberParked) {
+            vm->fiberParked = false;
+            continue;
+        }
+        if (IS_UNDEFINED(result)) return false;
+        vm->stackTop -= argCount + 1;
+        push(result);
+        return true;
+    }
+}
+
+// the running fiber waits (queued, or on a timer or a watch already) while the others run
+// with retryArgs < 0 the native's call is done and returns nil once the fiber is woken, otherwise its retryArgs
+// arguments stay on the stack and it gets called again with them (see runNextFiber())
+static Value parkFiber(Value* args, int retryArgs) {
+    if (retryArgs < 0) vm->stackTop = args - 1;
+    vm->fiber->retryArgs = retryArgs;
+    saveFiber();
+    if (vm->fiberRetrying) {
+        vm->fiberParked = true;             // runNextFiber() is calling this one again, it goes on with the next
+        return NIL_VAL;
+    }
+    vm->fiberSwitched = true;
+    return runNextFiber() ? NIL_VAL : UNDEFINED_VAL;
+}
+
+// run() got to the OP_RETURN of a fiber's bottom frame, with its result on top of the stack
+// the fiber is done: the result goes to the one that resumed it, if any, and its stack and frames are freed right away
+// the main fiber's script doesn't return while other fibers are queued or waiting, it waits at the OP_RETURN
+// (FIBER_DRAINING) and runs it again once they're all done
+static bool finishFiber() {
+    ObjFiber* fiber = vm->fiber;
+    if (fiber == vm->rootFiber) {
+        vm->frames[0].ip--;
+        fiber->state = FIBER_DRAINING;
+        saveFiber();
+        return runNextFiber();
     }
+
+    Value result = pop();
+    closeUpvalues(vm->stack);
+    if (vm->profiler != NULL) profileReturn();
+    freeStack(vm->stack, (int)(vm->stackLimit - vm->stack));
+    free(vm->frames);
+    vm->stack = NULL;
+    vm->stackTop = NULL;
+    vm->stackEnd = NULL;
+    vm->stackLimit = NULL;
+    vm->openUpvalueAt = NULL;
+    vm->frames = NULL;
+    vm->frameCount = 0;
+    vm->frameCapacity = 0;
+    fiber->state = FIBER_DONE;
+
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    if (caller == NULL) return runNextFiber();
+    caller->transfer = result;
+    writeBarrierValue((Obj*)caller, result);
+    return enterFiber(caller);
+}
+
+// after a runtime error: the fiber it happened in and the ones blocked resuming it are done, the ones queued and
+// waiting too, and the main fiber runs again (resetStack() empties it)
+static void abandonFibers() {
+    ObjFiber* root = vm->rootFiber;
+    if (vm->fiber != root) {
+        ObjFiber* fiber = vm->fiber;
+        saveFiber();
+        abandonFiber(fiber);
+        loadFiber(root);
+    }
+    resetLoop();
+    root->state = FIBER_RUNNING;
+    root->caller = NULL;
+    root->transfer = NIL_VAL;
+    root->retryArgs = -1;
+    ioCancel(root);
+}
+
+static bool checkArgCount(int argCount, int min, int max) {
+    if (argCount >= min && argCount <= max) return true;
+    if (min == max) {
+        runtimeError("Expected %d arguments but got %d.", min, argCount);
+    } else {
+        runtimeError("Expected %d to %d arguments but got %d.", min, max, argCount);
+    }
+    return false;
+}
+
+// what fiber() and spawn() run, a closure with at most maxArity parameters compiled already (a compile error
+// shows up here, not in whichever fiber happens to run it first)
+static ObjClosure* fiberClosure(const char* name, Value value, int maxArity) {
+    if (!IS_CLOSURE(value) || AS_CLOSURE(value)->function->arity > maxArity) {
+        runtimeError(maxArity == 0 ? "Argument 1 of %s() must be a function without parameters."
+                                   : "Argument 1 of %s() must be a function with at most one parameter.", name);
+        return NULL;
+    }
+    ObjClosure* closure = AS_CLOSURE(value);
+    if (closure->function->lazy != NULL && !compileOnCall(closure->function)) return NULL;
+    return closure;
+}
+
+// fiber(fn) makes a fiber that runs fn once resumed, fn can take the value the first resume() passes
+static Value fiberNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    ObjClosure* closure = fiberClosure("fiber", args[0], 1);
+    if (closure == NULL) return UNDEFINED_VAL;
+    return OBJ_VAL(newFiber(closure));
+}
+
+// resume(fiber, value) runs fiber until it yields or returns, which is what resume() returns then
+// value (nil if left out) is what the yield() it's waiting in returns, or fn's argument the first time
+static Value resumeNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 2)) return UNDEFINED_VAL;
+    if (!IS_FIBER(args[0])) {
+        runtimeError("Argument 1 of resume() must be a fiber.");
+        return UNDEFINED_VAL;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->spawned) {
+        runtimeError("Can't resume a spawned fiber.");
+        return UNDEFINED_VAL;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtimeError("Can't resume a finished fiber.");
+        return UNDEFINED_VAL;
+    }
+    if (fiber->state != FIBER_NEW && fiber->state != FIBER_SUSPENDED) {
+        runtimeError("Can't resume a fiber that's running.");
+        return UNDEFINED_VAL;
+    }
+
+    fiber->transfer = argCount == 2 ? args[1] : NIL_VAL;
+    fiber->caller = vm->fiber;
+    writeBarrier((Obj*)fiber);
+    vm->stackTop = args - 1;
+    saveFiber();
+    vm->fiberSwitched = true;
+    return enterFiber(fiber) ? NIL_VAL : UNDEFINED_VAL;
+}
+
+// yield(value) hands value (nil if left out) to the fiber that resumed this one and waits to be resumed again
+// a spawned fiber has nobody to hand anything to, it goes to the back of the queue and lets the others run
+static Value yieldNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 0, 1)) return UNDEFINED_VAL;
+    ObjFiber* fiber = vm->fiber;
+    ObjFiber* caller = fiber->caller;
+    if (caller != NULL) {
+        fiber->caller = NULL;
+        fiber->state = FIBER_SUSPENDED;
+        caller->transfer = argCount == 1 ? args[0] : NIL_VAL;
+        writeBarrier((Obj*)caller);
+        vm->stackTop = args - 1;
+        saveFiber();
+        vm->fiberSwitched = true;
+        return enterFiber(caller) ? NIL_VAL : UNDEFINED_VAL;
+    }
+    if (fiber->spawned) {
+        loopReady(fiber);
+        return parkFiber(args, -1);
+    }
+    runtimeError("Can't yield from the main fiber.");
+    return UNDEFINED_VAL;
+}
+
+// spawn(fn) queues a fiber running fn, the scheduler gets to it whenever the fiber running waits or yields
+// (the script's end included: it doesn't return before every fiber spawned is done)
+static Value spawnNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    ObjClosure* closure = fiberClosure("spawn", args[0], 0);
+    if (closure == NULL) return UNDEFINED_VAL;
+    ObjFiber* fiber = newFiber(closure);
+    fiber->spawned = true;
+    loopReady(fiber);
+    return OBJ_VAL(fiber);
+}
+
+static Value fiberDoneNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    if (!IS_FIBER(args[0])) {
+        runtimeError("Argument 1 of fiberDone() must be a fiber.");
+        return UNDEFINED_VAL;
+    }
+    return BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+}
+
+#ifdef EVENT_LOOP
+// the natives below wait without blocking the other fibers: when the system call would block, the fiber waits for
+// the event loop to wake it (see loop.h) and the native gets called again
+// sockets are the file descriptor numbers tcpListen(), tcpAccept() and tcpConnect() return
+
+// chars read at once by socketRead() and readFile()
+#define IO_CHUNK (64 * 1024)
+
+static bool checkFdArg(const char* name, Value* args, int index, int* fd) {
+    if (!IS_NUMBER(args[index]) || AS_NUMBER(args[index]) != (int)AS_NUMBER(args[index]) || AS_NUMBER(args[index]) < 0) {
+        runtimeError("Argument %d of %s() must be a socket.", index + 1, name);
+        return false;
+    }
+    *fd = (int)AS_NUMBER(args[index]);
+    return true;
+}
+
+static Value ioFailed(const char* name) {
+    runtimeError("%s() failed: %s.", name, ioError());
+    return UNDEFINED_VAL;
+}
+
+// the running fiber waits until fd can be read (or written), then the native is called again
+static Value waitFor(int fd, bool write, int argCount, Value* args) {
+    if (!loopWatch(vm->fiber, fd, write)) {
+        runtimeError("Another fiber is already waiting on this socket.");
+        return UNDEFINED_VAL;
+    }
+    return parkFiber(args, argCount);
+}
+
+// sleep(ms) lets the other fibers run for that long
+static Value sleepNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    if (!IS_NUMBER(args[0]) || !(AS_NUMBER(args[0]) >= 0)) {
+        runtimeError("Argument 1 of sleep() must be a non-negative number.");
+        return UNDEFINED_VAL;
+    }
+    loopSleep(vm->fiber, AS_NUMBER(args[0]) / 1000);
+    return parkFiber(args, -1);
+}
+
+// tcpListen(port) listens on every interface, tcpAccept() takes the connections
+static Value tcpListenNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0]) ||
+            AS_NUMBER(args[0]) < 0 || AS_NUMBER(args[0]) > 65535) {
+        runtimeError("Argument 1 of tcpListen() must be a port number.");
+        return UNDEFINED_VAL;
+    }
+    int fd = ioListen((int)AS_NUMBER(args[0]));
+    if (fd < 0) return ioFailed("tcpListen");
+    return INT_VAL(fd);
+}
+
+static Value tcpAcceptNative(int argCount, Value* args) {
+    int listener;
+    if (!checkArgCount(argCount, 1, 1) || !checkFdArg("tcpAccept", args, 0, &listener)) return UNDEFINED_VAL;
+    int fd = ioAccept(listener);
+    if (fd == IO_AGAIN) return waitFor(listener, false, argCount, args);
+    if (fd < 0) return ioFailed("tcpAccept");
+    return INT_VAL(fd);
+}
+
+// tcpConnect(host, port) returns right away, the first socketRead() or socketWrite() waits for the connection
+// (looking host up blocks though)
+static Value tcpConnectNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 2, 2)) return UNDEFINED_VAL;
+    if (!IS_ANY_STRING(args[0])) {
+        runtimeError("Argument 1 of tcpConnect() must be a host name.");
+        return UNDEFINED_VAL;
+    }
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) != (int)AS_NUMBER(args[1]) ||
+            AS_NUMBER(args[1]) < 1 || AS_NUMBER(args[1]) > 65535) {
+        runtimeError("Argument 2 of tcpConnect() must be a port number.");
+        return UNDEFINED_VAL;
+    }
+    int fd = ioConnect(flatString(args[0])->chars, (int)AS_NUMBER(args[1]));
+    if (fd < 0) return ioFailed("tcpConnect");
+    return INT_VAL(fd);
+}
+
+// socketRead(socket) returns what arrived (up to IO_CHUNK chars), nil once the other end has closed it
+static Value socketReadNative(int argCount, Value* args) {
+    int fd;
+    if (!checkArgCount(argCount, 1, 1) || !checkFdArg("socketRead", args, 0, &fd)) return UNDEFINED_VAL;
+    char chars[IO_CHUNK];
+    long count = ioRead(fd, chars, IO_CHUNK);
+    if (count == IO_AGAIN) return waitFor(fd, false, argCount, args);
+    if (count < 0) return ioFailed("socketRead");
+    if (count == 0) return NIL_VAL;
+    return OBJ_VAL(copyString(chars, (int)count));
+}
+
+// socketWrite(socket, string) returns once all of it is sent, fiber->ioDone counts what already is meanwhile
+static Value socketWriteNative(int argCount, Value* args) {
+    int fd;
+    if (!checkArgCount(argCount, 2, 2) || !checkFdArg("socketWrite", args, 0, &fd)) return UNDEFINED_VAL;
+    if (!IS_ANY_STRING(args[1])) {
+        runtimeError("Argument 2 of socketWrite() must be a string.");
+        return UNDEFINED_VAL;
+    }
+    ObjString* string = flatString(args[1]);
+    ObjFiber* fiber = vm->fiber;
+    while (fiber->ioDone < (size_t)string->length) {
+        long count = ioSend(fd, string->chars + fiber->ioDone, (size_t)string->length - fiber->ioDone);
+        if (count == IO_AGAIN) return waitFor(fd, true, argCount, args);
+        if (count < 0) {
+            fiber->ioDone = 0;
+            return ioFailed("socketWrite");
+        }
+        fiber->ioDone += (size_t)count;
+    }
+    fiber->ioDone = 0;
+    return NIL_VAL;
+}
+
+static Value socketCloseNative(int argCount, Value* args) {
+    int fd;
+    if (!checkArgCount(argCount, 1, 1) || !checkFdArg("socketClose", args, 0, &fd)) return UNDEFINED_VAL;
+    if (loopWatched(fd)) {
+        runtimeError("Can't close a socket another fiber is waiting on.");
+        return UNDEFINED_VAL;
+    }
+    if (ioClose(fd) < 0) return ioFailed("socketClose");
+    return NIL_VAL;
+}
+
+// readFile(path) returns the whole file as a string, read IO_CHUNK chars at a time into fiber->ioChars
+// a regular file never has to be waited for (and epoll can't), so between chunks it lets the fibers that are ready
+// run, a pipe or a device waits for the event loop like a socket does
+static Value readFileNative(int argCount, Value* args) {
+    if (!checkArgCount(argCount, 1, 1)) return UNDEFINED_VAL;
+    if (!IS_ANY_STRING(args[0])) {
+        runtimeError("Argument 1 of readFile() must be a path.");
+        return UNDEFINED_VAL;
+    }
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->ioChars == NULL) {
+        int fd = ioOpen(flatString(args[0])->chars);
+        if (fd < 0) {
+            runtimeError("Could not open file \"%s\": %s.", flatString(args[0])->chars, ioError());
+            return UNDEFINED_VAL;
+        }
+        fiber->ioFd = fd;
+        fiber->ioCapacity = IO_CHUNK;
+        fiber->ioChars = (char*)malloc(fiber->ioCapacity);
+        if (fiber->ioChars == NULL) exit(1);
+    }
+
+    for (;;) {
+        if (fiber->ioCapacity - fiber->ioDone < IO_CHUNK) {
+            fiber->ioCapacity *= 2;
+            fiber->ioChars = (char*)realloc(fiber->ioChars, fiber->ioCapacity);
+            if (fiber->ioChars == NULL) exit(1);
+        }
+        long count = ioRead(fiber->ioFd, fiber->ioChars + fiber->ioDone, IO_CHUNK);
+        if (count == IO_AGAIN) return waitFor(fiber->ioFd, false, argCount, args);
+        if (count < 0) {
+            runtimeError("Could not read file \"%s\": %s.", flatString(args[0])->chars, ioError());
+            ioCancel(fiber);
+            return UNDEFINED_VAL;
+        }
+        if (count == 0) break;
+        fiber->ioDone += (size_t)count;
+        if (loopReadyCount() > 0 && ioAlwaysReady(fiber->ioFd)) {
+            loopReady(fiber);
+            return parkFiber(args, argCount);
+        }
+    }
+
+    ObjString* string = copyString(fiber->ioChars, (int)fiber->ioDone);
+    ioCancel(fiber);
+    return OBJ_VAL(string);
+}
+#endif
+
+static void defineFiberNatives() {
+    defineNative("fiber", fiberNative);
+    defineNative("resume", resumeNative);
+    defineNative("yield", yieldNative);
+    defineNative("spawn", spawnNative);
+    defineNative("fiberDone", fiberDoneNative);
+#ifdef EVENT_LOOP
+    defineNative("sleep", sleepNative);
+    defineNative("tcpListen", tcpListenNative);
+    defineNative("tcpAccept", tcpAcceptNative);
+    defineNative("tcpConnect", tcpConnectNative);
+    defineNative("socketRead", socketReadNative);
+    defineNative("socketWrite", socketWriteNative);
+    defineNative("socketClose", socketCloseNative);
+    defineNative("readFile", readFileNative);
+#endif
 }
 
 // gets a method and adds it to its respective class's method table
@@ -279,340 +1290,998 @@ static void defineMethod(ObjString* name) {
     Value method = peek(0);
     ObjClass* klass = AS_CLASS(peek(1));
     tableSet(&klass->methods, name, method);
-    if (name == vm.initString) klass->initializer = method;
+    klass->version++;
+    if (name == vm->initString) klass->initializer = method;
+    writeBarrier((Obj*)klass);
     pop();
 }
 
+// a * b for two ints, which has to come out as -0 when a double multiplication would (-5 * 0)
+static inline Value intProduct(int64_t a, int64_t b) {
+    int64_t product = a * b;
+    if (product == 0 && (a < 0 || b < 0)) return NUMBER_VAL(-0.0);
+    return intValue(product);
+}
+
 // determine whether given value is falsey
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-// to "add" 2 strings together
-// calculates length of result string based on 2 strings given -> allocate char array for result -> then copy the 2 strings in
+// to "add" 2 strings together (either kind), long results are ropes that share both halves instead of copying them
+// the operands stay on the stack until the result is made, so a collection can't free them
 static void concatenate() {
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
-  
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
-  
-    ObjString* result = takeString(chars, length);
+    Value result = concatenateStrings(peek(1), peek(0));
     pop();
     pop();
-    push(OBJ_VAL(result));
+    push(result);
+}
+
+// where OP_SWITCH_INT or OP_SWITCH_STRING (the instruction at ip) sends value, the switch's case for it or the miss jump
+// a double with a whole value finds the same case its int would, as the == of the chain of cases would have it
+// a rope gets flattened first, it's on the stack so a collection while it is can't free it
+static uint8_t* switchTarget(uint8_t* ip, Value value) {
+    Chunk* chunk = &vm->frames[vm->frameCount - 1].closure->function->chunk;
+    uint8_t* jump = NULL;
+    if (*ip == OP_SWITCH_INT) {
+        int32_t low = (int32_t)(((uint32_t)ip[1] << 24) | (ip[2] << 16) | (ip[3] << 8) | ip[4]);
+        int count = (ip[5] << 8) | ip[6];
+        uint8_t* end = ip + 9 + 2 * count;
+        jump = ip + 7;
+        if (IS_INT(value)) {
+            int64_t slot = (int64_t)AS_INT(value) - low;
+            if (slot >= 0 && slot < count) jump = ip + 9 + 2 * slot;
+        } else if (IS_NUMBER(value)) {
+            double slot = AS_NUMBER(value) - low;
+            if (slot >= 0 && slot < count && slot == (int)slot) jump = ip + 9 + 2 * (int)slot;
+        }
+        return end + ((jump[0] << 8) | jump[1]);
+    }
+
+    int capacity = (ip[1] << 8) | ip[2];
+    uint8_t* end = ip + 5 + 4 * capacity;
+    jump = ip + 3;
+    if (IS_ANY_STRING(value)) {
+        ObjString* string = IS_STRING(value) ? AS_STRING(value) : flattenRope(AS_ROPE(value));
+        // strings are interned, the one in the table is the same object or none is
+        for (uint32_t slot = string->hash & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+            uint8_t* entry = ip + 5 + 4 * slot;
+            int constant = (entry[0] << 8) | entry[1];
+            if (constant == 0xffff) break;
+            if (AS_STRING(chunk->constants.values[constant]) == string) {
+                jump = entry + 2;
+                break;
+            }
+        }
+    }
+    return end + ((jump[0] << 8) | jump[1]);
+}
+
+#ifdef JIT
+// what the JIT's templates call back into (see jit.h), each does what run() does for the instruction, on vm->stackTop
+
+bool jitCallValue(int argCount) {
+    return callValue(peek(argCount), argCount);
+}
+
+bool jitInvoke(ObjString* name, int argCount, InlineCache* cache) {
+    return invoke(name, argCount, cache, false);
+}
+
+bool jitSuperInvoke(ObjClass* superclass, ObjString* name, int argCount, InlineCache* cache) {
+    return invokeFromClass(superclass, name, argCount, cache, false);
+}
+
+bool jitGetProperty(ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(0))) {
+        runtimeError("Only instances have properties.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(0));
+    InlineCacheEntry* entry = findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry == NULL) {
+        entry = cacheProperty(cache, instance, name);
+        if (entry == NULL) return false;
+    }
+
+    if (entry->index != -1) {
+        vm->stackTop[-1] = instance->fields[entry->index];
+    } else {
+        ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(entry->method));
+        vm->stackTop[-1] = OBJ_VAL(bound);
+    }
+    return true;
+}
+
+bool jitSetProperty(ObjString* name, InlineCache* cache) {
+    if (!IS_INSTANCE(peek(1))) {
+        runtimeError("Only instances have fields.");
+        return false;
+    }
+    ObjInstance* instance = AS_INSTANCE(peek(1));
+    Value value = peek(0);
+
+    InlineCacheEntry* entry = findCacheEntry(cache, instance->klass, instance->shape);
+    if (entry != NULL && entry->transition == NULL) {
+        instance->fields[entry->index] = value;
+        writeBarrierValue((Obj*)instance, value);
+    } else if (entry != NULL && entry->transition->fieldCount <= instance->fieldCapacity) {
+        instance->fields[entry->index] = value;
+        instance->shape = entry->transition;
+        writeBarrier((Obj*)instance);
+    } else {
+        ObjShape* before = instance->shape;
+        instanceSetField(instance, name, value);
+        entry = addCacheEntry(cache, instance->klass, before);
+        entry->index = shapeFieldIndex(instance->shape, name);
+        if (instance->shape != before) entry->transition = instance->shape;
+    }
+
+    vm->stackTop--;
+    vm->stackTop[-1] = value;
+    return true;
+}
+
+bool jitAddStrings() {
+    if (!IS_ANY_STRING(peek(0)) || !IS_ANY_STRING(peek(1))) {
+        runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+    concatenate();
+    return true;
+}
+
+void jitEqual() {
+    Value b = pop();
+    vm->stackTop[-1] = BOOL_VAL(valuesEqual(vm->stackTop[-1], b));
+}
+
+void jitPrint() {
+    printValue(pop());
+    writeOutput("\n", 1);
+}
+
+uint8_t* jitSwitchTarget(uint8_t* ip) {
+    return switchTarget(ip, peek(0));
+}
+
+void jitCloseUpvalues(Value* last) {
+    closeUpvalues(last);
+}
+
+void jitWriteBarrier(Obj* object, Value value) {
+    writeBarrierValue(object, value);
+}
+#endif
+
+// For VM disassembly and stack tracing (looks at stack internally for better debugs), ip is the instruction about to run
+static void traceExecution(CallFrame* frame, uint8_t* ip) {
+    printf("          ");
+    for (Value *slot = vm->stack; slot < vm->stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
+}
+
+// what the instrumented dispatch in run() does before every instruction, while tracing or profiling
+static void instrumentInstruction(CallFrame* frame, uint8_t* ip) {
+    if (vm->debug & DEBUG_TRACE_EXECUTION) traceExecution(frame, ip);
+    if (vm->profiler != NULL) profileInstruction(frame, ip);
 }
 
 // bytecode interpreter loop
 // endlessly reads next instruction, performs appropriate instruction, and updates stack/ip accordingly
 // macros simplify the process
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+// with COMPUTED_GOTO every handler ends by jumping straight to the handler of the next opcode through dispatchTable,
+// so each opcode gets its own indirect branch (much easier for the CPU to predict than one shared switch branch)
+// ip, slots and stackTop live in locals (registers) while running, the CallFrame and vm->stackTop only get
+// written back by STORE_FRAME() before anything that can look at them: calls, allocation (which can run the GC) and errors
+// the VM comes in as a parameter that shadows the thread-local vm, the same VM but in a register, so the loop doesn't
+// reload it from thread-local storage after every call it makes
+static InterpretResult run(VM* vm) {
+    CallFrame* frame;
+    register uint8_t* ip;
+    register Value* slots;
+    register Value* stackTop;
+
+    // write the cached registers back so the rest of the VM (and the GC) sees the real state
+    #define STORE_FRAME() \
+        (frame->ip = ip, vm->stackTop = stackTop)
+
+    // reload the registers from whatever frame is on top now (after a call or a return)
+    #define LOAD_FRAME() \
+        (frame = &vm->frames[vm->frameCount - 1], \
+        ip = frame->ip, \
+        slots = frame->slots, \
+        stackTop = vm->stackTop)
 
     // reads single byte from bytecode and advances instruction pointer
-    #define READ_BYTE() (*frame->ip++)
+    #define READ_BYTE() (*ip++)
     
     #define READ_SHORT() \
-        (frame->ip += 2, \
-        (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+        (ip += 2, \
+        (uint16_t)((ip[-2] << 8) | ip[-1]))
     
     #define READ_CONSTANT() \
         (frame->closure->function->chunk.constants.values[READ_BYTE()])
     
+    // index is written lowest byte first (see writeConstant()), read it back the same way
     #define READ_CONSTANT_LONG() \
-        (frame->closure->function->chunk.constants.values[ \
-        (READ_BYTE() << 16) | (READ_BYTE() << 8) | READ_BYTE()])
+        (ip += 3, \
+        frame->closure->function->chunk.constants.values[ \
+        ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
 
     #define READ_STRING() AS_STRING(READ_CONSTANT())
+
+    // the instruction's inline cache, its index is a 2 byte operand
+    #define READ_CACHE() \
+        (&frame->closure->function->chunk.caches[READ_SHORT()])
+
+    // stack operations on the cached stackTop, same meaning as push()/pop()/peek()
+    #define PUSH(value)     (*stackTop++ = (value))
+    #define POP()           (*--stackTop)
+    #define PEEK(distance)  (stackTop[-1 - (distance)])
+
+    // reports the error with an up to date ip (for the line number) and bails out of run()
+    #define RUNTIME_ERROR(...) \
+        do { \
+            STORE_FRAME(); \
+            runtimeError(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+
     // Macro that Pops 2 values from stack, applies the operation (op) to the 2 values, then pushes the result back to stack
     // you can pass macros as parameters to macros
-    #define BINARY_OP(valueType, op) \
+    // result overwrites the left operand in place instead of popping both and pushing again
+    // two ints skip floating point, intResult is the result worked out from them as int64_t a and b
+    #define BINARY_OP(valueType, op, intResult) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
+        if (LIKELY(ARE_INTS(PEEK(0), PEEK(1)))) { \
+            int64_t b = AS_INT(POP()); \
+            int64_t a = AS_INT(PEEK(0)); \
+            PEEK(0) = intResult; \
+            break; \
+        } \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(PEEK(0)); \
+        PEEK(0) = valueType(a op b); \
+    } while (false)
+
+    // checks the index operand of OP_INDEX_GET/SET against a list or buffer of the given length,
+    // leaves the element's position in slot
+    #define CHECK_INDEX(indexValue, length, slot) \
+    do { \
+        if (LIKELY(IS_INT(indexValue))) { \
+            slot = AS_INT(indexValue); \
+            if ((uint32_t)slot >= (uint32_t)(length)) { \
+                RUNTIME_ERROR("Index out of range."); \
+            } \
+            break; \
+        } \
+        if (!IS_NUMBER(indexValue)) { \
+            RUNTIME_ERROR("Index must be an integer."); \
+        } \
+        double index = AS_NUMBER(indexValue); \
+        if (!(index >= 0 && index < (length))) { \
+            RUNTIME_ERROR("Index out of range."); \
+        } \
+        slot = (int)index; \
+        if (slot != index) { \
+            RUNTIME_ERROR("Index must be an integer."); \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
     } while (false)
+
+    bool instrumented = (vm->debug & DEBUG_TRACE_EXECUTION) || vm->profiler != NULL;
+
+    // the frame on top after a call or a return runs its machine code, if it has any, until that leaves to the
+    // interpreter again (on an instruction it has no template for, or a value it wasn't compiled for)
+  #ifdef JIT
+    bool useJit = !instrumented && vm->jitEnabled;
+    #define JIT_ENTER() \
+        do { \
+            if (useJit && frame->closure->function->jit != NULL) { \
+                STORE_FRAME(); \
+                if (!jitRun(frame)) return INTERPRET_RUNTIME_ERROR; \
+                LOAD_FRAME(); \
+            } \
+        } while (false)
+  #else
+    #define JIT_ENTER() do { } while (false)
+  #endif
+
+    // INTERPRET_LOOP starts the loop, CASE(op) labels a handler and DISPATCH() ends one (takes the place of break)
+    #ifdef COMPUTED_GOTO
+        // must list every opcode, an opcode missing from here would jump to a NULL address
+        static void* dispatchTable[] = {
+            [OP_CONSTANT]      = &&TARGET_OP_CONSTANT,
+            [OP_NIL]           = &&TARGET_OP_NIL,
+            [OP_TRUE]          = &&TARGET_OP_TRUE,
+            [OP_FALSE]         = &&TARGET_OP_FALSE,
+            [OP_POP]           = &&TARGET_OP_POP,
+            [OP_GET_LOCAL]     = &&TARGET_OP_GET_LOCAL,
+            [OP_SET_LOCAL]     = &&TARGET_OP_SET_LOCAL,
+            [OP_GET_GLOBAL]    = &&TARGET_OP_GET_GLOBAL,
+            [OP_DEFINE_GLOBAL] = &&TARGET_OP_DEFINE_GLOBAL,
+            [OP_SET_GLOBAL]    = &&TARGET_OP_SET_GLOBAL,
+            [OP_GET_UPVALUE]   = &&TARGET_OP_GET_UPVALUE,
+            [OP_SET_UPVALUE]   = &&TARGET_OP_SET_UPVALUE,
+            [OP_GET_PROPERTY]  = &&TARGET_OP_GET_PROPERTY,
+            [OP_SET_PROPERTY]  = &&TARGET_OP_SET_PROPERTY,
+            [OP_GET_SUPER]     = &&TARGET_OP_GET_SUPER,
+            [OP_DUP]           = &&TARGET_OP_DUP,
+            [OP_EQUAL]         = &&TARGET_OP_EQUAL,
+            [OP_GREATER]       = &&TARGET_OP_GREATER,
+            [OP_LESS]          = &&TARGET_OP_LESS,
+            [OP_ADD]           = &&TARGET_OP_ADD,
+            [OP_SUBTRACT]      = &&TARGET_OP_SUBTRACT,
+            [OP_MULTIPLY]      = &&TARGET_OP_MULTIPLY,
+            [OP_DIVIDE]        = &&TARGET_OP_DIVIDE,
+            [OP_NOT]           = &&TARGET_OP_NOT,
+            [OP_NEGATE]        = &&TARGET_OP_NEGATE,
+            [OP_PRINT]         = &&TARGET_OP_PRINT,
+            [OP_JUMP]          = &&TARGET_OP_JUMP,
+            [OP_JUMP_IF_FALSE] = &&TARGET_OP_JUMP_IF_FALSE,
+            [OP_LOOP]          = &&TARGET_OP_LOOP,
+            [OP_CALL]          = &&TARGET_OP_CALL,
+            [OP_TAIL_CALL]     = &&TARGET_OP_TAIL_CALL,
+            [OP_INVOKE]        = &&TARGET_OP_INVOKE,
+            [OP_SUPER_INVOKE]  = &&TARGET_OP_SUPER_INVOKE,
+            [OP_TAIL_INVOKE]   = &&TARGET_OP_TAIL_INVOKE,
+            [OP_TAIL_SUPER_INVOKE] = &&TARGET_OP_TAIL_SUPER_INVOKE,
+            [OP_CLOSURE]       = &&TARGET_OP_CLOSURE,
+            [OP_CLOSE_UPVALUE] = &&TARGET_OP_CLOSE_UPVALUE,
+            [OP_MODULUS]       = &&TARGET_OP_MODULUS,
+            [OP_CONSTANT_LONG] = &&TARGET_OP_CONSTANT_LONG,
+            [OP_RETURN]        = &&TARGET_OP_RETURN,
+            [OP_CLASS]         = &&TARGET_OP_CLASS,
+            [OP_INHERIT]       = &&TARGET_OP_INHERIT,
+            [OP_METHOD]        = &&TARGET_OP_METHOD,
+            [OP_BUILD_LIST]    = &&TARGET_OP_BUILD_LIST,
+            [OP_INDEX_GET]     = &&TARGET_OP_INDEX_GET,
+            [OP_INDEX_SET]     = &&TARGET_OP_INDEX_SET,
+            [OP_SWITCH_INT]    = &&TARGET_OP_SWITCH_INT,
+            [OP_SWITCH_STRING] = &&TARGET_OP_SWITCH_STRING,
+            [OP_ADD_LOCALS]          = &&TARGET_OP_ADD_LOCALS,
+            [OP_ADD_CONSTANT]        = &&TARGET_OP_ADD_CONSTANT,
+            [OP_SUBTRACT_CONSTANT]   = &&TARGET_OP_SUBTRACT_CONSTANT,
+            [OP_POP_JUMP_IF_FALSE]   = &&TARGET_OP_POP_JUMP_IF_FALSE,
+            [OP_POP_JUMP_IF_TRUE]    = &&TARGET_OP_POP_JUMP_IF_TRUE,
+            [OP_JUMP_IF_NOT_LESS]    = &&TARGET_OP_JUMP_IF_NOT_LESS,
+            [OP_JUMP_IF_NOT_GREATER] = &&TARGET_OP_JUMP_IF_NOT_GREATER,
+        };
+
+        // when tracing or profiling every opcode is sent to TARGET_INSTRUMENT first, which does that and then jumps to the
+        // real handler (choosing the table once up front keeps either from costing anything when they are off)
+        static void* instrumentTable[UINT8_COUNT] = { [0 ... UINT8_MAX] = &&TARGET_INSTRUMENT };
+        void** dispatch = instrumented ? instrumentTable : dispatchTable;
+
+        #define INTERPRET_LOOP  DISPATCH();
+        #define CASE(op)        TARGET_##op
+        #define DISPATCH()      goto *dispatch[READ_BYTE()]
+    #else
+        // a switch has just the one dispatch branch, so the check stays in the loop (it's the same every time, which predicts well)
+        #define INTERPRET_LOOP \
+            loop: \
+                if (instrumented) { \
+                    STORE_FRAME(); \
+                    instrumentInstruction(frame, ip); \
+                } \
+                switch (READ_BYTE())
+        #define CASE(op)        case op
+        #define DISPATCH()      goto loop
+    #endif
+
+    LOAD_FRAME();
+    JIT_ENTER();
+
+    INTERPRET_LOOP
+    {
+    #ifdef COMPUTED_GOTO
+        TARGET_INSTRUMENT:
+            STORE_FRAME();
+            instrumentInstruction(frame, ip - 1);
+            goto *dispatchTable[ip[-1]];
+    #endif
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): { 
+            Value constant = READ_CONSTANT_LONG();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): stackTop--; DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->globalValues.values[slot];
+            if (IS_UNDEFINED(value)) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm->globalNames.values[slot])->chars);
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm->globalValues.values[slot] = PEEK(0);     // the slot already exists, so (unlike the old table insert) nothing here can allocate
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+                RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm->globalNames.values[slot])->chars);
+            }
+            vm->globalValues.values[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            ObjUpvalue* upvalue = frame->closure->upvalues[READ_BYTE()];
+            *upvalue->location = PEEK(0);
+            writeBarrierValue((Obj*)upvalue, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_PROPERTY): {
+            if (!IS_INSTANCE(PEEK(0))) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+      
+            ObjInstance* instance = AS_INSTANCE(PEEK(0));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
     
-    for (;;) {
+            InlineCacheEntry* entry = findCacheEntry(cache, instance->klass, instance->shape);
+            if (entry == NULL) {
+                STORE_FRAME();
+                entry = cacheProperty(cache, instance, name);
+                if (entry == NULL) return INTERPRET_RUNTIME_ERROR;
+            }
 
-    // For VM disassembly and stack tracing (looks at stack internally for better debugs)
-    #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stack + vm.stackCount; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+            if (entry->index != -1) {
+                PEEK(0) = instance->fields[entry->index];       // replaces the instance
+                DISPATCH();
+            }
+
+            // a method, bind it to the instance
+            STORE_FRAME();
+            ObjBoundMethod* bound = newBoundMethod(PEEK(0), AS_CLOSURE(entry->method));
+            PEEK(0) = OBJ_VAL(bound);
+            DISPATCH();
         }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
-    #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
+        CASE(OP_SET_PROPERTY): {
+            if (!IS_INSTANCE(PEEK(1))) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
-            case OP_CONSTANT_LONG: { 
-                Value constant = READ_CONSTANT_LONG();
-                push(constant);
-                break;
+      
+            ObjInstance* instance = AS_INSTANCE(PEEK(1));
+            ObjString* name = READ_STRING();
+            InlineCache* cache = READ_CACHE();
+            Value value = PEEK(0);
+
+            // hit: either overwrite the field in place, or take the remembered transition when the slot is already there
+            InlineCacheEntry* entry = findCacheEntry(cache, instance->klass, instance->shape);
+            if (entry != NULL && entry->transition == NULL) {
+                instance->fields[entry->index] = value;
+                writeBarrierValue((Obj*)instance, value);
+            } else if (entry != NULL && entry->transition->fieldCount <= instance->fieldCapacity) {
+                instance->fields[entry->index] = value;
+                instance->shape = entry->transition;
+                writeBarrier((Obj*)instance);
+            } else {
+                STORE_FRAME();
+                ObjShape* before = instance->shape;
+                instanceSetField(instance, name, value);
+                entry = addCacheEntry(cache, instance->klass, before);
+                entry->index = shapeFieldIndex(instance->shape, name);
+                if (instance->shape != before) entry->transition = instance->shape;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
+
+            stackTop--;
+            PEEK(0) = value;        // replaces the instance
+            DISPATCH();
+        }
+        CASE(OP_GET_SUPER): {
+            ObjString* name = READ_STRING();
+            ObjClass* superclass = AS_CLASS(POP());
+    
+            STORE_FRAME();
+            if (!bindMethod(superclass, name)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_LOCAL: {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            Value b = PEEK(0);
+            Value a = PEEK(1);
+            STORE_FRAME();                  // comparing a rope can flatten it, which allocates (so both stay on the stack till then)
+            PEEK(1) = BOOL_VAL(valuesEqual(a, b));
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_GREATER):  BINARY_OP(BOOL_VAL, >, BOOL_VAL(a > b)); DISPATCH();
+        CASE(OP_LESS):     BINARY_OP(BOOL_VAL, <, BOOL_VAL(a < b)); DISPATCH();
+        CASE(OP_ADD): {
+            if (LIKELY(ARE_INTS(PEEK(0), PEEK(1)))) {
+              int64_t b = AS_INT(POP());
+              PEEK(0) = intValue(AS_INT(PEEK(0)) + b);
+            } else if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+                STORE_FRAME();
+                concatenate();
+                stackTop = vm->stackTop;
+            } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+              double b = AS_NUMBER(POP());
+              double a = AS_NUMBER(PEEK(0));
+              PEEK(0) = NUMBER_VAL(a + b);
+            } else {
+              RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
+            DISPATCH();
+        }
+        CASE(OP_DUP): {
+            Value top = PEEK(0);
+            PUSH(top);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, intValue(a - b)); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, intProduct(a, b)); DISPATCH();
+        CASE(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, NUMBER_VAL((double)a / (double)b)); DISPATCH();
+        // the compiler already emitted OP_MODULUS for '%', the loop just never handled it
+        // C's % on ints truncates like fmod() does, x % 0 (NaN) and x % -1 (INT32_MIN % -1 overflows) are left to fmod()
+        CASE(OP_MODULUS): {
+            if (LIKELY(ARE_INTS(PEEK(0), PEEK(1)) && AS_INT(PEEK(0)) != 0 && AS_INT(PEEK(0)) != -1)) {
+                int32_t b = AS_INT(POP());
+                int32_t a = AS_INT(PEEK(0));
+                int32_t result = a % b;
+                PEEK(0) = result == 0 && a < 0 ? NUMBER_VAL(-0.0) : INT_VAL(result);  // fmod() keeps the dividend's sign
+                DISPATCH();
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
-                break;
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name); 
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(PEEK(0));
+            PEEK(0) = NUMBER_VAL(fmod(a, b));
+            DISPATCH();
+        }
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (IS_INT(PEEK(0)) && AS_INT(PEEK(0)) != 0) {
+                PEEK(0) = intValue(-(int64_t)AS_INT(PEEK(0)));                // -0 is a double
+                DISPATCH();
             }
-            case OP_GET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
-                break;
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
             }
-            case OP_SET_UPVALUE: {
-                uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
-                break;
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT): {
+            printValue(POP());
+            writeOutput("\n", 1);
+            DISPATCH();
+        }  
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }   
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+          #ifdef JIT
+            // a loop that keeps going round makes its function hot as well, the machine code takes over at the loop's top
+            if (useJit && ++frame->closure->function->hotness >= JIT_HOTNESS) {
+                if (frame->closure->function->jit != NULL || jitCompile(frame->closure->function)) JIT_ENTER();
             }
-            case OP_GET_PROPERTY: {
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-          
-                ObjInstance* instance = AS_INSTANCE(peek(0));
-                ObjString* name = READ_STRING();
-        
-                Value value;
-                if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // Instance.
-                    push(value);
-                    break;
-                }
-
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+          #endif
+            DISPATCH();
+        } 
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SET_PROPERTY: {
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-          
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
-                Value value = pop();
-                pop();
-                push(value);
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        } 
+        // the callee takes over this frame: its closure and arguments slide down into the window the returning
+        // function had, so a chain of tail calls runs in constant stack space however long it gets
+        // anything but a closure (or a method bound to one) is called as usual, the OP_RETURN after it hands its result on
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!tailCallValue(PEEK(argCount), argCount)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GET_SUPER: {
-                ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
-        
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache, false)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount, cache, false)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                  double b = AS_NUMBER(pop());
-                  double a = AS_NUMBER(pop());
-                  push(NUMBER_VAL(a + b));
-                } else {
-                  runtimeError("Operands must be two numbers or two strings.");
-                  return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        // method calls in tail position, the same as OP_INVOKE and OP_SUPER_INVOKE but taking over the frame
+        CASE(OP_TAIL_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            STORE_FRAME();
+            if (!invoke(method, argCount, cache, true)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_DUP: push(peek(0)); break;
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;  
-            case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
-                break;
-            }  
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
-                break;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_SUPER_INVOKE): {
+            ObjString* method = READ_STRING();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            ObjClass* superclass = AS_CLASS(POP());
+            STORE_FRAME();
+            if (!invokeFromClass(superclass, method, argCount, cache, true)) {
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
-                break;
-            }   
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
-                break;
-            } 
-            case OP_CALL: {
-                int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
-            } 
-            case OP_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE): {
+            ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+            // a closure over nothing is the same whichever time it's made, so the function's one is shared by all of them
+            if (function->upvalueCount == 0) {
+                if (function->closure == NULL) {
+                    STORE_FRAME();
+                    function->closure = newClosure(function);
+                    writeBarrier((Obj*)function);
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                PUSH(OBJ_VAL(function->closure));
+                DISPATCH();
             }
-            case OP_SUPER_INVOKE: {
-                ObjString* method = READ_STRING();
-                int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+            STORE_FRAME();
+            ObjClosure* closure = newClosure(function);
+            PUSH(OBJ_VAL(closure));
+            vm->stackTop = stackTop; // captureUpvalue() allocates too, keep the new closure visible to the GC
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                if (isLocal) {
+                    closure->upvalues[i] = captureUpvalue(slots + index);
+                } else {
+                    closure->upvalues[i] = frame->closure->upvalues[index];
                 }
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+                writeBarrier((Obj*)closure);                // a minor collection inside captureUpvalue() can already have promoted the closure
             }
-            case OP_CLOSURE: {
-                ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-                ObjClosure* closure = newClosure(function);
-                push(OBJ_VAL(closure));
-                for (int i = 0; i < closure->upvalueCount; i++) {
-                    uint8_t isLocal = READ_BYTE();
-                    uint8_t index = READ_BYTE();
-                    if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
-                    } else {
-                        closure->upvalues[i] = frame->closure->upvalues[index];
-                    }
-                }
-                break;
-            } 
-            case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stack + vm.stackCount - 1);
-                pop();
-                break;                          
-            case OP_RETURN: {
-                Value result = pop();
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
-                }
-        
-                vm.stackCount = (int)(frame->slots - vm.stack);
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
-                break;
+            DISPATCH();
+        } 
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(stackTop - 1);
+            stackTop--;
+            DISPATCH();                          
+        CASE(OP_RETURN): {
+            // the bottom frame of a fiber, or of the script while other fibers still have work to do (see finishFiber())
+            if (vm->frameCount == 1 && (vm->fiber != vm->rootFiber || !loopIdle())) {
+                STORE_FRAME();
+                if (!finishFiber()) return INTERPRET_RUNTIME_ERROR;
+                LOAD_FRAME();
+                JIT_ENTER();
+                DISPATCH();
+            }
+            Value result = POP();
+            closeUpvalues(slots);
+            if (vm->profiler != NULL) profileReturn();
+            vm->frameCount--;
+            if (vm->frameCount == 0) {
+                vm->stackTop = slots;
+                return INTERPRET_OK;
             }
-            case OP_CLASS:
-                push(OBJ_VAL(newClass(READ_STRING())));
-                break; 
-            case OP_INHERIT: {
-                Value superclass = peek(1);
-                if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+    
+            // the callee's window (slot zero included) is dropped and the result takes slot zero's place
+            *slots = result;
+            vm->stackTop = slots + 1;
+            LOAD_FRAME();
+            JIT_ENTER();
+            DISPATCH();
+        }
+        // condition, then-value and else-value are all on the stack, keep the one the condition picks
+        CASE(OP_CLASS): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            ObjClass* klass = newClass(name);
+            PUSH(OBJ_VAL(klass));
+            DISPATCH();
+        }
+        CASE(OP_INHERIT): {
+            Value superclass = PEEK(1);
+            if (!IS_CLASS(superclass)) {
+                RUNTIME_ERROR("Superclass must be a class.");
+            }
+      
+            ObjClass* subclass = AS_CLASS(PEEK(0));
+            STORE_FRAME();
+            tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+            subclass->version++;
+            writeBarrier((Obj*)subclass);
+            stackTop--; // Subclass.
+            DISPATCH();
+        }
+        CASE(OP_METHOD): {
+            ObjString* name = READ_STRING();
+            STORE_FRAME();
+            defineMethod(name);
+            stackTop = vm->stackTop;
+            DISPATCH();
+        }
+        CASE(OP_BUILD_LIST): {
+            int count = READ_BYTE();
+            STORE_FRAME();
+            ObjList* list = newList();
+            PUSH(OBJ_VAL(list));
+            vm->stackTop = stackTop;             // sizing the array can collect, the new list is only safe on the stack
+            if (count > 0) {
+                list->items.values = GROW_ARRAY(Value, NULL, 0, count);
+                list->items.capacity = count;
+                memcpy(list->items.values, stackTop - 1 - count, sizeof(Value) * count);
+                list->items.count = count;
+                writeBarrier((Obj*)list);       // a minor collection while sizing it can have promoted the list
+            }
+            stackTop -= count + 1;
+            PUSH(OBJ_VAL(list));                // replaces the elements
+            DISPATCH();
+        }
+        CASE(OP_INDEX_GET): {
+            Value target = PEEK(1);
+            int slot;
+            if (IS_LIST(target)) {
+                CHECK_INDEX(PEEK(0), AS_LIST(target)->items.count, slot);
+                PEEK(1) = AS_LIST(target)->items.values[slot];      // replaces the list
+            } else if (IS_BUFFER(target)) {
+                CHECK_INDEX(PEEK(0), AS_BUFFER(target)->length, slot);
+                PEEK(1) = NUMBER_VAL(AS_BUFFER(target)->values[slot]);
+            } else {
+                RUNTIME_ERROR("Only lists and buffers can be indexed.");
+            }
+            stackTop--;
+            DISPATCH();
+        }
+        CASE(OP_INDEX_SET): {
+            Value target = PEEK(2);
+            Value value = PEEK(0);
+            int slot;
+            if (IS_LIST(target)) {
+                CHECK_INDEX(PEEK(1), AS_LIST(target)->items.count, slot);
+                AS_LIST(target)->items.values[slot] = value;
+                writeBarrierValue(AS_OBJ(target), value);
+            } else if (IS_BUFFER(target)) {
+                CHECK_INDEX(PEEK(1), AS_BUFFER(target)->length, slot);
+                if (!IS_NUMBER(value)) {
+                    RUNTIME_ERROR("Buffer elements must be numbers.");
                 }
-          
-                ObjClass* subclass = AS_CLASS(peek(0));
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop(); // Subclass.
-                break;
+                AS_BUFFER(target)->values[slot] = AS_NUMBER(value);
+            } else {
+                RUNTIME_ERROR("Only lists and buffers can be indexed.");
             }
-            case OP_METHOD:
-                defineMethod(READ_STRING());
-                break;
+            stackTop -= 2;
+            PEEK(0) = value;                        // replaces the list
+            DISPATCH();
+        }
+        // both kinds of table are looked up the same way, ip is past the opcode already
+        CASE(OP_SWITCH_INT):
+        CASE(OP_SWITCH_STRING): {
+            STORE_FRAME();
+            ip = switchTarget(ip - 1, PEEK(0));
+            DISPATCH();
+        }
+        // superinstructions from the peephole pass, each does exactly what the sequence it replaced did (errors included)
+        CASE(OP_ADD_LOCALS): {
+            Value a = slots[READ_BYTE()];
+            Value b = slots[READ_BYTE()];
+            if (LIKELY(ARE_INTS(a, b))) {
+                PUSH(intValue((int64_t)AS_INT(a) + AS_INT(b)));
+            } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+            } else if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) {
+                PUSH(a);
+                PUSH(b);
+                STORE_FRAME();
+                concatenate();
+                stackTop = vm->stackTop;
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            if (LIKELY(ARE_INTS(PEEK(0), constant))) {
+                PEEK(0) = intValue((int64_t)AS_INT(PEEK(0)) + AS_INT(constant));
+                DISPATCH();
+            }
+            double b = AS_NUMBER(constant);
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) + b);
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            if (LIKELY(ARE_INTS(PEEK(0), constant))) {
+                PEEK(0) = intValue((int64_t)AS_INT(PEEK(0)) - AS_INT(constant));
+                DISPATCH();
+            }
+            double b = AS_NUMBER(constant);
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");      // what the a + -b it replaced reports
+            }
+            PEEK(0) = NUMBER_VAL(AS_NUMBER(PEEK(0)) - b);
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_TRUE): {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS): {
+            uint16_t offset = READ_SHORT();
+            if (LIKELY(ARE_INTS(PEEK(0), PEEK(1)))) {
+                int32_t b = AS_INT(POP());
+                int32_t a = AS_INT(POP());
+                // two ways out instead of one after a conditional move of ip, which would hold the next dispatch up
+                // until the compare is done rather than letting the branch predictor run ahead
+                if (a < b) DISPATCH();
+                ip += offset;
+                DISPATCH();
+            }
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if (!(a < b)) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER): {
+            uint16_t offset = READ_SHORT();
+            if (LIKELY(ARE_INTS(PEEK(0), PEEK(1)))) {
+                int32_t b = AS_INT(POP());
+                int32_t a = AS_INT(POP());
+                if (a > b) DISPATCH();                      // same as above
+                ip += offset;
+                DISPATCH();
+            }
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            if (!(a > b)) ip += offset;
+            DISPATCH();
         }
     }
+
+    // only reachable from the switch fallback when it reads a byte that isn't an opcode
+    RUNTIME_ERROR("Unknown opcode.");
     
+    #undef STORE_FRAME
+    #undef LOAD_FRAME
     #undef READ_BYTE
     #undef READ_SHORT
     #undef READ_CONSTANT
     #undef READ_CONSTANT_LONG
     #undef READ_STRING
+    #undef READ_CACHE
+    #undef PUSH
+    #undef POP
+    #undef PEEK
+    #undef RUNTIME_ERROR
     #undef BINARY_OP
+    #undef CHECK_INDEX
+    #undef TRACE_INSTRUCTION
+    #undef INTERPRET_LOOP
+    #undef CASE
+    #undef DISPATCH
+    #undef JIT_ENTER
 }
 
 // create a new empty chunk and pass it over to the compiler,
 // which will fill it up with bytecode IF program does not have compile errors
 // then send completed chunk over to the VM to be executed, then free it
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
-    if (function == NULL) return INTERPRET_COMPILE_ERROR;
-  
+// wraps the compiled script in a closure and calls it from the first frame
+static InterpretResult runScript(ObjFunction* function) {
     push(OBJ_VAL(function));
     ObjClosure* closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
   
-    return run();
-}
\ No newline at end of file
+    return run(vm);
+}
+
+InterpretResult interpret(VM* isolate, const char* source) {
+    useVM(isolate);
+    ObjFunction* function = compile(source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return runScript(function);
+}
+
+// interpret() for a script read from path, reuses the compiled code cached next to it as long as it is up to date
+// and otherwise compiles as usual, then writes a new cache for the next run
+// (DEBUG_PRINT_CODE always compiles, the disassembly is printed by the compiler)
+// compiling lazily leaves the cache alone: most of the code isn't compiled yet when it would be written, and a cache
+// written before would compile all of it up front again
+InterpretResult interpretFile(VM* isolate, const char* path, const char* source) {
+    useVM(isolate);
+    if (vm->compileLazily) return interpret(isolate, source);
+    ObjFunction* function = vm->debug & DEBUG_PRINT_CODE ? NULL : loadCompiled(path, source);
+    if (function == NULL) {
+        function = compile(source);
+        if (function == NULL) return INTERPRET_COMPILE_ERROR;
+
+        push(OBJ_VAL(function));
+        saveCompiled(path, source, function);
+        pop();
+    }
+    return runScript(function);
+}
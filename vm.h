@@ -4,47 +4,158 @@
 
 // required for access to ObjFunction
 #include "object.h"
+// required for the output buffer
+#include "output.h"
 // required for hash-table implementation
 #include "table.h"
 // manages runtime values used in the VM
 #include "value.h"
 
-// redefining size for VM's value stack
-// to make sure we have plenty of stack slots even in very deep call trees
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// the call-frame array and the value stack start out this big and double whenever a call needs more
+// FRAMES_MAX and STACK_MAX only stop runaway recursion with "Stack overflow." before it eats all the memory, they can be
+// overridden with -D (the value stack never moves, its STACK_MAX slots are reserved address space, see newStack())
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL 1024
+#ifndef STACK_MAX
+#define STACK_MAX (16 * 1024 * 1024)
+#endif
+// a fiber's (see ObjFiber) start out smaller, room for a call or two, and are reserved smaller so there can be many
+#define FIBER_FRAMES_INITIAL 8
+#define FIBER_STACK_INITIAL 512
+#ifndef FIBER_STACK_MAX
+#define FIBER_STACK_MAX (1024 * 1024)
+#endif
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1024 * 1024)
+#endif
 
 // for functions (call-stack), represents single ongoing function call
 // Each time a function is called, we create one of these structs
-typedef struct {
+typedef struct CallFrame {
     ObjClosure* closure;                        // pointer to the function being called 
     uint8_t* ip;                                // the caller stores its own instruction pointer, so it acts like a return address (remember it points to current line to be executed)
     Value* slots;                               //  points into the VM’s value stack at the first slot that this function can use
 } CallFrame;
 
+// diagnostics that can be switched on when the VM starts (clox --trace etc., or the CLOX_DEBUG environment variable)
+// all the same binary: with none of them on, nothing in the interpreter loop or the GC's fast paths checks for them
+typedef enum {
+    DEBUG_PRINT_CODE      = 1 << 0,             // disassemble every function once it's compiled
+    DEBUG_TRACE_EXECUTION = 1 << 1,             // print the stack and the instruction before each one runs
+    DEBUG_STRESS_GC       = 1 << 2,             // collect as often as possible, useful for flushing out memory management bugs
+    DEBUG_LOG_GC          = 1 << 3              // log every allocation, mark, free and collection
+} DebugFlags;
+
+// where the current full collection is at, it advances a slice at a time as the program allocates
+typedef enum {
+    GC_IDLE,                                    // no full collection running, only minor ones
+    GC_MARKING,                                 // tracing the whole heap, minor collections wait until it's done
+    GC_SWEEPING                                 // marking is done, the dead old objects are being freed a slice at a time
+} GCPhase;
+
+// pause times are counted in buckets of powers of two: bucket i holds the pauses of less than 2^i microseconds that
+// the one before it didn't take, the last one everything longer (about half a second and up)
+#define GC_PAUSE_BUCKETS 20
+// how many of the latest full collections' nextGC settings are kept
+#define GC_HISTORY 16
+
+// what has been allocated and freed of one ObjType, the bytes are the objects' own blocks (a string's characters, an
+// instance's inline fields and a buffer's elements included) but not the arrays and tables they grow later
+typedef struct {
+    size_t allocated;                           // # of objects
+    size_t freed;
+    size_t bytesAllocated;
+    size_t bytesFreed;
+} GCTypeStats;
+
+// running totals of the GC's work since the VM started, clox --gc-stats prints them when the program ends
+// always kept (a few adds per allocation and per pause), embedders get a copy with readGCStats(), Lox programs gcStats()
+typedef struct {
+    size_t bytesAllocated;                      // every byte ever allocated (a growing reallocation counts what it grew by), unlike vm->bytesAllocated it never goes down
+    size_t bytesFreed;                          // same for every byte given back
+    int minorCollections;
+    int fullCollections;                        // full collections that ran to the end
+    int pauses;                                 // times the program was stopped for the GC: minor collections, slices and whole full collections
+    double pauseTotal;                          // seconds spent in all of those pauses (wall time)
+    double pauseMax;                            // longest single pause
+    int pauseBuckets[GC_PAUSE_BUCKETS];         // how many of them took how long, see GC_PAUSE_BUCKETS
+    size_t nextGCHistory[GC_HISTORY];           // nextGC after each of the last full collections, the one ending collection n at n % GC_HISTORY
+    GCTypeStats types[OBJ_TYPE_COUNT];          // indexed by ObjType, live objects are the allocated ones not freed yet
+
+    // not counters, how things stand right now, only filled in by readGCStats()
+    size_t heapBytes;                           // vm->bytesAllocated
+    size_t nextGC;
+    double heapGrowFactor;
+    int strings;                                // interned strings
+    int stringCapacity;                         // slots in the string table
+} GCStats;
+
 // A stack-based VM structure that takes in a chunk to run/execute
+// each one is an isolate: a heap, collector, globals and output of its own, nothing it holds is shared with another VM
+// so any number of them can run side by side, one thread per VM at a time (see useVM())
 // IP = instruction pointer
 // CallFrame array replaces the chunk and ip fields
 // Now each CallFrame has its own ip and its own pointer to the ObjFunction that it’s executing. From there, we can get to the function’s chunk.
 // Every closure maintains an array of upvalues, one for each surrounding local variable that the closure uses
-typedef struct {
-    CallFrame frames[FRAMES_MAX];               // array of CallFrame structs, treated like a stack like with the value array (call-stack)
+typedef struct VM {
+    CallFrame* frames;                          // array of CallFrame structs, treated like a stack like with the value array (call-stack)
     int frameCount;                             // stores current height of the CallFrame stack (# of ongoing function calls)
+    int frameCapacity;
 
-    Value* stack;                               // VM Dynamic Stack
-    int stackCount;                             // Current element count within VM stack
-    int stackCapacity;                          // Total capacity of VM stack
-    Table globals;                              // hash-table storing global variables
+    Value* stack;                               // VM value stack, at a fixed address (frame->slots and open upvalues point into it)
+    Value* stackTop;                            // points just past the last value in use (where the next push goes)
+    Value* stackEnd;                            // just past the last slot committed so far
+    Value* stackLimit;                          // just past the last slot it can ever grow to (STACK_MAX, FIBER_STACK_MAX)
+    ValueArray globalValues;                    // global variables, indexed by the slot the compiler resolved each name to (UNDEFINED_VAL until defined)
+    ValueArray globalNames;                     // name of the global in each slot, for "Undefined variable" errors and the disassembler
+    Table globalSlots;                          // global name -> its slot, only consulted by the compiler and defineNative
     Table strings;                              // hash-table storing unique strings (for string interning)
     ObjString* initString;                      // for initializer strings
+    ObjShape* emptyShape;                       // root of the shape tree, the shape every new instance starts out with
+    Table listMethods;                          // name of each built-in list method -> its index in vm.c's listMethods array
     ObjUpvalue* openUpvalues;                   // A linked list of "open" upvalues — variables that are captured by closures, but still live on the stack
+    ObjUpvalue** openUpvalueAt;                 // for every stack slot, the open upvalue pointing at it (NULL if there's none)
     
     size_t bytesAllocated;                      // tracks total # of bytes currently allocated by VM, used to monitor memory usage and trigger the GC
-    size_t nextGC;                              // when bytesAllocated > nextGC, GC is triggered (after GC, is updated to a higher threshold based on the current memory usage)
-    Obj* objects;                               // VM stores a pointer to the head of a linked list used to find every allocated object (to avoid memory leakage)
+    size_t nextGC;                              // a full collection starts once the old generation (bytesAllocated less youngBytes) passes this, at least nurserySize
+    double heapGrowFactor;                      // a full collection sets nextGC to the old generation it left times this, more than 1 (GC_HEAP_GROW_FACTOR unless changed)
+    size_t nurserySize;                         // a minor collection runs once youngBytes passes this
+    size_t sliceBytes;                          // bytes allocated since the last slice of the running collection
+    size_t sliceInterval;                       // a slice runs once sliceBytes passes this
+    int sliceWork;                              // objects a slice blackens (or sweeps) at most
+    Obj* objects;                               // VM stores a pointer to the head of a linked list used to find every allocated object (to avoid memory leakage), the old generation
+    Obj* youngObjects;                          // objects allocated since the last collection (the young generation), promoted to objects by surviving one
+    size_t youngBytes;                          // bytes of objects allocated into the young generation, a minor collection runs once this passes NURSERY_SIZE
+    int rememberedCount;                        // # of old objects in the remembered set
+    int rememberedCapacity;
+    Obj** remembered;                           // old objects that may point at young ones (filled by the write barriers), roots for a minor collection
+                                                // while marking: marked objects that were written to, traced again by the next slice
+    GCPhase gcPhase;                            // state of the incremental full collection
+    size_t cycleStartBytes;                     // heap size when the running full collection began, for the log
+    Obj* sweepObjects;                          // old objects the lazy sweep hasn't reached yet, the survivors go back onto objects
     int grayCount;                              // Tracks the number of objects in the gray stack during garbage collection
     int grayCapacity;                           // total capacity of the gray stack
     Obj** grayStack;                            // A dynamically allocated stack used during garbage collection (GC)
+    GCStats gcStats;                            // what the GC has done so far, for benchmarks (see bench/)
+    struct Pool* pool;                          // where small allocations come from (see memory.c), NULL without POOL_ALLOCATOR
+    struct Tracers* tracers;                    // threads helping with big traces, NULL until the first one (see memory.c)
+    struct Mapping* mappings;                   // .loxc files mapped in, the functions loaded from them use their code (see loxc.c)
+
+    char output[OUTPUT_BUFFER_SIZE];            // what the program printed that hasn't been written to stdout yet (see output.h)
+    int outputLength;                           // # of chars in it
+    int outputCapacity;                         // how many it may hold, 0 (write everything right away) while a diagnostic prints to stdout
+
+    ObjFiber* fiber;                            // the fiber running, the fields above from frames to openUpvalueAt are its (see ObjFiber)
+    ObjFiber* rootFiber;                        // the main fiber, the one the script runs on
+    struct EventLoop* loop;                     // fibers queued to run and waiting on timers and sockets, NULL until the first (see loop.h)
+    bool fiberSwitched;                         // a native just switched to another fiber, its result isn't pushed (see callValue())
+    bool fiberRetrying;                         // the scheduler is calling a woken fiber's I/O native again
+    bool fiberParked;                           // ...which had to wait once more
+
+    struct Profiler* profiler;                  // NULL unless the program is being profiled (see profiler.h)
+    int debug;                                  // DebugFlags switched on
+    bool compileLazily;                         // function bodies get compiled on their first call, not with the script (see compile())
+    bool jitEnabled;                            // hot functions get compiled to machine code (see jit.h), on unless clox --no-jit
 } VM;
 
 // The VM runs the chunk and then responds with a value from this enum:
@@ -54,14 +165,21 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR                     // runtime error (e.g., stack overflow, invalid operation)
 } InterpretResult;
 
-extern VM vm;                                   // exposes vm variable to other files as a global var
+// the VM the calling thread is running, everything in the interpreter works on this one
+// the entry points below bind it, so threads running VMs of their own never see each other's
+extern THREAD_LOCAL VM* vm;
 
 // Declare VM functions
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);      // Pass in a string of source code now
+VM* newVM(int debugFlags);              // debugFlags: the DebugFlags to switch on, the new VM is bound to the calling thread
+void freeVM(VM* isolate);
+void useVM(VM* isolate);                // binds isolate to the calling thread, which mustn't be running another VM right then
+void readGCStats(VM* isolate, GCStats* stats);                 // a copy of isolate's GC figures so far, from the thread running it
+InterpretResult interpret(VM* isolate, const char* source);    // Pass in a string of source code now
+InterpretResult interpretFile(VM* isolate, const char* path, const char* source);  // same for a script file, through its .loxc cache
+// the rest work on the VM bound to the calling thread
 void push(Value value);
 Value pop();
+int globalSlot(ObjString* name);                    // slot of a global name, claiming a fresh (undefined) one the first time the name is seen
 
 // end the Include guard
 #endif
\ No newline at end of file